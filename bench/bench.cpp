@@ -0,0 +1,1003 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <new>
+
+#include "BM_Disparity.h"
+#include "SIMD_Kernels.h"
+#include "OpenCL_Interface.h"
+
+using namespace std::chrono;
+using namespace std;
+
+/*
+ * Benchmark of the disparity engines on synthetic stereo pairs: no dataset
+ * is needed and every run sees the same images. Each configuration of the
+ * sweep (size x kernel size x max disparity x engine) runs warmup + N
+ * iterations and reports p50/p90/p99 latency and Mpixel-disparities/s.
+ *
+ * With --verify the raw disparities of every engine are compared with the
+ * reference (the generic naive engine, one thread), and every configuration
+ * also goes through verifyMatrix(): all the C++ variants with every SIMD
+ * instruction set, both costs and the LR check. The OpenCL engine is added
+ * to the default engines when there is a device. With --baseline the p50 of
+ * every configuration is compared with a previous --json run of the same
+ * SIMD instruction set, cost and threads (skipped otherwise). The exit
+ * status is a failure if an engine does not match or is slower than allowed.
+ * The matrix also counts the heap allocations of the process around repeated
+ * compute() calls: the frames after the first one must do none.
+ */
+
+struct BenchSize {
+    unsigned int width;
+    unsigned int height;
+};
+
+struct BenchResult {
+    std::string engine;
+    BenchSize size;
+    unsigned int kernel_size;
+    unsigned int max_d;
+    double p50;
+    double p90;
+    double p99;
+    double mean;
+    double mpds;
+    double accuracy;
+    unsigned long mismatches;   // pixels further than the tolerance from the reference (--verify)
+    unsigned int max_diff;
+    double baseline_p50;        // 0 when the baseline has no such configuration
+};
+
+/* Global Arguments */
+std::vector<BenchSize> sizes = {{640, 480}};
+std::vector<unsigned int> kernel_sizes = {3, 7, 11};
+std::vector<unsigned int> max_ds = {16, 64};
+std::vector<std::string> engines = {"naive", "box", "rolling"};
+bool engines_set = false; // --engines given, --verify does not add the OpenCL engine
+BM_Cost cost = BM_COST_SAD;
+SIMD_Isa simd_isa = SIMD_Dispatch::detect();
+unsigned int num_threads = 1;
+unsigned int warmup = 3;
+unsigned int iterations = 20;
+unsigned int seed = 1;
+const char* json_file = NULL;
+bool verify = false;
+unsigned int tolerance = 0;
+const char* baseline_file = NULL;
+double max_regression = 10;
+bool local_kernel = true;
+int device_index = -1; // OpenCL device of getDevices(), -1 for the default one
+
+/*
+ * Heap allocations of the process. With glibc every malloc() family call is
+ * counted (operator new included, it calls malloc()), elsewhere operator new.
+ */
+static std::atomic<unsigned long> heap_allocations(0);
+
+#ifdef __GLIBC__
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t num, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size) noexcept
+{
+    heap_allocations++;
+    *ptr = __libc_memalign(alignment, size);
+    return (*ptr != NULL) ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    heap_allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+}
+#else
+void* operator new(size_t size)
+{
+    heap_allocations++;
+    void* ptr = malloc((size > 0) ? size : 1);
+    if (ptr == NULL)
+        throw std::bad_alloc();
+
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+#endif
+
+// Frames after the first one of the heap check of verifyMatrix()
+#define BENCH_STEADY_FRAMES 3
+
+// NDRange of the OpenCL kernel, padded to the work-group size for every image size
+static size_t global_item_size[] = {640, 480, 1};
+static const size_t local_item_size[] = {20, 15, 1};
+
+// Rows of a band of the synthetic pair, all its pixels have the same disparity
+#define BENCH_BAND_HEIGHT 32
+
+void helper()
+{
+    cout << "Usage: bench [--sizes <WxH,...>] [--k <value,...>] [--max-d <value,...>] [--engines <naive|box|rolling|opencl,...>] [--cost <sad|census>] [--simd <scalar|sse4.1|avx2|avx512bw>] [--threads <value>] [--warmup <value>] [--iterations <value>] [--seed <value>] [--json <file>] [--verify] [--tolerance <value>] [--baseline <file>] [--max-regression <percent>] [--no-local-kernel] [--device <index>] [--list-devices]" << endl;
+
+    exit(EXIT_SUCCESS);
+}
+
+static std::vector<std::string> splitList(const char* list)
+{
+    std::vector<std::string> items;
+    std::string item;
+
+    for (const char* c = list; ; c++)
+    {
+        if ( (*c == ',') || (*c == '\0') )
+        {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+
+            if (*c == '\0')
+                break;
+        }
+        else
+            item += *c;
+    }
+
+    return items;
+}
+
+static std::vector<unsigned int> parseUIntList(const char* list)
+{
+    std::vector<std::string> items = splitList(list);
+    std::vector<unsigned int> values;
+
+    for (size_t k=0; k<items.size(); k++)
+        values.push_back((unsigned int) atoi(items[k].c_str()));
+
+    return values;
+}
+
+void parseArg(int argc, char** argv)
+{
+    for (int k = 1; k < argc; k++)
+    {
+        // every option but the flags takes a value
+        if ( (k + 1 >= argc) && strcmp(argv[k], "-h") && strcmp(argv[k], "--help") && strcmp(argv[k], "--verify")
+             && strcmp(argv[k], "--no-local-kernel") && strcmp(argv[k], "--list-devices") )
+        {
+            printf("[ERROR] Missing value of option = %s\n", argv[k]);
+            helper();
+        }
+
+        if (!strcmp(argv[k], "--sizes"))
+        {
+            sizes.clear();
+            std::vector<std::string> items = splitList(argv[++k]);
+            for (size_t s=0; s<items.size(); s++)
+            {
+                BenchSize size;
+                if ( (sscanf(items[s].c_str(), "%ux%u", &size.width, &size.height) != 2) || !size.width || !size.height )
+                {
+                    printf("[ERROR] Unrecognized size = %s\n", items[s].c_str());
+                    helper();
+                }
+                sizes.push_back(size);
+            }
+        }
+        else if (!(strcmp(argv[k], "-k")) || !(strcmp(argv[k], "--k")))
+            kernel_sizes = parseUIntList(argv[++k]);
+        else if (!strcmp(argv[k], "--max-d"))
+            max_ds = parseUIntList(argv[++k]);
+        else if (!strcmp(argv[k], "--engines"))
+        {
+            engines = splitList(argv[++k]);
+            engines_set = true;
+        }
+        else if (!strcmp(argv[k], "--cost"))
+        {
+            if (!BM_Disparity::parseCost(argv[++k], cost))
+            {
+                printf("[ERROR] Unrecognized matching cost = %s\n", argv[k]);
+                helper();
+            }
+        }
+        else if (!strcmp(argv[k], "--device"))
+            device_index = atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--list-devices"))
+        {
+            OpenCL_Interface::showDevices();
+            exit(EXIT_SUCCESS);
+        }
+        else if (!strcmp(argv[k], "--no-local-kernel"))
+            local_kernel = false;
+        else if (!strcmp(argv[k], "--simd"))
+        {
+            if (!SIMD_Dispatch::parseIsa(argv[++k], simd_isa))
+            {
+                printf("[ERROR] Unrecognized SIMD instruction set = %s\n", argv[k]);
+                helper();
+            }
+        }
+        else if (!strcmp(argv[k], "--threads"))
+            num_threads = (unsigned int) atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--warmup"))
+            warmup = (unsigned int) atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--iterations"))
+            iterations = (unsigned int) atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--seed"))
+            seed = (unsigned int) atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--json"))
+            json_file = argv[++k];
+        else if (!strcmp(argv[k], "--verify"))
+            verify = true;
+        else if (!strcmp(argv[k], "--tolerance"))
+            tolerance = (unsigned int) atoi(argv[++k]);
+        else if (!strcmp(argv[k], "--baseline"))
+            baseline_file = argv[++k];
+        else if (!strcmp(argv[k], "--max-regression"))
+            max_regression = atof(argv[++k]);
+        else if (!(strcmp(argv[k], "-h")) || !(strcmp(argv[k], "--help")))
+            helper();
+        else
+        {
+            printf("[ERROR] Unrecognized option = %s\n", argv[k]);
+            helper();
+        }
+    }
+
+    for (size_t e=0; e<engines.size(); e++)
+    {
+        BM_Engine engine;
+        if ( (engines[e] != "opencl") && !BM_Disparity::parseEngine(engines[e].c_str(), engine) )
+        {
+            printf("[ERROR] Unrecognized engine = %s\n", engines[e].c_str());
+            helper();
+        }
+    }
+
+    if (iterations == 0)
+        iterations = 1;
+}
+
+/*
+ * Synthetic stereo pair: a random texture seen with a known disparity that
+ * changes every BENCH_BAND_HEIGHT rows (right(x) = left(x + d)), so the
+ * result of an engine can be checked against the truth.
+ */
+static void makeStereoPair(unsigned int width, unsigned int height, unsigned int max_d, unsigned int seed,
+                           std::vector<unsigned char>& left, std::vector<unsigned char>& right)
+{
+    left.resize(width*height);
+    right.resize(width*height);
+
+    // LCG, the same pair on every machine
+    unsigned int state = seed*2654435761u + 1;
+    for (size_t k=0; k<left.size(); k++)
+    {
+        state = state*1664525u + 1013904223u;
+        left[k] = (unsigned char) (state >> 24);
+    }
+
+    for (unsigned int i=0; i<height; i++)
+    {
+        unsigned int d = (i/BENCH_BAND_HEIGHT*7 + 3) % max_d;
+        for (unsigned int j=0; j<width; j++)
+        {
+            if (j + d < width)
+                right[i*width + j] = left[i*width + j + d];
+            else
+            {
+                state = state*1664525u + 1013904223u;
+                right[i*width + j] = (unsigned char) (state >> 24);
+            }
+        }
+    }
+}
+
+/*
+ * Pixels with the disparity of their band, among the ones whose window is
+ * inside the band and whose match is inside the image
+ */
+static double accuracy(const unsigned int* disp, unsigned int width, unsigned int height, unsigned int max_d, unsigned int kernel_size)
+{
+    unsigned int half = kernel_size/2;
+    unsigned long checked = 0;
+    unsigned long correct = 0;
+
+    for (unsigned int i=half; i+half<height; i++)
+    {
+        if ( ((i - half)/BENCH_BAND_HEIGHT) != ((i + half)/BENCH_BAND_HEIGHT) )
+            continue;
+
+        unsigned int d = (i/BENCH_BAND_HEIGHT*7 + 3) % max_d;
+        for (unsigned int j=half+d; j+half<width; j++)
+        {
+            checked++;
+            if (disp[i*width + j] == d)
+                correct++;
+        }
+    }
+
+    return checked ? (100.0*correct)/checked : 0;
+}
+
+// Nearest-rank percentile of sorted latencies
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    size_t rank = (size_t) ceil(p/100.0*sorted.size());
+    if (rank == 0)
+        rank = 1;
+
+    return sorted[rank - 1];
+}
+
+static void summarize(BenchResult& result, std::vector<double>& times)
+{
+    std::sort(times.begin(), times.end());
+
+    double sum = 0;
+    for (size_t k=0; k<times.size(); k++)
+        sum += times[k];
+
+    result.p50 = percentile(times, 50);
+    result.p90 = percentile(times, 90);
+    result.p99 = percentile(times, 99);
+    result.mean = sum/times.size();
+    result.mpds = (double) result.size.width*result.size.height*result.max_d/(result.p50*1e-3)*1e-6;
+}
+
+static void benchCpp(BM_Engine engine, const std::vector<unsigned char>& left, const std::vector<unsigned char>& right,
+                     BenchResult& result, std::vector<unsigned int>& disp)
+{
+    unsigned int width = result.size.width;
+    unsigned int height = result.size.height;
+    disp.assign(width*height, 0);
+    std::vector<double> times;
+
+    BM_Disparity disparity(width, height, result.max_d, result.kernel_size);
+    disparity.setEngine(engine);
+    disparity.setCost(cost);
+    disparity.setNumThreads(num_threads);
+
+    for (unsigned int it=0; it<warmup+iterations; it++)
+    {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        disparity.compute(left.data(), right.data(), disp.data(), NULL);
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+
+        if (it >= warmup)
+            times.push_back(duration_cast<nanoseconds>(t2 - t1).count()*1e-6);
+    }
+
+    result.accuracy = accuracy(disp.data(), width, height, result.max_d, result.kernel_size);
+    summarize(result, times);
+}
+
+// Build options of the OpenCL variant of a configuration, as the application
+static std::string openclOptions(unsigned int kernel_size, unsigned int max_d, unsigned int width)
+{
+    char options[128];
+    sprintf(options, "-DKERNEL=%u -DMAX_D=%u -DWIDTH=%u", kernel_size, max_d, width);
+    if (local_kernel)
+        sprintf(options + strlen(options), " -DTILE_W=%zu -DTILE_H=%zu", local_item_size[0], local_item_size[1]);
+
+    return options;
+}
+
+// Local memory of a work-group of BM_Disparity_Local, as the application
+static size_t localKernelBytes(unsigned int kernel_size, unsigned int max_d)
+{
+    size_t half = kernel_size/2;
+    size_t strip_height = local_item_size[1] + 2*half;
+    size_t left_width = local_item_size[0] + 2*half;
+
+    return strip_height*(left_width + left_width + max_d - 1);
+}
+
+/*
+ * End-to-end OpenCL frame: upload of the pair, kernels and readback of the
+ * disparity, as the synchronous path of the application. The variant of the
+ * configuration is built the first time (outside of the timed frames).
+ */
+static void benchOpenCL(OpenCL_Interface& openCL, const std::vector<unsigned char>& left, const std::vector<unsigned char>& right,
+                        BenchResult& result, std::vector<unsigned int>& disp)
+{
+    unsigned int width = result.size.width;
+    unsigned int height = result.size.height;
+    disp.assign(width*height, 0);
+    std::vector<double> times;
+
+    cl_mem left_memobj = NULL;
+    cl_mem right_memobj = NULL;
+    cl_mem disp_memobj = NULL;
+    cl_mem census_left_memobj = NULL;
+    cl_mem census_right_memobj = NULL;
+    cl_kernel census_kernel = NULL;
+
+    openCL.selectProgram(openclOptions(result.kernel_size, result.max_d, width));
+
+    openCL.setMemoryBuffer<unsigned char>(left_memobj, width*height, CL_MEM_READ_ONLY);
+    openCL.setMemoryBuffer<unsigned char>(right_memobj, width*height, CL_MEM_READ_ONLY);
+    openCL.setMemoryBuffer<unsigned int>(disp_memobj, width*height, CL_MEM_WRITE_ONLY);
+
+    if (cost == BM_COST_CENSUS)
+    {
+        openCL.setMemoryBuffer<cl_ulong>(census_left_memobj, width*height, CL_MEM_READ_WRITE);
+        openCL.setMemoryBuffer<cl_ulong>(census_right_memobj, width*height, CL_MEM_READ_WRITE);
+
+        census_kernel = openCL.createKernel("Census_Transform");
+        openCL.setKernelArgs(census_kernel, left_memobj, 0);
+        openCL.setKernelArgs(census_kernel, right_memobj, 1);
+        openCL.setKernelArgs(census_kernel, census_left_memobj, 2);
+        openCL.setKernelArgs(census_kernel, census_right_memobj, 3);
+        openCL.setKernelArgs(census_kernel, width, 4);
+        openCL.setKernelArgs(census_kernel, height, 5);
+
+        openCL.setKernelArgs(census_left_memobj, 0);
+        openCL.setKernelArgs(census_right_memobj, 1);
+    }
+    else
+    {
+        openCL.setKernelArgs(left_memobj, 0);
+        openCL.setKernelArgs(right_memobj, 1);
+    }
+    openCL.setKernelArgs(disp_memobj, 2);
+    openCL.setKernelArgs(result.max_d, 3);
+    openCL.setKernelArgs(width, 4);
+    openCL.setKernelArgs(height, 5);
+
+    global_item_size[0] = ((width + local_item_size[0] - 1)/local_item_size[0])*local_item_size[0];
+    global_item_size[1] = ((height + local_item_size[1] - 1)/local_item_size[1])*local_item_size[1];
+
+    for (unsigned int it=0; it<warmup+iterations; it++)
+    {
+        high_resolution_clock::time_point t1 = high_resolution_clock::now();
+        openCL.enqueueWriteBuffer(left_memobj, left.data(), width*height, CL_TRUE);
+        openCL.enqueueWriteBuffer(right_memobj, right.data(), width*height, CL_TRUE);
+        if (census_kernel != NULL)
+            openCL.enqueueKernel(census_kernel);
+        openCL.run(disp_memobj, disp.data(), width*height, CL_TRUE);
+        high_resolution_clock::time_point t2 = high_resolution_clock::now();
+
+        if (it >= warmup)
+            times.push_back(duration_cast<nanoseconds>(t2 - t1).count()*1e-6);
+    }
+
+    if (census_kernel != NULL)
+    {
+        openCL.freeKernel(census_kernel);
+        openCL.freeOpenCLMemory(census_left_memobj);
+        openCL.freeOpenCLMemory(census_right_memobj);
+    }
+    openCL.freeOpenCLMemory(left_memobj);
+    openCL.freeOpenCLMemory(right_memobj);
+    openCL.freeOpenCLMemory(disp_memobj);
+
+    result.accuracy = accuracy(disp.data(), width, height, result.max_d, result.kernel_size);
+    summarize(result, times);
+}
+
+/*
+ * Golden reference of a configuration: the naive engine without the
+ * compile-time instantiations, in a single thread
+ */
+static void computeReference(const std::vector<unsigned char>& left, const std::vector<unsigned char>& right,
+                             const BenchResult& config, BM_Cost reference_cost, bool lr_check, std::vector<unsigned int>& disp)
+{
+    BM_Disparity disparity(config.size.width, config.size.height, config.max_d, config.kernel_size);
+    disparity.setEngine(BM_ENGINE_NAIVE);
+    disparity.setSpecialized(false);
+    disparity.setCost(reference_cost);
+    disparity.setLRCheck(lr_check);
+    disparity.setNumThreads(1);
+
+    disp.assign(config.size.width*config.size.height, 0);
+    disparity.compute(left.data(), right.data(), disp.data(), NULL);
+}
+
+/*
+ * Pixels of disp further than the tolerance from the reference. Only the
+ * pixels with a full window are compared, the OpenCL kernels do not write
+ * the border.
+ */
+static void compareReference(const std::vector<unsigned int>& disp, const std::vector<unsigned int>& reference, BenchResult& result)
+{
+    unsigned int width = result.size.width;
+    unsigned int height = result.size.height;
+    unsigned int half = result.kernel_size/2;
+
+    result.mismatches = 0;
+    result.max_diff = 0;
+    for (unsigned int i=half; i+half<height; i++)
+    {
+        for (unsigned int j=half; j+half<width; j++)
+        {
+            unsigned int a = disp[i*width + j];
+            unsigned int b = reference[i*width + j];
+            unsigned int diff = (a > b) ? (a - b) : (b - a);
+
+            if (diff > result.max_diff)
+                result.max_diff = diff;
+            if (diff > tolerance)
+                result.mismatches++;
+        }
+    }
+}
+
+// C++ variant checked by verifyMatrix()
+struct VerifyVariant {
+    const char* name;
+    BM_Engine engine;
+    bool specialized;
+};
+
+static const VerifyVariant verify_variants[] = {
+    {"naive", BM_ENGINE_NAIVE, true},
+    {"naive/generic", BM_ENGINE_NAIVE, false},
+    {"box", BM_ENGINE_BOXFILTER, true},
+    {"rolling", BM_ENGINE_ROLLING, true}
+};
+
+/*
+ * Correctness sweep of --verify, not timed: every variant of
+ * verify_variants with every SIMD instruction set of the CPU, both matching
+ * costs and with and without the LR check, against the reference of the same
+ * cost and LR check. The threads split the image in bands, so at least two
+ * are used. Every variant then computes BENCH_STEADY_FRAMES more frames,
+ * which must not allocate (heap_allocations). Returns the failing
+ * combinations, checks counts them all.
+ */
+static unsigned int verifyMatrix(const std::vector<unsigned char>& left, const std::vector<unsigned char>& right,
+                                 const BenchResult& config, unsigned int& checks)
+{
+    static const BM_Cost costs[] = {BM_COST_SAD, BM_COST_CENSUS};
+    unsigned int width = config.size.width;
+    unsigned int height = config.size.height;
+    unsigned int threads = std::max(num_threads, 2u);
+    unsigned int failed = 0;
+    std::vector<unsigned int> disp, reference;
+
+    for (size_t c=0; c<sizeof(costs)/sizeof(costs[0]); c++)
+    {
+        for (int lr_check=0; lr_check<2; lr_check++)
+        {
+            computeReference(left, right, config, costs[c], lr_check != 0, reference);
+
+            for (int isa=SIMD_ISA_SCALAR; isa<=(int) SIMD_Dispatch::detect(); isa++)
+            {
+                SIMD_Dispatch::select((SIMD_Isa) isa);
+
+                for (size_t v=0; v<sizeof(verify_variants)/sizeof(verify_variants[0]); v++)
+                {
+                    const VerifyVariant& variant = verify_variants[v];
+
+                    BM_Disparity disparity(width, height, config.max_d, config.kernel_size);
+                    disparity.setEngine(variant.engine);
+                    disparity.setSpecialized(variant.specialized);
+                    disparity.setCost(costs[c]);
+                    disparity.setLRCheck(lr_check != 0);
+                    disparity.setNumThreads(threads);
+
+                    disp.assign(width*height, 0);
+                    disparity.compute(left.data(), right.data(), disp.data(), NULL);
+
+                    // the workspace and the threads are set up by the first frame, the next ones reuse them
+                    unsigned long allocations = heap_allocations.load();
+                    for (unsigned int f=0; f<BENCH_STEADY_FRAMES; f++)
+                        disparity.compute(left.data(), right.data(), disp.data(), NULL);
+                    allocations = heap_allocations.load() - allocations;
+
+                    BenchResult result = config;
+                    compareReference(disp, reference, result);
+                    checks++;
+
+                    if (result.mismatches > 0)
+                    {
+                        printf("  [ERROR - MISMATCH] %s %s %s%s: %lu px, max diff %u\n", variant.name,
+                               SIMD_Dispatch::getIsaName((SIMD_Isa) isa), BM_Disparity::getCostName(costs[c]),
+                               lr_check ? " lr" : "", result.mismatches, result.max_diff);
+                        failed++;
+                    }
+                    else if (allocations > 0)
+                    {
+                        printf("  [ERROR - HEAP] %s %s %s%s: %lu allocations in %u steady-state frames\n", variant.name,
+                               SIMD_Dispatch::getIsaName((SIMD_Isa) isa), BM_Disparity::getCostName(costs[c]),
+                               lr_check ? " lr" : "", allocations, BENCH_STEADY_FRAMES);
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    SIMD_Dispatch::select(simd_isa);
+
+    return failed;
+}
+
+// Value of "key": in a line of the JSON written by writeJson()
+static bool jsonField(const std::string& line, const char* key, std::string& value)
+{
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos)
+        return false;
+
+    pos += pattern.size();
+    if (line[pos] == '"')
+    {
+        size_t end = line.find('"', pos + 1);
+        value = line.substr(pos + 1, end - pos - 1);
+    }
+    else
+    {
+        size_t end = line.find_first_of(",}", pos);
+        value = line.substr(pos, end - pos);
+    }
+
+    return true;
+}
+
+/*
+ * Results of a previous --json run, one configuration per line, and the
+ * SIMD instruction set, matching cost and threads of its header
+ */
+static std::vector<BenchResult> readBaseline(const char* file, std::string& simd, std::string& cost_name, unsigned int& threads)
+{
+    std::vector<BenchResult> baseline;
+
+    FILE* fp = fopen(file, "r");
+    if (!fp)
+    {
+        printf("[ERROR] Failed to read baseline %s\n", file);
+        exit(EXIT_FAILURE);
+    }
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), fp))
+    {
+        std::string line(buffer);
+        std::string engine, width, height, kernel_size, max_d, p50, value;
+
+        if (jsonField(line, "simd", value))
+            simd = value;
+        if (jsonField(line, "cost", value))
+            cost_name = value;
+        if (jsonField(line, "threads", value))
+            threads = (unsigned int) atoi(value.c_str());
+
+        if (!jsonField(line, "engine", engine) || !jsonField(line, "width", width) || !jsonField(line, "height", height) ||
+            !jsonField(line, "kernel_size", kernel_size) || !jsonField(line, "max_d", max_d) || !jsonField(line, "p50_ms", p50))
+            continue;
+
+        BenchResult result;
+        result.engine = engine;
+        result.size.width = (unsigned int) atoi(width.c_str());
+        result.size.height = (unsigned int) atoi(height.c_str());
+        result.kernel_size = (unsigned int) atoi(kernel_size.c_str());
+        result.max_d = (unsigned int) atoi(max_d.c_str());
+        result.p50 = atof(p50.c_str());
+        baseline.push_back(result);
+    }
+    fclose(fp);
+
+    return baseline;
+}
+
+static double findBaseline(const std::vector<BenchResult>& baseline, const BenchResult& result)
+{
+    for (size_t k=0; k<baseline.size(); k++)
+    {
+        const BenchResult& b = baseline[k];
+        if ( (b.engine == result.engine) && (b.size.width == result.size.width) && (b.size.height == result.size.height) &&
+             (b.kernel_size == result.kernel_size) && (b.max_d == result.max_d) )
+            return b.p50;
+    }
+
+    return 0;
+}
+
+static void writeJson(const char* file, const std::vector<BenchResult>& results)
+{
+    FILE* fp = fopen(file, "w");
+    if (!fp)
+    {
+        printf("[ERROR] Failed to write %s\n", file);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"simd\": \"%s\",\n", SIMD_Dispatch::getIsaName(SIMD_Dispatch::getIsa()));
+    fprintf(fp, "  \"cost\": \"%s\",\n", BM_Disparity::getCostName(cost));
+    fprintf(fp, "  \"threads\": %u,\n", num_threads);
+    fprintf(fp, "  \"warmup\": %u,\n", warmup);
+    fprintf(fp, "  \"iterations\": %u,\n", iterations);
+    fprintf(fp, "  \"seed\": %u,\n", seed);
+    fprintf(fp, "  \"results\": [\n");
+    for (size_t k=0; k<results.size(); k++)
+    {
+        const BenchResult& r = results[k];
+        fprintf(fp, "    {\"engine\": \"%s\", \"width\": %u, \"height\": %u, \"kernel_size\": %u, \"max_d\": %u, "
+                    "\"p50_ms\": %.4f, \"p90_ms\": %.4f, \"p99_ms\": %.4f, \"mean_ms\": %.4f, "
+                    "\"mpixel_disparities_per_s\": %.2f, \"accuracy\": %.2f",
+                r.engine.c_str(), r.size.width, r.size.height, r.kernel_size, r.max_d,
+                r.p50, r.p90, r.p99, r.mean, r.mpds, r.accuracy);
+        if (verify)
+            fprintf(fp, ", \"mismatches\": %lu, \"max_diff\": %u", r.mismatches, r.max_diff);
+        fprintf(fp, "}%s\n", (k + 1 < results.size()) ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+
+    fclose(fp);
+}
+
+int main(int argc, char** argv)
+{
+    parseArg(argc, argv);
+
+    if (SIMD_Dispatch::select(simd_isa) != simd_isa)
+        printf("[WARNING] SIMD instruction set '%s' not supported by this CPU\n", SIMD_Dispatch::getIsaName(simd_isa));
+
+    // the default verify run covers the OpenCL engine too when there is a device
+    if (verify && !engines_set && !OpenCL_Interface::getDevices().empty())
+        engines.push_back("opencl");
+
+    bool use_opencl = (std::find(engines.begin(), engines.end(), "opencl") != engines.end());
+
+    // The interface builds its program when it is created, only do it if an OpenCL engine is benchmarked
+    OpenCL_Interface* openCL = NULL;
+    if (use_opencl)
+    {
+        OpenCL_Interface::setNDRange(2, global_item_size, local_item_size);
+        #ifndef FPGA_OCL
+        if (cost == BM_COST_CENSUS)
+        {
+            local_kernel = false;
+            OpenCL_Interface::setKernelSource("./kernel/BM_Census-GPU.cl", "BM_Census");
+            OpenCL_Interface::setCpuKernelSource("", "");
+        }
+        else if (local_kernel)
+        {
+            // one program for every configuration, so the strips of the largest one must fit
+            size_t bytes = localKernelBytes(*std::max_element(kernel_sizes.begin(), kernel_sizes.end()),
+                                            *std::max_element(max_ds.begin(), max_ds.end()));
+            std::vector<OpenCL_Device> devices = OpenCL_Interface::getDevices();
+            int index = (device_index < 0) ? OpenCL_Interface::getDefaultDevice(devices) : device_index;
+            local_kernel = (index < (int) devices.size()) && (devices[index].local_mem_size >= bytes);
+            if (local_kernel)
+                OpenCL_Interface::setKernelSource("./kernel/BM_Disparity_Local-GPU.cl", "BM_Disparity_Local");
+        }
+        OpenCL_Interface::setBuildOptions(openclOptions(kernel_sizes[0], max_ds[0], sizes[0].width));
+
+        // the row kernel of the CPU devices keeps a row of costs in private memory
+        std::vector<OpenCL_Device> devices = OpenCL_Interface::getDevices();
+        int index = (device_index < 0) ? OpenCL_Interface::getDefaultDevice(devices) : device_index;
+        for (size_t s=0; s<sizes.size(); s++)
+        {
+            if ( (index < (int) devices.size()) && OpenCL_Interface::usesRowKernel(devices[index]) && (sizes[s].width > ROW_KERNEL_MAX_WIDTH) )
+            {
+                printf("[ERROR] Size %ux%u, the OpenCL row kernel of the CPU devices takes images up to %u pixels wide\n",
+                       sizes[s].width, sizes[s].height, ROW_KERNEL_MAX_WIDTH);
+                exit(EXIT_FAILURE);
+            }
+        }
+        #endif
+        // an index out of range is reported with the list of devices by the interface
+        openCL = new OpenCL_Interface(device_index);
+        openCL->m_use_opencl_events = false;
+    }
+
+    cout << "-------- BENCH -------- " << endl;
+    cout << "> Matching Cost: " << BM_Disparity::getCostName(cost) << endl;
+    cout << "> SIMD: " << SIMD_Dispatch::getIsaName(SIMD_Dispatch::getIsa()) << endl;
+    if (use_opencl)
+    {
+        cout << "> OpenCL Device: " << openCL->getDeviceIndex() << " (" << openCL->getDeviceName() << ")" << endl;
+        cout << "> OpenCL Kernel: " << (openCL->isRowKernel() ? "rows (CPU device)" : (local_kernel ? "local memory tiles" : "global memory")) << endl;
+    }
+    cout << "> C++ Threads: " << num_threads << endl;
+    cout << "> Warmup / Iterations: " << warmup << " / " << iterations << endl;
+    cout << "----------------------- " << endl;
+    printf("%-8s %11s %3s %6s %9s %9s %9s %10s %8s\n", "engine", "size", "k", "max-d", "p50(ms)", "p90(ms)", "p99(ms)", "Mpd/s", "acc(%)");
+
+    // the times only compare on the same setup, a baseline of another one is not a regression gate
+    std::vector<BenchResult> baseline;
+    if (baseline_file != NULL)
+    {
+        std::string baseline_simd, baseline_cost;
+        unsigned int baseline_threads = 0;
+        baseline = readBaseline(baseline_file, baseline_simd, baseline_cost, baseline_threads);
+
+        if ( (baseline_simd != SIMD_Dispatch::getIsaName(SIMD_Dispatch::getIsa())) || (baseline_cost != BM_Disparity::getCostName(cost)) ||
+             (baseline_threads != num_threads) )
+        {
+            printf("[WARNING] Baseline %s is of %s / %s / %u threads, this run %s / %s / %u threads: regression gate skipped\n",
+                   baseline_file, baseline_simd.c_str(), baseline_cost.c_str(), baseline_threads,
+                   SIMD_Dispatch::getIsaName(SIMD_Dispatch::getIsa()), BM_Disparity::getCostName(cost), num_threads);
+            baseline.clear();
+            baseline_file = NULL;
+        }
+    }
+
+    std::vector<BenchResult> results;
+    std::vector<unsigned char> left, right;
+    std::vector<unsigned int> disp, reference;
+    unsigned int failed_verify = 0;
+    unsigned int failed_matrix = 0;
+    unsigned int matrix_checks = 0;
+    unsigned int failed_regression = 0;
+
+    for (size_t s=0; s<sizes.size(); s++)
+    {
+        for (size_t d=0; d<max_ds.size(); d++)
+        {
+            makeStereoPair(sizes[s].width, sizes[s].height, max_ds[d], seed, left, right);
+
+            for (size_t k=0; k<kernel_sizes.size(); k++)
+            {
+                bool has_reference = false;
+
+                for (size_t e=0; e<engines.size(); e++)
+                {
+                    BenchResult result;
+                    result.engine = engines[e];
+                    result.size = sizes[s];
+                    result.kernel_size = kernel_sizes[k];
+                    result.max_d = max_ds[d];
+                    result.mismatches = 0;
+                    result.max_diff = 0;
+
+                    if ( (result.size.width < result.kernel_size) || (result.size.height < result.kernel_size) )
+                        continue;
+
+                    // the reference is the same for every engine of the configuration
+                    if (verify && !has_reference)
+                    {
+                        computeReference(left, right, result, cost, false, reference);
+                        has_reference = true;
+                    }
+
+                    if (engines[e] == "opencl")
+                        benchOpenCL(*openCL, left, right, result, disp);
+                    else
+                    {
+                        BM_Engine engine;
+                        BM_Disparity::parseEngine(engines[e].c_str(), engine);
+                        benchCpp(engine, left, right, result, disp);
+                    }
+
+                    char size[32];
+                    sprintf(size, "%ux%u", result.size.width, result.size.height);
+                    printf("%-8s %11s %3u %6u %9.3f %9.3f %9.3f %10.1f %8.2f", result.engine.c_str(), size, result.kernel_size,
+                           result.max_d, result.p50, result.p90, result.p99, result.mpds, result.accuracy);
+
+                    if (verify)
+                    {
+                        compareReference(disp, reference, result);
+                        if (result.mismatches > 0)
+                        {
+                            printf("  [ERROR - MISMATCH] %lu px, max diff %u", result.mismatches, result.max_diff);
+                            failed_verify++;
+                        }
+                        else
+                            printf("  [OK - MATCH]");
+                    }
+
+                    result.baseline_p50 = findBaseline(baseline, result);
+                    if (result.baseline_p50 > 0)
+                    {
+                        double change = (result.p50/result.baseline_p50 - 1)*100;
+                        printf("  %+.1f%%", change);
+                        if (change > max_regression)
+                        {
+                            printf(" [ERROR - REGRESSION]");
+                            failed_regression++;
+                        }
+                    }
+                    printf("\n");
+
+                    results.push_back(result);
+                }
+
+                if ( verify && (sizes[s].width >= kernel_sizes[k]) && (sizes[s].height >= kernel_sizes[k]) )
+                {
+                    BenchResult config;
+                    config.size = sizes[s];
+                    config.kernel_size = kernel_sizes[k];
+                    config.max_d = max_ds[d];
+
+                    unsigned int checks = 0;
+                    unsigned int failed = verifyMatrix(left, right, config, checks);
+
+                    char size[32];
+                    sprintf(size, "%ux%u", config.size.width, config.size.height);
+                    printf("%-8s %11s %3u %6u %9u checks", "matrix", size, config.kernel_size, config.max_d, checks);
+                    if (failed > 0)
+                        printf("  [ERROR - MISMATCH] %u variants\n", failed);
+                    else
+                        printf("  [OK - MATCH]\n");
+
+                    matrix_checks += checks;
+                    failed_matrix += failed;
+                }
+            }
+        }
+    }
+
+    if (use_opencl)
+        delete openCL;
+
+    if (json_file != NULL)
+    {
+        writeJson(json_file, results);
+        printf("> JSON: %s\n", json_file);
+    }
+
+    if (verify)
+    {
+        printf("> Verify (tolerance %u): %zu configurations, %u mismatching\n", tolerance, results.size(), failed_verify);
+        printf("> Verify matrix (SIMD x variants x costs x LR check, no heap allocation per frame): %u checks, %u failing\n",
+               matrix_checks, failed_matrix);
+    }
+    if (baseline_file != NULL)
+        printf("> Baseline %s (max regression %.1f%%): %u slower\n", baseline_file, max_regression, failed_regression);
+
+    if (failed_verify || failed_matrix || failed_regression)
+        return EXIT_FAILURE;
+
+    return 0;
+}
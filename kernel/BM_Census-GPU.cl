@@ -0,0 +1,103 @@
+// Window, disparity range and image width are given by the host as build options (-DKERNEL=7 -DMAX_D=16 -DWIDTH=640),
+// so the loops have constant bounds. Without them the range and the width are the kernel arguments.
+#ifndef KERNEL
+#define KERNEL 7
+#endif
+#define HALF_KERNEL KERNEL/2
+
+#ifdef MAX_D
+#define D_RANGE MAX_D
+#else
+#define D_RANGE max_d
+#endif
+
+#ifdef WIDTH
+#define IM_WIDTH WIDTH
+#else
+#define IM_WIDTH width
+#endif
+
+// type of the disparity map, uchar or ushort when the map is normalized on the device (-DDISP_TYPE=uchar)
+#ifndef DISP_TYPE
+#define DISP_TYPE unsigned int
+#endif
+
+// stride of the samples of the census window (2*HALF_KERNEL + 1 wide): at most 8 per axis, so the descriptor fits in
+// 64 bits. The same as BM_Disparity::censusTransform()
+#define CENSUS_STRIDE ((2*(HALF_KERNEL) + 8)/8)
+
+/*
+ * Census descriptor of every pixel of both images (one bit per sample of the
+ * window, set when the sample is darker than the center). Computed once per
+ * frame, before BM_Census.
+ */
+__kernel void Census_Transform(__global unsigned char* restrict left_im, __global unsigned char* restrict right_im,
+                               __global ulong* restrict census_left, __global ulong* restrict census_right,
+                               unsigned int width, unsigned int height)
+{
+    unsigned int idx = get_global_id(0);
+    unsigned int idy = get_global_id(1);
+
+    if ( (idy >= HALF_KERNEL) && (idy < (height - HALF_KERNEL)) )
+    {
+		if ( (idx >= HALF_KERNEL) && (idx < (IM_WIDTH - HALF_KERNEL)) )
+		{
+			unsigned char center_left = left_im[idy*IM_WIDTH + idx];
+			unsigned char center_right = right_im[idy*IM_WIDTH + idx];
+			ulong desc_left = 0;
+			ulong desc_right = 0;
+
+			for (int ky=-HALF_KERNEL; ky<=HALF_KERNEL; ky+=CENSUS_STRIDE)
+			{
+				for (int kx=-HALF_KERNEL; kx<=HALF_KERNEL; kx+=CENSUS_STRIDE)
+				{
+					if ( (ky == 0) && (kx == 0) )
+						continue;
+
+					int pos = (idy + ky)*IM_WIDTH + idx + kx;
+					desc_left = (desc_left << 1) | (ulong) (left_im[pos] < center_left);
+					desc_right = (desc_right << 1) | (ulong) (right_im[pos] < center_right);
+				}
+			}
+
+			census_left[idy*IM_WIDTH + idx] = desc_left;
+			census_right[idy*IM_WIDTH + idx] = desc_right;
+		}
+	}
+}
+
+/*
+ * Disparity with the census cost: Hamming distance (popcount of the XOR)
+ * between the descriptor of the left pixel and the right pixel of each
+ * candidate. Same candidates and first-minimum ties as BM_Disparity.
+ */
+__kernel void BM_Census(__global ulong* restrict census_left, __global ulong* restrict census_right, __global DISP_TYPE* restrict disp_im, unsigned int max_d,
+                        unsigned int width, unsigned int height)
+{
+    unsigned int idx = get_global_id(0);
+    unsigned int idy = get_global_id(1);
+
+    if ( (idy >= HALF_KERNEL) && (idy < (height - HALF_KERNEL)) )
+    {
+		if ( (idx >= HALF_KERNEL) && (idx < (IM_WIDTH - HALF_KERNEL)) )
+		{
+			ulong desc = census_left[idy*IM_WIDTH + idx];
+			unsigned int min = UINT_MAX;
+			unsigned int disp = 0;
+			int idx_disp = 0;
+
+			for (int idx_col = idx; (idx_col>=HALF_KERNEL) && (idx_disp<D_RANGE); idx_col--)
+			{
+				unsigned int match_cost = (unsigned int) popcount(desc ^ census_right[idy*IM_WIDTH + idx_col]);
+				if ( match_cost < min )
+				{
+					min = match_cost;
+					disp = idx_disp;
+				}
+				idx_disp++;
+			}
+
+			disp_im[idy*IM_WIDTH + idx] = disp;
+		}
+	}
+}
@@ -1,13 +1,37 @@
+// Window, disparity range and image width are given by the host as build options (-DKERNEL=7 -DMAX_D=16 -DWIDTH=640),
+// so the loops have constant bounds. Without them the range and the width are the kernel arguments.
+#ifndef KERNEL
 #define KERNEL 7
+#endif
 #define HALF_KERNEL KERNEL/2
 
+// the costs of the candidates of a pixel are kept in a private array of D_BLOCK entries
+#ifdef MAX_D
+#define D_RANGE MAX_D
+#define D_BLOCK MAX_D
+#else
+#define D_RANGE max_d
+#define D_BLOCK 256
+#endif
+
+#ifdef WIDTH
+#define IM_WIDTH WIDTH
+#else
+#define IM_WIDTH width
+#endif
+
+// type of the disparity map, uchar or ushort when the map is normalized on the device (-DDISP_TYPE=uchar)
+#ifndef DISP_TYPE
+#define DISP_TYPE unsigned int
+#endif
+
 //__attribute((reqd_work_group_size(20,15,1)))
-__kernel void BM_Disparity(__global unsigned char* restrict left_im, __global unsigned char* restrict right_im, __global unsigned int* restrict disp_im, unsigned int MAX_D)
+__kernel void BM_Disparity(__global unsigned char* restrict left_im, __global unsigned char* restrict right_im, __global DISP_TYPE* restrict disp_im, unsigned int max_d,
+                           unsigned int width, unsigned int height)
 {
 
     /* Get index of the work item */
     //int2 globalId = (int2)(get_global_id(0), get_global_id(1));
-    int2 globalSize = (int2)(get_global_size(0), get_global_size(1));
     int2 groupId = (int2)(get_group_id(0), get_group_id(1));
     int2 localId = (int2)(get_local_id(0), get_local_id(1));
     int2 localSize = (int2)(get_local_size(0), get_local_size(1));
@@ -16,13 +40,14 @@ __kernel void BM_Disparity(__global unsigned char* restrict left_im, __global un
     unsigned int idx = groupId.x*localSize.x + localId.x;
     unsigned int idy = groupId.y*localSize.y + localId.y;
 
-    if ( (idy >= HALF_KERNEL) && (idy < (globalSize.y - HALF_KERNEL)) )
+    // the NDRange is padded to the work-group size, items out of the image do nothing
+    if ( (idy >= HALF_KERNEL) && (idy < (height - HALF_KERNEL)) )
     {
-		if ( (idx >= HALF_KERNEL) && (idx < (globalSize.x - HALF_KERNEL)) )
+		if ( (idx >= HALF_KERNEL) && (idx < (IM_WIDTH - HALF_KERNEL)) )
 		{			
 			int idx_disp = 0;
-			int disp_block[256];
-			for (int idx_col = idx; (idx_col>=HALF_KERNEL) && (idx_disp<MAX_D); idx_col--)
+			int disp_block[D_BLOCK];
+			for (int idx_col = idx; (idx_col>=HALF_KERNEL) && (idx_disp<D_RANGE); idx_col--)
 			{
 				unsigned int match_cost = 0;
 				#pragma unroll
@@ -30,7 +55,7 @@ __kernel void BM_Disparity(__global unsigned char* restrict left_im, __global un
 				{
 					#pragma unroll
 					for (int kx=idx_col-HALF_KERNEL;kx<=(idx_col+HALF_KERNEL);kx++)
-						match_cost += abs(left_im[ky*globalSize.x + kx + (idx-idx_col)] - right_im[ky*globalSize.x + kx]);
+						match_cost += abs(left_im[ky*IM_WIDTH + kx + (idx-idx_col)] - right_im[ky*IM_WIDTH + kx]);
 				}
 
 				disp_block[idx_disp++] = match_cost;
@@ -47,7 +72,7 @@ __kernel void BM_Disparity(__global unsigned char* restrict left_im, __global un
 				}
 			}
 
-			disp_im[idy*globalSize.x + idx] = disp;
+			disp_im[idy*IM_WIDTH + idx] = disp;
 		}
 	}
 
@@ -0,0 +1,108 @@
+// Tiled variant of BM_Disparity-GPU.cl. Neighbouring work-items read almost the same windows, so the work-group
+// loads once into local memory the strip of both images its windows read: the tile plus its halo, and on the right
+// image the D_STRIP - 1 columns on its left. Build options: -DKERNEL=7 -DMAX_D=16 -DWIDTH=640 -DTILE_W=20 -DTILE_H=15,
+// the tile is the work-group size. The host only selects it when the strips fit in the local memory of the device.
+#ifndef KERNEL
+#define KERNEL 7
+#endif
+#define HALF_KERNEL (KERNEL/2)
+
+#ifndef TILE_W
+#define TILE_W 20
+#endif
+#ifndef TILE_H
+#define TILE_H 15
+#endif
+
+// the strip of the right image holds the candidates of D_STRIP disparities
+#ifdef MAX_D
+#define D_RANGE MAX_D
+#define D_STRIP MAX_D
+#else
+#define D_RANGE max_d
+#define D_STRIP 256
+#endif
+
+#ifdef WIDTH
+#define IM_WIDTH WIDTH
+#else
+#define IM_WIDTH width
+#endif
+
+// type of the disparity map, uchar or ushort when the map is normalized on the device (-DDISP_TYPE=uchar)
+#ifndef DISP_TYPE
+#define DISP_TYPE unsigned int
+#endif
+
+#define STRIP_H (TILE_H + 2*HALF_KERNEL)
+#define LEFT_W (TILE_W + 2*HALF_KERNEL)
+#define RIGHT_W (LEFT_W + D_STRIP - 1)
+
+__attribute__((reqd_work_group_size(TILE_W, TILE_H, 1)))
+__kernel void BM_Disparity_Local(__global unsigned char* restrict left_im, __global unsigned char* restrict right_im, __global DISP_TYPE* restrict disp_im, unsigned int max_d,
+                                 unsigned int width, unsigned int height)
+{
+    __local unsigned char left_strip[STRIP_H*LEFT_W];
+    __local unsigned char right_strip[STRIP_H*RIGHT_W];
+
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0)*TILE_W;
+    int y0 = get_group_id(1)*TILE_H;
+    int idx = x0 + lx;
+    int idy = y0 + ly;
+
+    // every work-item of the group loads a share of the strips (the padded ones too, they reach the barrier).
+    // The pixels out of the image are never read by a valid candidate
+    for (int k=ly*TILE_W + lx; k<STRIP_H*RIGHT_W; k+=TILE_W*TILE_H)
+    {
+        int y = y0 - HALF_KERNEL + k/RIGHT_W;
+        int x = x0 - HALF_KERNEL - (D_STRIP - 1) + k%RIGHT_W;
+        right_strip[k] = ( (y >= 0) && (y < (int) height) && (x >= 0) && (x < (int) IM_WIDTH) ) ? right_im[y*IM_WIDTH + x] : 0;
+    }
+
+    for (int k=ly*TILE_W + lx; k<STRIP_H*LEFT_W; k+=TILE_W*TILE_H)
+    {
+        int y = y0 - HALF_KERNEL + k/LEFT_W;
+        int x = x0 - HALF_KERNEL + k%LEFT_W;
+        left_strip[k] = ( (y >= 0) && (y < (int) height) && (x >= 0) && (x < (int) IM_WIDTH) ) ? left_im[y*IM_WIDTH + x] : 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if ( (idy >= HALF_KERNEL) && (idy < (int) (height - HALF_KERNEL)) )
+    {
+        if ( (idx >= HALF_KERNEL) && (idx < (int) (IM_WIDTH - HALF_KERNEL)) )
+        {
+            // only the best candidate is kept, instead of the cost of every disparity
+            unsigned int min_cost = UINT_MAX;
+            unsigned int disp = 0;
+            int num_d = min((int) D_RANGE, idx - HALF_KERNEL + 1);
+
+            for (int d=0; d<num_d; d++)
+            {
+                unsigned int match_cost = 0;
+                #pragma unroll
+                for (int ky=0; ky<=2*HALF_KERNEL; ky++)
+                {
+                    __local const unsigned char* left_row = left_strip + (ly + ky)*LEFT_W + lx;
+                    __local const unsigned char* right_row = right_strip + (ly + ky)*RIGHT_W + lx + (D_STRIP - 1) - d;
+
+                    #pragma unroll
+                    for (int kx=0; kx<=2*HALF_KERNEL; kx++)
+                        match_cost += abs(left_row[kx] - right_row[kx]);
+                }
+
+                // strict, so a tie keeps the smallest disparity as BM_Disparity does
+                if (match_cost < min_cost)
+                {
+                    min_cost = match_cost;
+                    disp = d;
+                }
+            }
+
+            disp_im[idy*IM_WIDTH + idx] = disp;
+        }
+    }
+
+}
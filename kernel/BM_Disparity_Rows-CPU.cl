@@ -0,0 +1,95 @@
+// Row-streaming variant of BM_Disparity-GPU.cl for CPU devices, where one work-item per pixel costs more to schedule
+// than to compute. A work-item owns a row of the image: for every disparity it slides the SAD window along the row,
+// adding the column that enters and removing the one that leaves, and keeps the best cost of every pixel of the row.
+// The NDRange is 1D, one work-item per row. Build options as BM_Disparity-GPU.cl (-DKERNEL=7 -DMAX_D=16 -DWIDTH=640).
+#ifndef KERNEL
+#define KERNEL 7
+#endif
+#define HALF_KERNEL (KERNEL/2)
+#define WINDOW (2*HALF_KERNEL + 1)
+
+#ifdef MAX_D
+#define D_RANGE MAX_D
+#else
+#define D_RANGE max_d
+#endif
+
+// the best costs of a row are kept in a private array of WIDTH entries, so the row pitch must be a build option and
+// at most ROW_MAX_WIDTH (ROW_KERNEL_MAX_WIDTH of OpenCL_Interface.h, checked by the host)
+#define ROW_MAX_WIDTH 8192
+#ifndef WIDTH
+#error "BM_Disparity_Rows needs the row pitch of the images (-DWIDTH)"
+#elif WIDTH > ROW_MAX_WIDTH
+#error "BM_Disparity_Rows keeps a row of costs in private memory, WIDTH is larger than ROW_MAX_WIDTH"
+#endif
+#define IM_WIDTH WIDTH
+
+// type of the disparity map, uchar or ushort when the map is normalized on the device (-DDISP_TYPE=uchar)
+#ifndef DISP_TYPE
+#define DISP_TYPE unsigned int
+#endif
+
+// SAD of the column x of the window of row idy, with the right image moved by d
+unsigned int column_cost(__global const unsigned char* restrict left_im, __global const unsigned char* restrict right_im,
+                         unsigned int width, int idy, int x, int d)
+{
+    unsigned int cost = 0;
+
+    #pragma unroll
+    for (int ky=idy-HALF_KERNEL; ky<=(idy+HALF_KERNEL); ky++)
+        cost += abs(left_im[ky*IM_WIDTH + x] - right_im[ky*IM_WIDTH + x - d]);
+
+    return cost;
+}
+
+__kernel void BM_Disparity_Rows(__global unsigned char* restrict left_im, __global unsigned char* restrict right_im, __global DISP_TYPE* restrict disp_im, unsigned int max_d,
+                                unsigned int width, unsigned int height)
+{
+    int idy = get_global_id(0);
+
+    // the NDRange is padded, and the border rows have no window
+    if ( (idy < HALF_KERNEL) || (idy >= (int) (height - HALF_KERNEL)) )
+        return;
+
+    unsigned int best_cost[WIDTH];
+    __global DISP_TYPE* disp_row = disp_im + idy*IM_WIDTH;
+
+    for (int d=0; d<(int) D_RANGE; d++)
+    {
+        // first pixel with the candidate d, its window on the right image starts at column 0
+        int x_first = HALF_KERNEL + d;
+        if (x_first >= (int) (IM_WIDTH - HALF_KERNEL))
+            break;
+
+        // the columns of the current window, oldest the one that leaves it next
+        unsigned int columns[WINDOW];
+        unsigned int window = 0;
+        int oldest = 0;
+
+        #pragma unroll
+        for (int k=0; k<WINDOW; k++)
+        {
+            columns[k] = column_cost(left_im, right_im, width, idy, x_first - HALF_KERNEL + k, d);
+            window += columns[k];
+        }
+
+        for (int x=x_first; x<(int) (IM_WIDTH - HALF_KERNEL); x++)
+        {
+            // d = 0 is a candidate of every pixel. Strict, so a tie keeps the smallest disparity as BM_Disparity does
+            if ( (d == 0) || (window < best_cost[x]) )
+            {
+                best_cost[x] = window;
+                disp_row[x] = d;
+            }
+
+            if ( (x + 1) < (int) (IM_WIDTH - HALF_KERNEL) )
+            {
+                unsigned int column = column_cost(left_im, right_im, width, idy, x + HALF_KERNEL + 1, d);
+                window += column - columns[oldest];
+                columns[oldest] = column;
+                oldest = (oldest + 1 == WINDOW) ? 0 : oldest + 1;
+            }
+        }
+    }
+
+}
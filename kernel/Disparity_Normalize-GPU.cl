@@ -0,0 +1,84 @@
+// Output stage of the disparity kernels on the device (--device-normalize): the maximum disparity of the map and
+// its 8-bit version with the table of DisparityNormalizer, so the host reads back W*H bytes ready to show. The host
+// appends this file to the program of the disparity kernels and it takes their build options (-DKERNEL, -DWIDTH,
+// -DDISP_TYPE). Its macros have their own names, the ones of the disparity kernels are already defined.
+#ifndef KERNEL
+#define KERNEL 7
+#endif
+#define NORM_HALF_KERNEL (KERNEL/2)
+
+#ifndef DISP_TYPE
+#define DISP_TYPE unsigned int
+#endif
+
+#ifdef WIDTH
+#define NORM_WIDTH WIDTH
+#else
+#define NORM_WIDTH width
+#endif
+
+// pixels written by the disparity kernels, the borders where the window does not fit are not
+#define NORM_INSIDE(x, y) ( ((x) >= NORM_HALF_KERNEL) && ((x) < (int) (NORM_WIDTH - NORM_HALF_KERNEL)) && \
+                            ((y) >= NORM_HALF_KERNEL) && ((y) < (int) (height - NORM_HALF_KERNEL)) )
+
+/*
+ * Maximum of the disparities of the map below max_d, into max_value (0
+ * before the kernel). The work-group reduces its pixels in local memory,
+ * then does a single atomic on max_value.
+ */
+__kernel void Disparity_Max(__global const DISP_TYPE* restrict disp_im, __global unsigned int* restrict max_value, unsigned int max_d,
+                            unsigned int width, unsigned int height)
+{
+    __local unsigned int group_max;
+
+    int idx = get_global_id(0);
+    int idy = get_global_id(1);
+    bool first = (get_local_id(0) == 0) && (get_local_id(1) == 0);
+
+    if (first)
+        group_max = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (NORM_INSIDE(idx, idy))
+    {
+        unsigned int disp = disp_im[idy*NORM_WIDTH + idx];
+        if (disp < max_d)
+            atomic_max(&group_max, disp);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (first)
+        atomic_max(max_value, group_max);
+}
+
+/*
+ * 8-bit map: disp*255/max, 255 from max on and 0 when max is 0 (the table of
+ * DisparityNormalizer), 0 on the borders. fixed_max is the maximum of a fixed
+ * range, 0 to use the maximum of the frame in max_value.
+ */
+__kernel void Disparity_Normalize(__global const DISP_TYPE* restrict disp_im, __global const unsigned int* restrict max_value,
+                                  __global uchar* restrict norm_im, unsigned int fixed_max, unsigned int width, unsigned int height)
+{
+    int idx = get_global_id(0);
+    int idy = get_global_id(1);
+
+    // the NDRange is padded to the work-group size
+    if ( (idx >= (int) NORM_WIDTH) || (idy >= (int) height) )
+        return;
+
+    uchar norm = 0;
+    if (NORM_INSIDE(idx, idy))
+    {
+        unsigned int max = (fixed_max > 0) ? fixed_max : *max_value;
+        unsigned int disp = disp_im[idy*NORM_WIDTH + idx];
+
+        if (max == 0)
+            norm = 0;
+        else if (disp >= max)
+            norm = 255;
+        else
+            norm = (uchar) (disp*255/max);
+    }
+
+    norm_im[idy*NORM_WIDTH + idx] = norm;
+}
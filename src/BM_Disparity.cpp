@@ -19,7 +19,14 @@
 
 #include <iostream>
 #include "BM_Disparity.h"
+#include "SIMD_Kernels.h"
+#include "BM_Specialized.h"
+#include "DisparityNormalizer.h"
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+unsigned long BM_Disparity::m_allocations = 0;
 
 BM_Disparity::BM_Disparity(unsigned int w, unsigned int h)
 {
@@ -28,6 +35,20 @@ BM_Disparity::BM_Disparity(unsigned int w, unsigned int h)
     m_max_disp = 16;
     m_kernel_size = 1;
     m_half_kernel_size = m_kernel_size/2;
+    m_engine = BM_ENGINE_NAIVE;
+    m_cost = BM_COST_SAD;
+    m_census_left = NULL;
+    m_census_right = NULL;
+    m_pool = new ThreadPool(1);
+    m_disp_raw = NULL;
+    m_disp_norm = NULL;
+    m_naive_row = BM_findSpecialization(m_kernel_size, m_max_disp);
+    m_lr_check = false;
+    m_lr_threshold = 1;
+    m_normalizer = new DisparityNormalizer(m_max_disp);
+    m_min_value = 0;
+    m_max_value = 0;
+    allocateWorkspace();
 }
 
 BM_Disparity::BM_Disparity(unsigned int w, unsigned int h, unsigned int max_d, unsigned int kernel_size)
@@ -37,80 +58,914 @@ BM_Disparity::BM_Disparity(unsigned int w, unsigned int h, unsigned int max_d, u
     m_max_disp = max_d;
     m_kernel_size = kernel_size;
     m_half_kernel_size = m_kernel_size/2;
+    m_engine = BM_ENGINE_NAIVE;
+    m_cost = BM_COST_SAD;
+    m_census_left = NULL;
+    m_census_right = NULL;
+    m_pool = new ThreadPool(1);
+    m_disp_raw = NULL;
+    m_disp_norm = NULL;
+    m_naive_row = BM_findSpecialization(m_kernel_size, m_max_disp);
+    m_lr_check = false;
+    m_lr_threshold = 1;
+    m_normalizer = new DisparityNormalizer(m_max_disp);
+    m_min_value = 0;
+    m_max_value = 0;
+    allocateWorkspace();
 }
 
 BM_Disparity::~BM_Disparity()
 {
+    freeWorkspace();
+    delete m_normalizer;
+    delete m_pool;
+};
 
+/*
+ * Frame shared by the tasks of the thread pool, each task computes one band of rows
+ */
+struct BM_Disparity::BandContext {
+    BM_Disparity* self;
+    const unsigned char* left_image;
+    const unsigned char* right_image;
+    unsigned int* disp_image;
+    unsigned char* valid_mask;
+    unsigned char* disp_norm;
+    unsigned int first_row;     // rows split in bands: the rows where the kernel fits, or a range of them
+    unsigned int num_rows;
+    unsigned int num_bands;
 };
 
+void* BM_Disparity::alignedAlloc(size_t size)
+{
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, BM_WORKSPACE_ALIGNMENT, (size > 0) ? size : 1))
+    {
+        std::cerr << "[ERROR] Failed to allocate the BM_Disparity workspace" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    m_allocations++;
+    return ptr;
+}
+
+/*
+ * Size every buffer used by compute() for the current engine and number of
+ * threads, so the frames themselves never touch the heap.
+ */
+void BM_Disparity::allocateWorkspace()
+{
+    freeWorkspace();
+
+    m_disp_raw = (unsigned int*) alignedAlloc(m_width*m_height*sizeof(unsigned int));
+    m_disp_norm = (unsigned char*) alignedAlloc(m_width*m_height*sizeof(unsigned char));
+
+    if (m_cost == BM_COST_CENSUS)
+    {
+        m_census_left = (uint64_t*) alignedAlloc(m_width*m_height*sizeof(uint64_t));
+        m_census_right = (uint64_t*) alignedAlloc(m_width*m_height*sizeof(uint64_t));
+    }
+
+    m_bands.resize(m_pool->getNumThreads());
+    for (size_t k=0; k<m_bands.size(); k++)
+    {
+        BandWorkspace& band = m_bands[k];
+        memset(&band, 0, sizeof(BandWorkspace));
+
+        if (m_cost == BM_COST_CENSUS)
+        {
+            band.best_cost = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+            band.best_disp = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+        }
+        else if ( (m_engine == BM_ENGINE_BOXFILTER) || (m_engine == BM_ENGINE_ROLLING) )
+        {
+            band.col_sum = (unsigned int*) alignedAlloc(m_max_disp*m_width*sizeof(unsigned int));
+            band.prefix = (unsigned int*) alignedAlloc((m_width + 1)*sizeof(unsigned int));
+            band.best_cost = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+            band.best_disp = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+        }
+
+        if ( (m_cost == BM_COST_SAD) && (m_engine == BM_ENGINE_ROLLING) )
+            band.ring = (unsigned char*) alignedAlloc((2*m_half_kernel_size + 1)*m_max_disp*m_width*sizeof(unsigned char));
+
+        if (m_lr_check)
+        {
+            band.right_cost = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+            band.right_disp = (unsigned int*) alignedAlloc(m_width*sizeof(unsigned int));
+        }
+    }
+}
+
+void BM_Disparity::freeWorkspace()
+{
+    for (size_t k=0; k<m_bands.size(); k++)
+    {
+        free(m_bands[k].col_sum);
+        free(m_bands[k].ring);
+        free(m_bands[k].prefix);
+        free(m_bands[k].best_cost);
+        free(m_bands[k].best_disp);
+        free(m_bands[k].right_cost);
+        free(m_bands[k].right_disp);
+    }
+    m_bands.clear();
+
+    free(m_census_left);
+    free(m_census_right);
+    m_census_left = NULL;
+    m_census_right = NULL;
+
+    free(m_disp_raw);
+    free(m_disp_norm);
+    m_disp_raw = NULL;
+    m_disp_norm = NULL;
+}
+
+/*
+ * Number of workspace buffers allocated by every BM_Disparity so far. It only
+ * grows when an engine is built or reconfigured, never while computing frames.
+ * Other heap allocations are not seen here, the bench (--verify) counts all of
+ * the ones of compute().
+ */
+unsigned long BM_Disparity::getAllocationCount()
+{
+    return m_allocations;
+}
+
+size_t BM_Disparity::getWorkingSetBytes()
+{
+    size_t bytes = 0;
+
+    if (m_cost == BM_COST_CENSUS)
+        return 2*m_width*sizeof(uint64_t) + 2*m_width*sizeof(unsigned int) + (m_lr_check ? 2*m_width*sizeof(unsigned int) : 0);
+
+    if ( (m_engine == BM_ENGINE_BOXFILTER) || (m_engine == BM_ENGINE_ROLLING) )
+        bytes += m_max_disp*m_width*sizeof(unsigned int) + (m_width + 1)*sizeof(unsigned int) + 2*m_width*sizeof(unsigned int);
+    else
+        bytes += m_kernel_size*m_width*2*sizeof(unsigned char);
+
+    if (m_engine == BM_ENGINE_ROLLING)
+        bytes += (2*m_half_kernel_size + 1)*m_max_disp*m_width*sizeof(unsigned char);
+
+    if (m_lr_check)
+        bytes += 2*m_width*sizeof(unsigned int);
+
+    return bytes;
+}
+
+void BM_Disparity::setEngine(BM_Engine engine)
+{
+    if (engine == m_engine)
+        return;
+
+    m_engine = engine;
+    allocateWorkspace();
+}
+
+BM_Engine BM_Disparity::getEngine()
+{
+    return m_engine;
+}
+
+void BM_Disparity::setNumThreads(unsigned int num_threads)
+{
+    if (num_threads == 0)
+        num_threads = std::thread::hardware_concurrency();
+    if (num_threads == 0)
+        num_threads = 1;
+
+    if (num_threads == m_pool->getNumThreads())
+        return;
+
+    delete m_pool;
+    m_pool = new ThreadPool(num_threads);
+    allocateWorkspace();
+}
+
+unsigned int BM_Disparity::getNumThreads()
+{
+    return m_pool->getNumThreads();
+}
+
+void BM_Disparity::setCost(BM_Cost cost)
+{
+    if (cost == m_cost)
+        return;
+
+    m_cost = cost;
+    allocateWorkspace();
+}
+
+BM_Cost BM_Disparity::getCost()
+{
+    return m_cost;
+}
+
+/*
+ * Use (or not) the naive engine instantiated at compile time for the kernel
+ * size and maximum disparity of this engine, when the dispatch table has it.
+ */
+void BM_Disparity::setSpecialized(bool enable)
+{
+    m_naive_row = enable ? BM_findSpecialization(m_kernel_size, m_max_disp) : NULL;
+}
+
+bool BM_Disparity::isSpecialized()
+{
+    return m_naive_row != NULL;
+}
+
+/*
+ * Left-right consistency check. The costs of every (x, d) of a row are also
+ * used to get the disparity referenced to the right image, in the same pass.
+ * A pixel is kept when both disparities differ at most threshold, otherwise
+ * its disparity is set to 0 (occlusion or mismatch).
+ */
+void BM_Disparity::setLRCheck(bool enable, unsigned int threshold)
+{
+    m_lr_threshold = threshold;
+
+    if (enable == m_lr_check)
+        return;
+
+    m_lr_check = enable;
+    allocateWorkspace();
+}
+
+bool BM_Disparity::getLRCheck()
+{
+    return m_lr_check;
+}
+
+/*
+ * Normalize by max_d - 1 instead of the maximum of each frame. The table is
+ * then known before computing, so every row is normalized by the band that
+ * computes it and compute() needs no extra pass over the image.
+ */
+void BM_Disparity::setFixedRange(bool enable)
+{
+    m_normalizer->setFixedRange(enable);
+}
+
+bool BM_Disparity::isFixedRange()
+{
+    return m_normalizer->isFixedRange();
+}
+
+unsigned int BM_Disparity::getMinDisparity()
+{
+    return m_min_value;
+}
+
+unsigned int BM_Disparity::getMaxDisparity()
+{
+    return m_max_value;
+}
+
+const char* BM_Disparity::getEngineName(BM_Engine engine)
+{
+    switch (engine)
+    {
+        case BM_ENGINE_NAIVE:
+            return "naive";
+        case BM_ENGINE_BOXFILTER:
+            return "box";
+        case BM_ENGINE_ROLLING:
+            return "rolling";
+    }
+
+    return "unknown";
+}
+
+bool BM_Disparity::parseEngine(const char* name, BM_Engine& engine)
+{
+    if (!strcmp(name, "naive"))
+        engine = BM_ENGINE_NAIVE;
+    else if (!strcmp(name, "box"))
+        engine = BM_ENGINE_BOXFILTER;
+    else if (!strcmp(name, "rolling"))
+        engine = BM_ENGINE_ROLLING;
+    else
+        return false;
+
+    return true;
+}
+
+const char* BM_Disparity::getCostName(BM_Cost cost)
+{
+    switch (cost)
+    {
+        case BM_COST_SAD:
+            return "sad";
+        case BM_COST_CENSUS:
+            return "census";
+    }
+
+    return "unknown";
+}
+
+bool BM_Disparity::parseCost(const char* name, BM_Cost& cost)
+{
+    if (!strcmp(name, "sad"))
+        cost = BM_COST_SAD;
+    else if (!strcmp(name, "census"))
+        cost = BM_COST_CENSUS;
+    else
+        return false;
+
+    return true;
+}
+
+/*
+ * Kept for compatibility: the normalized map is stored in the workspace of the
+ * engine and is overwritten by the next call.
+ */
 unsigned char* BM_Disparity::computeBM_Dispartity(unsigned char* left_image, unsigned char* right_image) {
 
-    // static vector for the dispartity block
-    // each line will contain a disparity with a maximum idx_disp
+    compute(left_image, right_image, NULL, m_disp_norm);
 
-    int disp_block[m_max_disp];
-    unsigned int* disp_image = new unsigned int[m_width*m_height];
-    unsigned char* disp_image_norm = new unsigned char[m_width*m_height];
+    return m_disp_norm;
+}
 
-    //init zeros
-    for (int k=0; k<m_width*m_height; k++)
-        disp_image[k] = 0;
+void BM_Disparity::compute(const unsigned char* left_image, const unsigned char* right_image,
+                           unsigned int* disp_raw, unsigned char* disp_norm, unsigned char* valid_mask)
+{
+    unsigned int* disp_image = (disp_raw != NULL) ? disp_raw : m_disp_raw;
 
-    int max_value = 0;
+    // the kernel never fits around the image borders
+    unsigned int border_rows = (m_height < 2*m_half_kernel_size) ? m_height : m_half_kernel_size;
+    unsigned int num_rows = (m_height > 2*border_rows) ? (m_height - 2*border_rows) : 0;
+    memset(disp_image, 0, border_rows*m_width*sizeof(unsigned int));
+    memset(disp_image + (m_height - border_rows)*m_width, 0, border_rows*m_width*sizeof(unsigned int));
+    if (valid_mask != NULL)
+    {
+        memset(valid_mask, 0, border_rows*m_width);
+        memset(valid_mask + (m_height - border_rows)*m_width, 0, border_rows*m_width);
+    }
 
-    for (int i=0; i<m_height; i++)
+    // with a fixed range the bands normalize their own rows (a disparity of 0 is always 0)
+    bool fused_norm = (disp_norm != NULL) && m_normalizer->isFixedRange();
+    if (fused_norm)
     {
-        if ( (i < m_half_kernel_size) || (i >= (m_height - m_half_kernel_size)) )
+        memset(disp_norm, 0, border_rows*m_width);
+        memset(disp_norm + (m_height - border_rows)*m_width, 0, border_rows*m_width);
+    }
+
+    unsigned int num_bands = m_pool->getNumThreads();
+    if (num_bands > num_rows)
+        num_bands = num_rows;
+
+    BandContext context;
+    context.self = this;
+    context.left_image = left_image;
+    context.right_image = right_image;
+    context.disp_image = disp_image;
+    context.valid_mask = valid_mask;
+    context.disp_norm = fused_norm ? disp_norm : NULL;
+    context.first_row = m_half_kernel_size;
+    context.num_rows = num_rows;
+    context.num_bands = num_bands;
+
+    m_pool->run(computeBand, &context, num_bands);
+    updateRange(num_bands);
+
+    if ( (disp_norm == NULL) || fused_norm )
+        return;
+
+    // the table depends on the maximum of the frame, so the map is normalized once it is complete
+    m_normalizer->setMaxValue(m_max_value);
+    context.disp_norm = disp_norm;
+    context.num_bands = m_pool->getNumThreads();
+    m_pool->run(normalizeBand, &context, context.num_bands);
+}
+
+/*
+ * Compute the rows [y0, y1) of the raw disparity, the other rows are not
+ * written. The bands read their halo from the rows around the range, so a
+ * frame split in ranges gives the same map as compute(). The minimum and
+ * maximum disparity are the ones of the range.
+ */
+void BM_Disparity::computeRows(const unsigned char* left_image, const unsigned char* right_image,
+                               unsigned int* disp_raw, unsigned int y0, unsigned int y1)
+{
+    if (y1 > m_height)
+        y1 = m_height;
+
+    // rows of the range where the kernel fits, the others are border
+    unsigned int first = (y0 > m_half_kernel_size) ? y0 : m_half_kernel_size;
+    unsigned int last = (m_height > m_half_kernel_size) ? m_height - m_half_kernel_size : 0;
+    if (last > y1)
+        last = y1;
+
+    for (unsigned int i=y0; i<y1; i++)
+    {
+        if ( (i < first) || (i >= last) )
+            memset(disp_raw + i*m_width, 0, m_width*sizeof(unsigned int));
+    }
+
+    unsigned int num_rows = (last > first) ? (last - first) : 0;
+    unsigned int num_bands = m_pool->getNumThreads();
+    if (num_bands > num_rows)
+        num_bands = num_rows;
+
+    BandContext context;
+    context.self = this;
+    context.left_image = left_image;
+    context.right_image = right_image;
+    context.disp_image = disp_raw;
+    context.valid_mask = NULL;
+    context.disp_norm = NULL;
+    context.first_row = first;
+    context.num_rows = num_rows;
+    context.num_bands = num_bands;
+
+    m_pool->run(computeBand, &context, num_bands);
+    updateRange(num_bands);
+}
+
+/*
+ * Minimum and maximum disparity of the frame, from the ones of its bands
+ */
+void BM_Disparity::updateRange(unsigned int num_bands)
+{
+    m_min_value = UINT_MAX;
+    m_max_value = 0;
+    for (unsigned int k=0; k<num_bands; k++)
+    {
+        if (m_bands[k].min_value < m_min_value)
+            m_min_value = m_bands[k].min_value;
+        if (m_bands[k].max_value > m_max_value)
+            m_max_value = m_bands[k].max_value;
+    }
+    if (m_min_value > m_max_value)
+        m_min_value = 0;
+}
+
+/*
+ * Normalize one band of rows of a complete disparity map (lookup table of the frame)
+ */
+void BM_Disparity::normalizeBand(void* context, unsigned int band)
+{
+    BandContext* ctx = (BandContext*) context;
+    BM_Disparity* self = ctx->self;
+
+    unsigned int y0 = (unsigned int) ((unsigned long) self->m_height*band/ctx->num_bands);
+    unsigned int y1 = (unsigned int) ((unsigned long) self->m_height*(band + 1)/ctx->num_bands);
+
+    self->m_normalizer->apply(ctx->disp_image + y0*self->m_width, ctx->disp_norm + y0*self->m_width, (y1 - y0)*self->m_width);
+}
+
+/*
+ * Compute one band of rows. Every band reads half_kernel rows above and below
+ * its own rows (halo), so the bands are independent and give the same result
+ * as a single pass over the whole image.
+ */
+void BM_Disparity::computeBand(void* context, unsigned int band)
+{
+    BandContext* ctx = (BandContext*) context;
+    BM_Disparity* self = ctx->self;
+
+    unsigned int y0 = ctx->first_row + (unsigned int) ((unsigned long) ctx->num_rows*band/ctx->num_bands);
+    unsigned int y1 = ctx->first_row + (unsigned int) ((unsigned long) ctx->num_rows*(band + 1)/ctx->num_bands);
+
+    BandWorkspace& workspace = self->m_bands[band];
+
+    // columns where the kernel does not fit
+    unsigned int border_cols = (self->m_width < 2*self->m_half_kernel_size) ? self->m_width : self->m_half_kernel_size;
+    for (unsigned int i=y0; i<y1; i++)
+    {
+        unsigned int* disp_row = ctx->disp_image + i*self->m_width;
+        memset(disp_row, 0, border_cols*sizeof(unsigned int));
+        memset(disp_row + self->m_width - border_cols, 0, border_cols*sizeof(unsigned int));
+
+        if (ctx->valid_mask != NULL)
+        {
+            unsigned char* mask_row = ctx->valid_mask + i*self->m_width;
+            memset(mask_row, 0, border_cols);
+            memset(mask_row + self->m_width - border_cols, 0, border_cols);
+        }
+
+        if (ctx->disp_norm != NULL)
+        {
+            unsigned char* norm_row = ctx->disp_norm + i*self->m_width;
+            memset(norm_row, 0, border_cols);
+            memset(norm_row + self->m_width - border_cols, 0, border_cols);
+        }
+    }
+
+    workspace.min_value = UINT_MAX;
+    workspace.max_value = 0;
+
+    // the kernel does not fit in a row, the band is all border
+    if (self->m_width < self->m_kernel_size)
+        return;
+
+    if (self->m_cost == BM_COST_CENSUS)
+        self->computeCensus(ctx->left_image, ctx->right_image, ctx->disp_image, ctx->valid_mask, ctx->disp_norm, y0, y1, workspace);
+    else if (self->m_engine == BM_ENGINE_BOXFILTER)
+        self->computeBoxFilter(ctx->left_image, ctx->right_image, ctx->disp_image, ctx->valid_mask, ctx->disp_norm, y0, y1, workspace);
+    else if (self->m_engine == BM_ENGINE_ROLLING)
+        self->computeRolling(ctx->left_image, ctx->right_image, ctx->disp_image, ctx->valid_mask, ctx->disp_norm, y0, y1, workspace);
+    else
+        self->computeNaive(ctx->left_image, ctx->right_image, ctx->disp_image, ctx->valid_mask, ctx->disp_norm, y0, y1, workspace);
+}
+
+/*
+ * Prepare the right-referenced argmin of a new row
+ */
+void BM_Disparity::startRow(BandWorkspace& workspace)
+{
+    if (!m_lr_check)
+        return;
+
+    for (unsigned int j=m_half_kernel_size; j<(m_width - m_half_kernel_size); j++)
+    {
+        workspace.right_cost[j] = UINT_MAX;
+        workspace.right_disp[j] = 0;
+    }
+}
+
+/*
+ * Check a finished row against its right-referenced disparities (when the LR
+ * check is enabled), fill its validity mask, keep the minimum and maximum
+ * disparity of the band and, with a fixed range, normalize the row while it
+ * is still in cache (norm_row is NULL otherwise).
+ */
+void BM_Disparity::finishRow(unsigned int* disp_row, unsigned char* mask_row, unsigned char* norm_row, BandWorkspace& workspace)
+{
+    unsigned int min_value = workspace.min_value;
+    unsigned int max_value = workspace.max_value;
+
+    for (unsigned int j=m_half_kernel_size; j<(m_width - m_half_kernel_size); j++)
+    {
+        unsigned int disp = disp_row[j];
+        bool valid = true;
+
+        if (m_lr_check)
+        {
+            // the left pixel j matches the right pixel j - disp
+            unsigned int disp_right = workspace.right_disp[j - disp];
+            unsigned int diff = (disp > disp_right) ? (disp - disp_right) : (disp_right - disp);
+            valid = (diff <= m_lr_threshold);
+            if (!valid)
+            {
+                disp = 0;
+                disp_row[j] = 0;
+            }
+        }
+
+        if (mask_row != NULL)
+            mask_row[j] = valid ? 255 : 0;
+
+        if (norm_row != NULL)
+            norm_row[j] = m_normalizer->lookup(disp);
+
+        if (disp < min_value)
+            min_value = disp;
+        if (disp > max_value)
+            max_value = disp;
+    }
+
+    workspace.min_value = min_value;
+    workspace.max_value = max_value;
+}
+
+/*
+ * Reference engine: the SAD of the whole kernel window is recomputed for each
+ * pixel and each disparity. A compile-time instantiation is used when there is
+ * one for this configuration (see BM_Specialized.h). Computes rows [y0, y1).
+ */
+void BM_Disparity::computeNaive(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                                unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace) {
+
+    unsigned int* right_cost = m_lr_check ? workspace.right_cost : NULL;
+    unsigned int* right_disp = m_lr_check ? workspace.right_disp : NULL;
+
+    for (int i=y0; i<(int) y1; i++)
+    {
+        unsigned int* disp_row = disp_image + i*m_width;
+        unsigned char* mask_row = (valid_mask != NULL) ? (valid_mask + i*m_width) : NULL;
+        unsigned char* norm_row = (disp_norm != NULL) ? (disp_norm + i*m_width) : NULL;
+
+        startRow(workspace);
+
+        if (m_naive_row != NULL)
+        {
+            m_naive_row(left_image, right_image, disp_row, m_width, i, right_cost, right_disp);
+
+            finishRow(disp_row, mask_row, norm_row, workspace);
             continue;
+        }
 
-        for (int j=0; j<m_width; j++)
+        for (int j=0; j<(int) m_width; j++)
         {
-            if ( (j < m_half_kernel_size) || (j >= (m_width - m_half_kernel_size)) )
+            if ( (j < (int) m_half_kernel_size) || (j >= (int) (m_width - m_half_kernel_size)) )
                 continue;
 
             // Take a point on the left, search the correspondence one in the right image and shift this to the left
+            // keep a running minimum (first minimum on ties) instead of storing the cost of every disparity
             unsigned int idx_disp = 0;
+            unsigned int min = UINT_MAX;
+            unsigned int disp = 0;
 
             for (int idx_col = j; (idx_disp < m_max_disp) && (idx_col >= (int) m_half_kernel_size); idx_col--)
             {
                 // SAD Match Cost between Patches
                 unsigned int match_cost = 0;
-                for (int ki=i-m_half_kernel_size;ki<=(i+m_half_kernel_size);ki++)
+                for (int ki=i-(int) m_half_kernel_size;ki<=(i+(int) m_half_kernel_size);ki++)
                 {
-                    for (int kj=idx_col-m_half_kernel_size;kj<=(idx_col+m_half_kernel_size);kj++)
+                    for (int kj=idx_col-(int) m_half_kernel_size;kj<=(idx_col+(int) m_half_kernel_size);kj++)
                     {
                         match_cost += abs(left_image[ki*m_width + kj + (j-idx_col)] - right_image[ki*m_width + kj]);
                     }
                 }
 
-                disp_block[idx_disp++] = match_cost; //MatchCost(left_block, right_block);
-            }
+                if ( match_cost < min )
+                {
+                    min = match_cost;
+                    disp = idx_disp;
+                }
 
-            // get the minimum cost for each disp_block and maximum cost for the whole image
-            int min = disp_block[0];
-            unsigned int disp = 0;
-            for (unsigned int k=0; k<idx_disp; k++)
-            {
-                if ( disp_block[k] < min )
+                // same cost seen from the right pixel idx_col
+                if ( (right_cost != NULL) && (match_cost < right_cost[idx_col]) )
                 {
-                    min = disp_block[k];
-                    disp = k;
+                    right_cost[idx_col] = match_cost;
+                    right_disp[idx_col] = idx_disp;
                 }
+
+                idx_disp++;
             }
 
-            if (disp > max_value)
-                max_value = disp;
+            disp_row[j] = disp;
+        }
 
-            disp_image[i*m_width + j] = disp;
+        finishRow(disp_row, mask_row, norm_row, workspace);
+    }
+}
+
+/*
+ * Disparities searched by the box-filter and rolling engines: a pixel j has
+ * the candidate d only if its right window fits in the image (j - half >= d),
+ * so disparities beyond w - 2*half - 1 are never used.
+ */
+int BM_Disparity::usedDisparities()
+{
+    const int w = m_width;
+    const int half = m_half_kernel_size;
+
+    return ((int) m_max_disp < (w - 2*half)) ? (int) m_max_disp : (w - 2*half);
+}
+
+/*
+ * Argmin of the row i from the column sums of the workspace (one row of w
+ * entries per disparity). The horizontal sum is the difference of two entries
+ * of the prefix sum of the column sums. Candidates are visited with increasing
+ * d and replaced only on a strictly lower cost, which keeps the argmin of the
+ * naive engine.
+ */
+void BM_Disparity::selectRow(unsigned int i, int max_d, unsigned int* disp_image, unsigned char* valid_mask, unsigned char* disp_norm,
+                             BandWorkspace& workspace)
+{
+    const SIMD_Kernels& simd = SIMD_Dispatch::getKernels();
+
+    const int w = m_width;
+    const int window = 2*m_half_kernel_size + 1;   // the columns of the naive window, kernel_size + 1 for an even one
+    const int half = m_half_kernel_size;
+
+    unsigned int* col_sum = workspace.col_sum;
+    unsigned int* prefix = workspace.prefix;
+    unsigned int* best_cost = workspace.best_cost;
+    unsigned int* best_disp = workspace.best_disp;
+
+    for (int j=half; j<(w - half); j++)
+    {
+        best_cost[j] = UINT_MAX;
+        best_disp[j] = 0;
+    }
+    startRow(workspace);
+
+    for (int d=0; d<max_d; d++)
+    {
+        // prefix[t] = sum of col[d .. d+t-1], the window of pixel j = d+half+t is prefix[t+window] - prefix[t]
+        simd.prefixSum(col_sum + d*w + d, prefix, w - d);
+
+        // with the LR check the same costs also belong to the right pixels j - d = half + t
+        if (m_lr_check)
+            simd.argminUpdateLR(prefix + window, prefix, best_cost + d + half, best_disp + d + half,
+                                workspace.right_cost + half, workspace.right_disp + half, d, (w - half) - (d + half));
+        else
+            simd.argminUpdate(prefix + window, prefix, best_cost + d + half, best_disp + d + half, d, (w - half) - (d + half));
+    }
+
+    unsigned int* disp_row = disp_image + i*w;
+    for (int j=half; j<(w - half); j++)
+        disp_row[j] = best_disp[j];
+
+    finishRow(disp_row, (valid_mask != NULL) ? (valid_mask + i*w) : NULL, (disp_norm != NULL) ? (disp_norm + i*w) : NULL, workspace);
+}
+
+/*
+ * Box-filter engine: the SAD window is separable, so for each disparity d we
+ * keep the vertical sum of |L(y,x) - R(y,x-d)| over the kernel rows (column
+ * sums) and slide it down one row at a time (add the incoming row, subtract
+ * the outgoing one), then take the argmin with selectRow(). Every (pixel,
+ * disparity) candidate costs O(1) whatever the kernel size. The row kernels
+ * are vectorized (see SIMD_Kernels.h).
+ * Computes rows [y0, y1).
+ */
+void BM_Disparity::computeBoxFilter(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                                    unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace) {
+
+    const SIMD_Kernels& simd = SIMD_Dispatch::getKernels();
+
+    const int w = m_width;
+    const int h = m_height;
+    const int k = m_kernel_size;
+    const int half = m_half_kernel_size;
+    const int max_d = usedDisparities();
+
+    if ( (h < k) || (w < k) )
+        return;
+
+    // col_sum[d*w + x] = sum over the kernel rows of |L(y,x) - R(y,x-d)|, valid for x >= d
+    unsigned int* col_sum = workspace.col_sum;
+
+    for (int i=y0; i<(int) y1; i++)
+    {
+        if (i == (int) y0)
+        {
+            // first row of the band: sum the whole kernel height
+            for (int d=0; d<max_d; d++)
+            {
+                unsigned int* col = col_sum + d*w;
+                memset(col + d, 0, (w - d)*sizeof(unsigned int));
+
+                for (int y=i-half; y<=i+half; y++)
+                    simd.addAbsDiff(left_image + y*w + d, right_image + y*w, col + d, w - d);
+            }
+        }
+        else
+        {
+            // slide the kernel one row down
+            const unsigned char* l_in = left_image + (i + half)*w;
+            const unsigned char* r_in = right_image + (i + half)*w;
+            const unsigned char* l_out = left_image + (i - half - 1)*w;
+            const unsigned char* r_out = right_image + (i - half - 1)*w;
+            for (int d=0; d<max_d; d++)
+                simd.slideAbsDiff(l_in + d, r_in, l_out + d, r_out, col_sum + d*w + d, w - d);
+        }
+
+        selectRow(i, max_d, disp_image, valid_mask, disp_norm, workspace);
+    }
+}
+
+/*
+ * Rolling engine: same column sums as the box filter, but the costs of each
+ * image row are computed once. The ring keeps |L(y,x) - R(y,x-d)| of the
+ * 2*half + 1 rows of the window in a disparity-major D x W layout, so moving to the next
+ * row adds the incoming row and subtracts the outgoing one read back from the
+ * ring instead of the left and right images. The column sums plus the ring
+ * are the whole working set of a thread (see getWorkingSetBytes()).
+ * Computes rows [y0, y1).
+ */
+void BM_Disparity::computeRolling(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                                  unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace) {
+
+    const SIMD_Kernels& simd = SIMD_Dispatch::getKernels();
+
+    const int w = m_width;
+    const int h = m_height;
+    const int k = m_kernel_size;
+    const int half = m_half_kernel_size;
+    const int window = 2*half + 1;  // rows of the naive window, kernel_size + 1 for an even one
+    const int max_d = usedDisparities();
+
+    if ( (h < k) || (w < k) )
+        return;
+
+    // ring + (y % window)*max_d*w holds the costs of the image row y, one row of w entries per disparity
+    unsigned int* col_sum = workspace.col_sum;
+    unsigned char* ring = workspace.ring;
+    const int ring_stride = max_d*w;
+
+    for (int i=y0; i<(int) y1; i++)
+    {
+        int y_first = i + half;
+        if (i == (int) y0)
+        {
+            // first row of the band: fill the ring with the whole kernel height
+            memset(ring, 0, window*ring_stride*sizeof(unsigned char));
+            for (int d=0; d<max_d; d++)
+                memset(col_sum + d*w + d, 0, (w - d)*sizeof(unsigned int));
+            y_first = i - half;
+        }
+
+        // the slot of the incoming row y is the one of the outgoing row y - window
+        for (int y=y_first; y<=i+half; y++)
+        {
+            unsigned char* slot = ring + (y % window)*ring_stride;
+            const unsigned char* l_in = left_image + y*w;
+            const unsigned char* r_in = right_image + y*w;
+            for (int d=0; d<max_d; d++)
+                simd.rollAbsDiff(l_in + d, r_in, slot + d*w + d, col_sum + d*w + d, w - d);
         }
+
+        selectRow(i, max_d, disp_image, valid_mask, disp_norm, workspace);
     }
+}
+
+/*
+ * Census transform of rows [y0, y1): one bit per sample of the kernel window,
+ * set when the sample is darker than the center pixel. The window has
+ * 2*half + 1 columns and rows, sampled with the smallest stride that takes at
+ * most 8 of them, (2*half + 8)/8, so the descriptor always fits in 64 bits
+ * (stride 1 up to a 7x7 window, 2 from 9x9, i.e. kernel sizes 8 and 9, to
+ * 15x15). Pixels where the window does not fit are not used.
+ */
+void BM_Disparity::censusTransform(const unsigned char* image, uint64_t* census, unsigned int y0, unsigned int y1)
+{
+    const int w = m_width;
+    const int half = m_half_kernel_size;
+    const int stride = (2*half + 8)/8;
+
+    for (int i=y0; i<(int) y1; i++)
+    {
+        const unsigned char* center = image + i*w;
+        uint64_t* census_row = census + i*w;
 
-    // norm image
-    for (int k = 0; k < m_width * m_height; k++)
-        disp_image_norm[k] = static_cast<unsigned char>(disp_image[k] * 255 / max_value);
+        for (int j=half; j<(w - half); j++)
+            census_row[j] = 0;
 
-    return disp_image_norm;
+        // one sample for the whole row at a time, the inner loop is contiguous and vectorizes
+        for (int ky=-half; ky<=half; ky+=stride)
+        {
+            const unsigned char* row = image + (i + ky)*w;
+            for (int kx=-half; kx<=half; kx+=stride)
+            {
+                if ( (ky == 0) && (kx == 0) )
+                    continue;
+
+                for (int j=half; j<(w - half); j++)
+                    census_row[j] = (census_row[j] << 1) | (uint64_t) (row[j + kx] < center[j]);
+            }
+        }
+    }
+}
+
+/*
+ * Census cost: the descriptors of the band rows are computed once per image,
+ * then every candidate d of the pixel j costs popcount(CL(j) ^ CR(j - d)),
+ * without reading the kernel window again. Candidates and ties are visited
+ * as in the SAD engines, so the LR check and the borders behave the same.
+ * Computes rows [y0, y1).
+ */
+void BM_Disparity::computeCensus(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                                 unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace) {
+
+    const SIMD_Kernels& simd = SIMD_Dispatch::getKernels();
+
+    const int w = m_width;
+    const int h = m_height;
+    const int k = m_kernel_size;
+    const int half = m_half_kernel_size;
+    const int max_d = usedDisparities();
+
+    if ( (h < k) || (w < k) )
+        return;
+
+    // only the descriptors of the band rows are compared, so bands do not need each other
+    censusTransform(left_image, m_census_left, y0, y1);
+    censusTransform(right_image, m_census_right, y0, y1);
+
+    unsigned int* best_cost = workspace.best_cost;
+    unsigned int* best_disp = workspace.best_disp;
+    unsigned int* right_cost = m_lr_check ? workspace.right_cost : NULL;
+    unsigned int* right_disp = m_lr_check ? workspace.right_disp : NULL;
+
+    for (int i=y0; i<(int) y1; i++)
+    {
+        const uint64_t* census_left = m_census_left + i*w;
+        const uint64_t* census_right = m_census_right + i*w;
+
+        for (int j=half; j<(w - half); j++)
+        {
+            best_cost[j] = UINT_MAX;
+            best_disp[j] = 0;
+        }
+        startRow(workspace);
+
+        // the left pixel j = d + half + t matches the right pixel half + t
+        for (int d=0; d<max_d; d++)
+            simd.hammingArgmin(census_left + d + half, census_right + half, best_cost + d + half, best_disp + d + half,
+                               (right_cost != NULL) ? (right_cost + half) : NULL, (right_disp != NULL) ? (right_disp + half) : NULL,
+                               d, (w - half) - (d + half));
+
+        unsigned int* disp_row = disp_image + i*w;
+        for (int j=half; j<(w - half); j++)
+            disp_row[j] = best_disp[j];
+
+        finishRow(disp_row, (valid_mask != NULL) ? (valid_mask + i*w) : NULL, (disp_norm != NULL) ? (disp_norm + i*w) : NULL, workspace);
+    }
 }
 
 unsigned int BM_Disparity::MatchCost(unsigned char *a, unsigned char *b) {
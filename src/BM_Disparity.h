@@ -20,6 +20,34 @@
 #ifndef DISPARITYMAP_BM_DISPARITY_H
 #define DISPARITYMAP_BM_DISPARITY_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "ThreadPool.h"
+#include "BM_Specialized.h"
+#include "DisparityNormalizer.h"
+
+// alignment of the workspace buffers (one cache line, also fits AVX-512 loads)
+#define BM_WORKSPACE_ALIGNMENT 64
+
+/*
+ * Engines available to compute the SAD cost of each disparity candidate.
+ * All of them return the same disparity map bit-for-bit.
+ */
+enum BM_Engine {
+    BM_ENGINE_NAIVE,        // full kernel_size x kernel_size window for every candidate
+    BM_ENGINE_BOXFILTER,    // running column and row sums, O(1) per candidate
+    BM_ENGINE_ROLLING       // box filter fed by a ring of the last kernel_size rows of costs
+};
+
+/*
+ * Matching cost of a disparity candidate
+ */
+enum BM_Cost {
+    BM_COST_SAD,            // sum of absolute differences over the kernel window (aggregated by the engine)
+    BM_COST_CENSUS          // Hamming distance of the census descriptors of both pixels
+};
+
 class BM_Disparity {
 
 public:
@@ -29,12 +57,118 @@ public:
 
     unsigned char* computeBM_Dispartity(unsigned char* left_image, unsigned char* right_image);
 
+    // Compute a frame into caller-owned buffers of width*height elements: the raw disparity,
+    // the normalized 8-bit map, or both (pass NULL to skip one), and optionally the validity
+    // mask (255 valid, 0 border or rejected by the LR check). No heap allocation is done.
+    void compute(const unsigned char* left_image, const unsigned char* right_image,
+                 unsigned int* disp_raw, unsigned char* disp_norm, unsigned char* valid_mask = NULL);
+
+    // Raw disparity of the rows [y0, y1) of the frame only (e.g. the share of the host when a frame is split
+    // with an OpenCL device). The images are whole frames, the windows read the rows around the range.
+    void computeRows(const unsigned char* left_image, const unsigned char* right_image,
+                     unsigned int* disp_raw, unsigned int y0, unsigned int y1);
+
+    static unsigned long getAllocationCount();
+
+    // Approximate bytes a thread keeps hot while computing a row: cost buffers, ring and argmin
+    // (the image rows of the window for the naive engine), to compare against the L2 size
+    size_t getWorkingSetBytes();
+
+    void setEngine(BM_Engine engine);
+    BM_Engine getEngine();
+
+    // Rows are split in bands computed by a persistent pool of num_threads threads (0 = all cores)
+    void setNumThreads(unsigned int num_threads);
+    unsigned int getNumThreads();
+
+    // The naive engine uses a compile-time instantiation for common (kernel_size, max_d) pairs
+    void setSpecialized(bool enable);
+    bool isSpecialized();
+
+    // Single-pass left-right consistency check, invalid pixels get disparity 0
+    void setLRCheck(bool enable, unsigned int threshold = 1);
+    bool getLRCheck();
+
+    // Normalize by max_d - 1 instead of the maximum of each frame (fused with the computation)
+    void setFixedRange(bool enable);
+    bool isFixedRange();
+
+    // Minimum and maximum disparity of the last frame, tracked while computing it
+    unsigned int getMinDisparity();
+    unsigned int getMaxDisparity();
+
+    // Census descriptors are computed once per image and compared with popcount, the SAD engine is then unused
+    void setCost(BM_Cost cost);
+    BM_Cost getCost();
+
+    static const char* getEngineName(BM_Engine engine);
+    static bool parseEngine(const char* name, BM_Engine& engine);
+    static const char* getCostName(BM_Cost cost);
+    static bool parseCost(const char* name, BM_Cost& cost);
+
 private:
     unsigned int m_width;
     unsigned int m_height;
     unsigned int m_max_disp;
     unsigned int m_kernel_size;
     unsigned int m_half_kernel_size;
+    BM_Engine m_engine;
+    BM_Cost m_cost;
+    ThreadPool* m_pool;
+    BM_NaiveRow m_naive_row;
+    bool m_lr_check;
+    unsigned int m_lr_threshold;
+    DisparityNormalizer* m_normalizer;
+    unsigned int m_min_value;
+    unsigned int m_max_value;
+
+    // Workspace, sized when the engine is built or reconfigured
+    struct BandWorkspace {
+        unsigned int* col_sum;
+        unsigned char* ring;
+        unsigned int* prefix;
+        unsigned int* best_cost;
+        unsigned int* best_disp;
+        unsigned int* right_cost;
+        unsigned int* right_disp;
+        unsigned int min_value;
+        unsigned int max_value;
+    };
+    std::vector<BandWorkspace> m_bands;
+    uint64_t* m_census_left;
+    uint64_t* m_census_right;
+    unsigned int* m_disp_raw;
+    unsigned char* m_disp_norm;
+    static unsigned long m_allocations;
+
+    static void* alignedAlloc(size_t size);
+    void allocateWorkspace();
+    void freeWorkspace();
+
+    struct BandContext;
+    static void computeBand(void* context, unsigned int band);
+    void updateRange(unsigned int num_bands);
+    static void normalizeBand(void* context, unsigned int band);
+
+    BM_Disparity(const BM_Disparity&) = delete;
+    BM_Disparity& operator=(const BM_Disparity&) = delete;
+
+    void startRow(BandWorkspace& workspace);
+    void finishRow(unsigned int* disp_row, unsigned char* mask_row, unsigned char* norm_row, BandWorkspace& workspace);
+
+    void computeNaive(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                      unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace);
+    void computeBoxFilter(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                          unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace);
+    void computeRolling(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                        unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace);
+    void selectRow(unsigned int i, int max_d, unsigned int* disp_image, unsigned char* valid_mask, unsigned char* disp_norm,
+                   BandWorkspace& workspace);
+    int usedDisparities();
+
+    void censusTransform(const unsigned char* image, uint64_t* census, unsigned int y0, unsigned int y1);
+    void computeCensus(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_image,
+                       unsigned char* valid_mask, unsigned char* disp_norm, unsigned int y0, unsigned int y1, BandWorkspace& workspace);
 
     unsigned char* GetKernelImage(unsigned char* image, unsigned int i, unsigned int j);
     unsigned int MatchCost(unsigned char* a, unsigned char* b);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BM_Specialized.h"
+
+#define BM_SPECIALIZATION(K, D) { K, D, BM_naiveRow<K, D> }
+
+/*
+ * Dispatch table of the instantiations built in the binary: the usual kernel
+ * sizes and maximum disparities used from the command line.
+ */
+static const struct {
+    unsigned int kernel_size;
+    unsigned int max_d;
+    BM_NaiveRow row;
+} specializations[] = {
+    BM_SPECIALIZATION(3, 16),  BM_SPECIALIZATION(3, 32),  BM_SPECIALIZATION(3, 64),  BM_SPECIALIZATION(3, 128),
+    BM_SPECIALIZATION(5, 16),  BM_SPECIALIZATION(5, 32),  BM_SPECIALIZATION(5, 64),  BM_SPECIALIZATION(5, 128),
+    BM_SPECIALIZATION(7, 16),  BM_SPECIALIZATION(7, 32),  BM_SPECIALIZATION(7, 64),  BM_SPECIALIZATION(7, 128),
+    BM_SPECIALIZATION(9, 16),  BM_SPECIALIZATION(9, 32),  BM_SPECIALIZATION(9, 64),  BM_SPECIALIZATION(9, 128),
+    BM_SPECIALIZATION(11, 16), BM_SPECIALIZATION(11, 32), BM_SPECIALIZATION(11, 64), BM_SPECIALIZATION(11, 128),
+};
+
+BM_NaiveRow BM_findSpecialization(unsigned int kernel_size, unsigned int max_d)
+{
+    for (unsigned int k=0; k<sizeof(specializations)/sizeof(specializations[0]); k++)
+    {
+        if ( (specializations[k].kernel_size == kernel_size) && (specializations[k].max_d == max_d) )
+            return specializations[k].row;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_BM_SPECIALIZED_H
+#define DISPARITYMAP_BM_SPECIALIZED_H
+
+#include <stdlib.h>
+#include <limits.h>
+
+/*
+ * Naive SAD engine computing row i of the disparity image into disp_row. When
+ * right_cost/right_disp are not NULL, the same costs also give the running
+ * argmin of each right-image pixel (right-referenced disparity).
+ */
+typedef void (*BM_NaiveRow)(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_row,
+                            unsigned int width, unsigned int i, unsigned int* right_cost, unsigned int* right_disp);
+
+/*
+ * Naive engine with the kernel size and the maximum disparity known at compile
+ * time: the window loops are fully unrolled, the costs of a pixel live in a
+ * fixed-size array and no bounds depend on runtime members. Same candidates
+ * and tie-breaking (first minimum) as BM_Disparity::computeNaive.
+ */
+template <unsigned int KERNEL, unsigned int MAX_D>
+void BM_naiveRow(const unsigned char* left_image, const unsigned char* right_image, unsigned int* disp_row,
+                 unsigned int width, unsigned int i, unsigned int* right_cost, unsigned int* right_disp)
+{
+    const int half = KERNEL/2;
+    const int w = (int) width;
+
+    for (int j=half; j<(w - half); j++)
+    {
+        const unsigned char* left_block = left_image + (i - half)*w + (j - half);
+        const unsigned char* right_block = right_image + (i - half)*w + (j - half);
+
+        // close to the left border only j - half + 1 candidates fit
+        const int num_d = (j - half + 1 < (int) MAX_D) ? (j - half + 1) : (int) MAX_D;
+
+        unsigned int disp_block[MAX_D];
+        if (num_d == (int) MAX_D)
+        {
+            // constant trip count
+            for (int d=0; d<(int) MAX_D; d++)
+            {
+                unsigned int match_cost = 0;
+                for (int ky=0; ky<(int) KERNEL; ky++)
+                    for (int kx=0; kx<(int) KERNEL; kx++)
+                        match_cost += abs(left_block[ky*w + kx] - right_block[ky*w + kx - d]);
+                disp_block[d] = match_cost;
+            }
+        }
+        else
+        {
+            for (int d=0; d<num_d; d++)
+            {
+                unsigned int match_cost = 0;
+                for (int ky=0; ky<(int) KERNEL; ky++)
+                    for (int kx=0; kx<(int) KERNEL; kx++)
+                        match_cost += abs(left_block[ky*w + kx] - right_block[ky*w + kx - d]);
+                disp_block[d] = match_cost;
+            }
+        }
+
+        unsigned int min = UINT_MAX;
+        unsigned int disp = 0;
+        for (int d=0; d<num_d; d++)
+        {
+            if (disp_block[d] < min)
+            {
+                min = disp_block[d];
+                disp = d;
+            }
+        }
+        disp_row[j] = disp;
+
+        if (right_cost != NULL)
+        {
+            for (int d=0; d<num_d; d++)
+            {
+                if (disp_block[d] < right_cost[j - d])
+                {
+                    right_cost[j - d] = disp_block[d];
+                    right_disp[j - d] = d;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Specialized instantiation for (kernel_size, max_d), or NULL when the pair is
+ * not in the dispatch table and the generic engine has to be used.
+ */
+BM_NaiveRow BM_findSpecialization(unsigned int kernel_size, unsigned int max_d);
+
+#endif //DISPARITYMAP_BM_SPECIALIZED_H
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "BufferPool.h"
+
+BufferPool::BufferPool(OpenCL_Interface& openCL) : m_openCL(openCL)
+{
+    m_allocations = 0;
+}
+
+BufferPool::~BufferPool()
+{
+    for (size_t k=0; k<m_entries.size(); k++)
+    {
+        if (m_entries[k].mem != NULL)
+            m_openCL.freeOpenCLMemory(m_entries[k].mem);
+    }
+}
+
+cl_mem BufferPool::get(unsigned int id, size_t bytes, cl_mem_flags flags, bool clear)
+{
+    if (id >= m_entries.size())
+    {
+        Entry empty = {NULL, 0, 0};
+        m_entries.resize(id + 1, empty);
+    }
+
+    Entry& entry = m_entries[id];
+    if ( (entry.mem == NULL) || (entry.bytes != bytes) || (entry.flags != flags) )
+    {
+        if (entry.mem != NULL)
+            m_openCL.freeOpenCLMemory(entry.mem);
+
+        m_openCL.setMemoryBuffer<unsigned char>(entry.mem, bytes, flags);
+        entry.bytes = bytes;
+        entry.flags = flags;
+        m_allocations++;
+
+        // the queue is in order, so the kernels enqueued after it see the zeros
+        if (clear)
+            m_openCL.releaseEvent(m_openCL.enqueueFillBufferAsync<unsigned char>(entry.mem, 0, bytes, 0, NULL));
+    }
+
+    return entry.mem;
+}
+
+unsigned long BufferPool::getAllocations()
+{
+    return m_allocations;
+}
+
+size_t BufferPool::getBytes()
+{
+    size_t bytes = 0;
+    for (size_t k=0; k<m_entries.size(); k++)
+        bytes += m_entries[k].bytes;
+
+    return bytes;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_BUFFERPOOL_H
+#define DISPARITYMAP_BUFFERPOOL_H
+
+#include <vector>
+#include "OpenCL_Interface.h"
+
+/*
+ * OpenCL buffers of the current resolution, by id. get() creates a buffer
+ * the first time it is asked for, and again only when its size (or flags)
+ * change, so a dataset of a single resolution allocates once and a new
+ * camera model only reallocates what changed. A buffer asked for with clear
+ * is filled with zeros on the kernel queue whenever it is (re)created, for
+ * the outputs whose kernels leave some elements unwritten.
+ */
+class BufferPool {
+
+public:
+    BufferPool(OpenCL_Interface& openCL);
+    ~BufferPool();
+
+    cl_mem get(unsigned int id, size_t bytes, cl_mem_flags flags, bool clear = false);
+
+    // Buffers created since the pool was, and bytes held now
+    unsigned long getAllocations();
+    size_t getBytes();
+
+private:
+    struct Entry {
+        cl_mem mem;
+        size_t bytes;
+        cl_mem_flags flags;
+    };
+
+    OpenCL_Interface& m_openCL;
+    std::vector<Entry> m_entries;
+    unsigned long m_allocations;
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+};
+
+#endif //DISPARITYMAP_BUFFERPOOL_H
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "CoScheduler.h"
+
+// minimum share of each side, as a fraction of the rows of the frame
+#define COSCHEDULER_MIN_SHARE (1.0/64)
+
+CoScheduler::CoScheduler(double device_share, double smoothing)
+{
+    m_device_share = device_share;
+    m_smoothing = smoothing;
+    m_host_row_time = 0;
+    m_device_row_time = 0;
+}
+
+unsigned int CoScheduler::getSplitRow(unsigned int height, unsigned int half_kernel)
+{
+    // only the rows where the kernel fits are split
+    if (height <= 2*half_kernel)
+        return height;
+    unsigned int num_rows = height - 2*half_kernel;
+
+    unsigned int min_rows = (unsigned int) (num_rows*COSCHEDULER_MIN_SHARE);
+    if (min_rows < 1)
+        min_rows = 1;
+
+    unsigned int device_rows = (unsigned int) (num_rows*m_device_share + 0.5);
+    if (device_rows < min_rows)
+        device_rows = min_rows;
+    if (device_rows + min_rows > num_rows)
+        device_rows = (num_rows > min_rows) ? (num_rows - min_rows) : num_rows;
+
+    return height - half_kernel - device_rows;
+}
+
+void CoScheduler::update(unsigned int host_rows, double host_time, unsigned int device_rows, double device_time)
+{
+    if ( (host_rows > 0) && (host_time > 0) )
+    {
+        double row_time = host_time/host_rows;
+        m_host_row_time = (m_host_row_time > 0) ? m_host_row_time + m_smoothing*(row_time - m_host_row_time) : row_time;
+    }
+
+    if ( (device_rows > 0) && (device_time > 0) )
+    {
+        double row_time = device_time/device_rows;
+        m_device_row_time = (m_device_row_time > 0) ? m_device_row_time + m_smoothing*(row_time - m_device_row_time) : row_time;
+    }
+
+    // the rows of each side are proportional to its throughput (rows per ms)
+    if ( (m_host_row_time > 0) && (m_device_row_time > 0) )
+        m_device_share = m_host_row_time/(m_host_row_time + m_device_row_time);
+}
+
+double CoScheduler::getDeviceShare()
+{
+    return m_device_share;
+}
+
+double CoScheduler::getHostRowTime()
+{
+    return m_host_row_time;
+}
+
+double CoScheduler::getDeviceRowTime()
+{
+    return m_device_row_time;
+}
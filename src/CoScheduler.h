@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_COSCHEDULER_H
+#define DISPARITYMAP_COSCHEDULER_H
+
+/*
+ * Split of the rows of a frame between the C++ engine (top rows) and an
+ * OpenCL device (bottom rows) in the co-scheduling mode. The share of the
+ * device follows the time per row each side took over the last frames
+ * (exponential average), so that both sides finish a frame together.
+ */
+class CoScheduler {
+
+public:
+    // device_share: fraction of the rows of the first frame given to the device
+    CoScheduler(double device_share = 0.5, double smoothing = 0.25);
+
+    // First row of the device in a frame of height rows: rows [0, split) are the host ones, [split, height) the device ones.
+    // Both sides keep a few rows, so the time of the slower one is still measured
+    unsigned int getSplitRow(unsigned int height, unsigned int half_kernel);
+
+    // Time (ms) each side took for its rows of the last frame
+    void update(unsigned int host_rows, double host_time, unsigned int device_rows, double device_time);
+
+    double getDeviceShare();
+    double getHostRowTime();
+    double getDeviceRowTime();
+
+private:
+    double m_device_share;
+    double m_smoothing;
+    double m_host_row_time;
+    double m_device_row_time;
+};
+
+#endif //DISPARITYMAP_COSCHEDULER_H
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DisparityNormalizer.h"
+
+DisparityNormalizer::DisparityNormalizer(unsigned int max_d)
+{
+    m_size = (max_d > 0) ? max_d : 1;
+    // one more entry for the values out of range
+    m_table = new unsigned char[m_size + 1];
+    m_fixed_range = false;
+    setMaxValue(0);
+}
+
+DisparityNormalizer::~DisparityNormalizer()
+{
+    delete[] m_table;
+}
+
+void DisparityNormalizer::setFixedRange(bool enable)
+{
+    m_fixed_range = enable;
+    setMaxValue(0);
+}
+
+bool DisparityNormalizer::isFixedRange()
+{
+    return m_fixed_range;
+}
+
+void DisparityNormalizer::setMaxValue(unsigned int max_value)
+{
+    if (m_fixed_range)
+        max_value = m_size - 1;
+
+    m_max_value = max_value;
+
+    for (unsigned int k=0; k<m_size; k++)
+    {
+        if (max_value == 0)
+            m_table[k] = 0;
+        else if (k >= max_value)
+            m_table[k] = 255;
+        else
+            m_table[k] = static_cast<unsigned char>(k * 255 / max_value);
+    }
+    m_table[m_size] = 255;
+}
+
+unsigned int DisparityNormalizer::getMaxValue()
+{
+    return m_max_value;
+}
+
+void DisparityNormalizer::apply(const unsigned int* disp, unsigned char* norm, size_t n)
+{
+    for (size_t k=0; k<n; k++)
+        norm[k] = lookup(disp[k]);
+}
+
+void DisparityNormalizer::normalize(const unsigned int* disp, unsigned char* norm, size_t n)
+{
+    // with a table of up to 256 entries the map is walked once: its values go to norm as table indices while
+    // the maximum is found, then the table is applied in place to the 8-bit indices
+    if (!m_fixed_range && (m_size < 256))
+    {
+        unsigned int max_value = 0;
+        for (size_t k=0; k<n; k++)
+        {
+            unsigned int value = (disp[k] < m_size) ? disp[k] : m_size;
+            norm[k] = static_cast<unsigned char>(value);
+            if ( (value > max_value) && (value < m_size) )
+                max_value = value;
+        }
+
+        if (max_value != m_max_value)
+            setMaxValue(max_value);
+
+        for (size_t k=0; k<n; k++)
+            norm[k] = m_table[norm[k]];
+
+        return;
+    }
+
+    if (!m_fixed_range)
+    {
+        unsigned int max_value = 0;
+        for (size_t k=0; k<n; k++)
+            if ( (disp[k] > max_value) && (disp[k] < m_size) )
+                max_value = disp[k];
+
+        if (max_value != m_max_value)
+            setMaxValue(max_value);
+    }
+
+    apply(disp, norm, n);
+}
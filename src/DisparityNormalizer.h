@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_DISPARITYNORMALIZER_H
+#define DISPARITYMAP_DISPARITYNORMALIZER_H
+
+#include <stddef.h>
+
+/*
+ * Output stage shared by the C++ and OpenCL paths: maps a raw disparity map
+ * to 8 bits with a lookup table of max_d entries (value*255/max) instead of
+ * a divide per pixel. The table is built once per frame from its maximum
+ * disparity, or once for all frames with a fixed range (0 .. max_d-1).
+ */
+class DisparityNormalizer {
+
+public:
+    DisparityNormalizer(unsigned int max_d);
+    ~DisparityNormalizer();
+
+    // Scale every frame by max_d - 1 instead of its own maximum (frames are comparable between them)
+    void setFixedRange(bool enable);
+    bool isFixedRange();
+
+    // Build the table for a frame whose maximum disparity is max_value (a map of zeros stays 0)
+    void setMaxValue(unsigned int max_value);
+    unsigned int getMaxValue();
+
+    // norm[k] = table[disp[k]], values out of the table (e.g. unwritten device memory) get 255
+    inline unsigned char lookup(unsigned int disp) const
+    {
+        return m_table[(disp < m_size) ? disp : m_size];
+    }
+    void apply(const unsigned int* disp, unsigned char* norm, size_t n);
+
+    // Find the maximum of a map computed elsewhere (OpenCL) and apply() the table in the same call. With up to
+    // 256 disparities the map is read once, the table is applied to its 8-bit indices
+    void normalize(const unsigned int* disp, unsigned char* norm, size_t n);
+
+private:
+    unsigned int m_size;
+    unsigned char* m_table;
+    unsigned int m_max_value;
+    bool m_fixed_range;
+
+    DisparityNormalizer(const DisparityNormalizer&) = delete;
+    DisparityNormalizer& operator=(const DisparityNormalizer&) = delete;
+};
+
+#endif //DISPARITYMAP_DISPARITYNORMALIZER_H
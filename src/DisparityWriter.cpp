@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <opencv2/opencv.hpp>
+#include "DisparityWriter.h"
+#include "File.h"
+#include "Profiler.h"
+
+DisparityWriter::DisparityWriter(const std::string& dir, DisparityFormat format, unsigned int queue_size)
+{
+    m_dir = dir;
+    m_format = format;
+
+    if (queue_size == 0)
+        queue_size = 1;
+
+    File output(m_dir);
+    if (!output.exists())
+        output.mkdirs();
+
+    m_items.resize(queue_size);
+    m_head = 0;
+    m_count = 0;
+    m_stop = false;
+    m_written = 0;
+    m_stalls = 0;
+    m_stall_time = 0;
+
+    m_thread = std::thread(&DisparityWriter::writer, this);
+}
+
+DisparityWriter::~DisparityWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv_ready.notify_all();
+
+    // the writer empties the queue before it returns
+    m_thread.join();
+}
+
+bool DisparityWriter::needsRaw()
+{
+    return (m_format == DISPARITY_FORMAT_RAW16);
+}
+
+void DisparityWriter::push(const std::string& name, const unsigned char* norm, const unsigned int* disp, unsigned int width, unsigned int height)
+{
+    const unsigned int queue_size = (unsigned int) m_items.size();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_count == queue_size)
+    {
+        // the compute is waiting on the disk
+        ProfileScope wait(PROFILE_QUEUE_WAIT);
+        std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        m_cv_free.wait(lock, [&] { return m_count < queue_size; });
+        std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+
+        m_stalls++;
+        m_stall_time += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
+
+    // the writer only reads the head of the queue, so this buffer can be filled without the lock
+    Item& item = m_items[(m_head + m_count) % queue_size];
+    lock.unlock();
+
+    item.name = name;
+    item.width = width;
+    item.height = height;
+    {
+        ProfileScope copy(PROFILE_HOST_COPY);
+        if (needsRaw())
+        {
+            item.data.resize(width*height*2);
+            for (unsigned int k=0; k<width*height; k++)
+            {
+                unsigned int value = (disp[k] < 0xFFFF) ? disp[k] : 0xFFFF;
+                item.data[2*k] = (unsigned char) (value & 0xFF);
+                item.data[2*k+1] = (unsigned char) (value >> 8);
+            }
+        }
+        else
+            item.data.assign(norm, norm + width*height);
+    }
+
+    lock.lock();
+    m_count++;
+    lock.unlock();
+    m_cv_ready.notify_one();
+}
+
+void DisparityWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv_free.wait(lock, [&] { return m_count == 0; });
+}
+
+/*
+ * Writer thread: write the head of the queue without holding the lock and
+ * free its buffer afterwards.
+ */
+void DisparityWriter::writer()
+{
+    const unsigned int queue_size = (unsigned int) m_items.size();
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv_ready.wait(lock, [&] { return m_stop || (m_count > 0); });
+
+            if (m_count == 0)
+                return;
+        }
+
+        writeItem(m_items[m_head]);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_head = (m_head + 1) % queue_size;
+            m_count--;
+            m_written++;
+        }
+        m_cv_free.notify_all();
+    }
+}
+
+void DisparityWriter::writeItem(const Item& item)
+{
+    static const char* extensions[] = {".raw", ".raw", ".pgm", ".png"};
+
+    // <dir>/<image name without extension>.<ext>
+    std::string name = item.name.substr(0, item.name.find_last_of("."));
+    std::string path = m_dir + "/" + name + extensions[m_format];
+
+    if (m_format == DISPARITY_FORMAT_PNG)
+    {
+        cv::Mat image(item.height, item.width, CV_8UC1, (void*) item.data.data());
+        if (!cv::imwrite(path, image))
+        {
+            printf("[ERROR] Failed to write %s\n", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+    {
+        printf("[ERROR] Failed to write %s\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    if (m_format == DISPARITY_FORMAT_PGM)
+        fprintf(fp, "P5\n%u %u\n255\n", item.width, item.height);
+
+    size_t written = fwrite(item.data.data(), 1, item.data.size(), fp);
+    fclose(fp);
+
+    if (written != item.data.size())
+    {
+        printf("[ERROR] Failed to write %s\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+unsigned long DisparityWriter::getWritten()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_written;
+}
+
+unsigned long DisparityWriter::getStalls()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stalls;
+}
+
+double DisparityWriter::getStallTime()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stall_time;
+}
+
+const char* DisparityWriter::getFormatName(DisparityFormat format)
+{
+    switch (format)
+    {
+        case DISPARITY_FORMAT_RAW8:
+            return "u8";
+        case DISPARITY_FORMAT_RAW16:
+            return "u16";
+        case DISPARITY_FORMAT_PGM:
+            return "pgm";
+        case DISPARITY_FORMAT_PNG:
+            return "png";
+    }
+
+    return "unknown";
+}
+
+bool DisparityWriter::parseFormat(const char* name, DisparityFormat& format)
+{
+    if (!strcmp(name, "u8"))
+        format = DISPARITY_FORMAT_RAW8;
+    else if (!strcmp(name, "u16"))
+        format = DISPARITY_FORMAT_RAW16;
+    else if (!strcmp(name, "pgm"))
+        format = DISPARITY_FORMAT_PGM;
+    else if (!strcmp(name, "png"))
+        format = DISPARITY_FORMAT_PNG;
+    else
+        return false;
+
+    return true;
+}
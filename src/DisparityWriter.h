@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_DISPARITYWRITER_H
+#define DISPARITYMAP_DISPARITYWRITER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+enum DisparityFormat {
+    DISPARITY_FORMAT_RAW8,  // normalized map, width*height bytes
+    DISPARITY_FORMAT_RAW16, // disparities, width*height little-endian 16-bit values
+    DISPARITY_FORMAT_PGM,   // normalized map, binary 8-bit PGM
+    DISPARITY_FORMAT_PNG    // normalized map, 8-bit PNG
+};
+
+/*
+ * Background writer of the disparity maps: push() copies a map into one of
+ * queue_size buffers and returns, a thread encodes and writes it to
+ * <dir>/<name>.<ext>. When the queue is full push() waits for the writer
+ * (backpressure), and that time is accounted as a stall. push() is called
+ * from a single thread (the frame loop).
+ */
+class DisparityWriter {
+
+public:
+    DisparityWriter(const std::string& dir, DisparityFormat format, unsigned int queue_size);
+    ~DisparityWriter();
+
+    // RAW16 writes the raw disparities (disp), the other formats the normalized map (norm)
+    bool needsRaw();
+    void push(const std::string& name, const unsigned char* norm, const unsigned int* disp, unsigned int width, unsigned int height);
+
+    // Wait until every pushed map is written
+    void flush();
+
+    unsigned long getWritten();
+    unsigned long getStalls();
+    double getStallTime();
+
+    static const char* getFormatName(DisparityFormat format);
+    static bool parseFormat(const char* name, DisparityFormat& format);
+
+private:
+    struct Item {
+        std::string name;
+        unsigned int width;
+        unsigned int height;
+        std::vector<unsigned char> data;
+    };
+
+    std::string m_dir;
+    DisparityFormat m_format;
+
+    // m_items[m_head .. m_head+m_count) are waiting to be written, the buffers are reused
+    std::vector<Item> m_items;
+    unsigned int m_head;
+    unsigned int m_count;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_free;
+    std::condition_variable m_cv_ready;
+    bool m_stop;
+
+    unsigned long m_written;
+    unsigned long m_stalls;
+    double m_stall_time;
+
+    void writer();
+    void writeItem(const Item& item);
+
+    DisparityWriter(const DisparityWriter&) = delete;
+    DisparityWriter& operator=(const DisparityWriter&) = delete;
+};
+
+#endif //DISPARITYMAP_DISPARITYWRITER_H
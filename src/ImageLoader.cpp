@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include "ImageLoader.h"
+#include "Profiler.h"
+
+ImageLoader::ImageLoader(const std::string& dir_left, const std::string& dir_right, const std::vector<std::string>& list_files,
+                         unsigned int queue_size, unsigned int num_decoders, unsigned int width, unsigned int height)
+{
+    m_dir_left = dir_left;
+    m_dir_right = dir_right;
+    m_list_files = list_files;
+
+    if (queue_size == 0)
+        queue_size = 1;
+    if (num_decoders == 0)
+        num_decoders = 1;
+
+    m_slots.resize(queue_size);
+    m_ready.assign(queue_size, false);
+    m_next_file = 0;
+    m_next_out = 0;
+    m_depth = 0;
+    m_stop = false;
+    m_stalls = 0;
+    m_stall_time = 0;
+    m_width = width;
+    m_height = height;
+
+    for (unsigned int k=0; k<num_decoders; k++)
+        m_decoders.push_back(std::thread(&ImageLoader::decoder, this));
+}
+
+ImageLoader::~ImageLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv_free.notify_all();
+
+    for (size_t k=0; k<m_decoders.size(); k++)
+        m_decoders[k].join();
+}
+
+void ImageLoader::addHostBuffer(int buffer, unsigned char* left, unsigned char* right, unsigned int width, unsigned int height)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (buffer >= (int) m_buffers_left.size())
+        {
+            m_buffers_left.resize(buffer + 1, NULL);
+            m_buffers_right.resize(buffer + 1, NULL);
+            m_buffers_width.resize(buffer + 1, 0);
+            m_buffers_height.resize(buffer + 1, 0);
+        }
+        m_buffers_left[buffer] = left;
+        m_buffers_right[buffer] = right;
+        m_buffers_width[buffer] = (width > 0) ? width : m_width;
+        m_buffers_height[buffer] = (height > 0) ? height : m_height;
+        m_free_buffers.push_back(buffer);
+    }
+    m_cv_free.notify_all();
+}
+
+/*
+ * Decode an image into a host buffer of width*height bytes. imdecode()
+ * keeps the memory of a destination of the same size and type, so the pixels
+ * are written in place with no copy. An image of another size gets memory of
+ * its own (the returned image does not point to data).
+ */
+cv::Mat ImageLoader::decodeInto(const std::string& file, unsigned char* data, unsigned int width, unsigned int height)
+{
+    std::ifstream stream(file.c_str(), std::ios::binary);
+    std::vector<unsigned char> encoded((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+    cv::Mat image(height, width, CV_8UC1, data);
+    cv::imdecode(encoded, cv::IMREAD_GRAYSCALE | cv::IMREAD_IGNORE_ORIENTATION, &image);
+
+    return image;
+}
+
+/*
+ * Decoder thread: take the next file as soon as its slot (and, with host
+ * buffers, a buffer pair) is free, decode the pair without holding the lock
+ * and publish it.
+ */
+void ImageLoader::decoder()
+{
+    const unsigned int queue_size = (unsigned int) m_slots.size();
+
+    while (true)
+    {
+        unsigned int index;
+        int buffer = -1;
+        unsigned char* left = NULL;
+        unsigned char* right = NULL;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv_free.wait(lock, [&] {
+                return m_stop || (m_next_file >= m_list_files.size()) ||
+                       ( (m_next_file < m_next_out + queue_size) && ((m_width == 0) || !m_free_buffers.empty()) );
+            });
+
+            if (m_stop || (m_next_file >= m_list_files.size()))
+                return;
+
+            index = m_next_file++;
+
+            if (m_width > 0)
+            {
+                buffer = m_free_buffers.back();
+                m_free_buffers.pop_back();
+                left = m_buffers_left[buffer];
+                right = m_buffers_right[buffer];
+                width = m_buffers_width[buffer];
+                height = m_buffers_height[buffer];
+            }
+        }
+
+        StereoFrame frame;
+        frame.index = index;
+        frame.name = m_list_files[index];
+        frame.buffer = buffer;
+        if (buffer >= 0)
+        {
+            ProfileScope decode(PROFILE_DECODE, index);
+
+            // in the buffers of the pair, or in images of their own if the pair has another size
+            frame.left = decodeInto(m_dir_left + "/" + frame.name, left, width, height);
+            frame.right = decodeInto(m_dir_right + "/" + frame.name, right, width, height);
+        }
+        else
+        {
+            ProfileScope decode(PROFILE_DECODE, index);
+
+            frame.left = cv::imread(m_dir_left + "/" + frame.name, cv::IMREAD_GRAYSCALE);
+            frame.right = cv::imread(m_dir_right + "/" + frame.name, cv::IMREAD_GRAYSCALE);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_slots[index % queue_size] = frame;
+            m_ready[index % queue_size] = true;
+            m_depth++;
+        }
+        m_cv_ready.notify_all();
+    }
+}
+
+bool ImageLoader::next(StereoFrame& frame)
+{
+    const unsigned int queue_size = (unsigned int) m_slots.size();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    if (m_next_out >= m_list_files.size())
+        return false;
+
+    unsigned int slot = m_next_out % queue_size;
+    if (!m_ready[slot])
+    {
+        // the compute is waiting on disk or decode
+        ProfileScope wait(PROFILE_QUEUE_WAIT, m_next_out);
+        std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+        m_cv_ready.wait(lock, [&] { return (bool) m_ready[slot]; });
+        std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+
+        m_stalls++;
+        m_stall_time += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    }
+
+    frame = m_slots[slot];
+    m_slots[slot] = StereoFrame();
+    m_ready[slot] = false;
+    m_depth--;
+    m_next_out++;
+
+    lock.unlock();
+    m_cv_free.notify_all();
+
+    return true;
+}
+
+unsigned int ImageLoader::getQueueDepth()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_depth;
+}
+
+unsigned int ImageLoader::getQueueSize()
+{
+    return (unsigned int) m_slots.size();
+}
+
+unsigned long ImageLoader::getStalls()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stalls;
+}
+
+double ImageLoader::getStallTime()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stall_time;
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_IMAGELOADER_H
+#define DISPARITYMAP_IMAGELOADER_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/opencv.hpp>
+
+/*
+ * Grayscale stereo pair decoded by the loader
+ */
+struct StereoFrame {
+    unsigned int index;
+    std::string name;
+    cv::Mat left;
+    cv::Mat right;
+    int buffer = -1; // host buffer pair the pair was decoded into, -1 if it owns its images
+};
+
+/*
+ * Prefetching loader: decoder threads read and decode the stereo pairs ahead
+ * of the frame loop into a bounded queue of queue_size pairs. Frames come out
+ * in file order whatever decoder finished first, and the time the consumer
+ * had to wait for a decoder (stall) is accounted.
+ *
+ * With a buffer size (width, height) the pairs are decoded straight into host
+ * buffers given by addHostBuffer() (e.g. mapped OpenCL buffers) instead of
+ * images of their own. A decoder waits for a free pair of buffers, and the
+ * consumer gives the pair back with addHostBuffer() once it is done with it.
+ * A pair of another size than its buffers is decoded into images of its own
+ * (frame.left.data is not the buffer), so the consumer can give the buffers
+ * back at the size of the pair.
+ */
+class ImageLoader {
+
+public:
+    ImageLoader(const std::string& dir_left, const std::string& dir_right, const std::vector<std::string>& list_files,
+                unsigned int queue_size, unsigned int num_decoders, unsigned int width = 0, unsigned int height = 0);
+    ~ImageLoader();
+
+    // Next pair in file order, false when all of them were returned. Waits if it is not decoded yet.
+    bool next(StereoFrame& frame);
+
+    // Give (or give back) the host buffers of width*height bytes used as buffer pair 'buffer', 0 for the size of the loader
+    void addHostBuffer(int buffer, unsigned char* left, unsigned char* right, unsigned int width = 0, unsigned int height = 0);
+
+    // Decoded pairs waiting in the queue
+    unsigned int getQueueDepth();
+    unsigned int getQueueSize();
+
+    // Times next() had to wait for a decoder, and total time waiting
+    unsigned long getStalls();
+    double getStallTime();
+
+private:
+    std::string m_dir_left;
+    std::string m_dir_right;
+    std::vector<std::string> m_list_files;
+
+    // slot k % queue_size holds the frame k, frames [m_next_out, m_next_out + queue_size) may be decoded
+    std::vector<StereoFrame> m_slots;
+    std::vector<bool> m_ready;
+    unsigned int m_next_file;
+    unsigned int m_next_out;
+    unsigned int m_depth;
+
+    // free host buffer pairs, only used with a buffer size
+    unsigned int m_width;
+    unsigned int m_height;
+    std::vector<int> m_free_buffers;
+    std::vector<unsigned char*> m_buffers_left;
+    std::vector<unsigned char*> m_buffers_right;
+    std::vector<unsigned int> m_buffers_width;
+    std::vector<unsigned int> m_buffers_height;
+
+    std::vector<std::thread> m_decoders;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_free;
+    std::condition_variable m_cv_ready;
+    bool m_stop;
+
+    unsigned long m_stalls;
+    double m_stall_time;
+
+    void decoder();
+    cv::Mat decodeInto(const std::string& file, unsigned char* data, unsigned int width, unsigned int height);
+
+    ImageLoader(const ImageLoader&) = delete;
+    ImageLoader& operator=(const ImageLoader&) = delete;
+};
+
+#endif //DISPARITYMAP_IMAGELOADER_H
@@ -20,7 +20,32 @@
 #include <iostream>
 #include <string.h>
 #include <stdio.h>
+#include <chrono>
 #include "OpenCL_Interface.h"
+#include "ProgramCache.h"
+
+/* Default kernel of the interface, an application selects its own with setKernelSource() */
+#ifdef FPGA_OCL
+std::string OpenCL_Interface::m_kernel_file = "./kernel/DisparityAOCL_640x480";
+std::string OpenCL_Interface::m_kernel_name = "BM_Disparity_WorkGroup";
+std::string OpenCL_Interface::m_cpu_kernel_file = "";
+std::string OpenCL_Interface::m_cpu_kernel_name = "";
+#else
+std::string OpenCL_Interface::m_kernel_file = "./kernel/BM_Disparity-GPU.cl";
+std::string OpenCL_Interface::m_kernel_name = "BM_Disparity";
+std::string OpenCL_Interface::m_cpu_kernel_file = "./kernel/BM_Disparity_Rows-CPU.cl";
+std::string OpenCL_Interface::m_cpu_kernel_name = "BM_Disparity_Rows";
+#endif
+std::vector<std::string> OpenCL_Interface::m_extra_kernel_files;
+std::string OpenCL_Interface::m_program_cache = "./kernel/cache";
+std::string OpenCL_Interface::m_build_options = "";
+
+bool OpenCL_Interface::m_use_opencl_events = true;
+
+/* NDRange of the kernels, given with setNDRange() */
+cl_uint OpenCL_Interface::m_dim_item_size = 1;
+const size_t* OpenCL_Interface::m_global_item_size = NULL;
+const size_t* OpenCL_Interface::m_local_item_size = NULL;
 
 // need deprecated version for OpenCL < 2.0
 // clCreateCommandQueueWithProperties() instead of deprecated clCreateCommandQueue()
@@ -63,27 +88,153 @@ static void kernel_info_sizet_array(cl_device_id device, cl_kernel kernel, cl_de
     printf("%-40s = (%zu, %zu, %zu)\n", name, a[0], a[1], a[2]);
 }
 
-OpenCL_Interface::OpenCL_Interface()
+static const char* getDeviceTypeName(cl_device_type type)
 {
-    
-    cl_int status;
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "GPU";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "ACCELERATOR";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "CPU";
 
-    cl_uint num_devices;
-    cl_uint num_platforms;
-    
-    #ifdef FPGA_OCL
+    return "OTHER";
+}
 
-        if(!aocl_utils::setCwdToExeDir())
-            exit(EXIT_FAILURE);
+std::vector<OpenCL_Device> OpenCL_Interface::getDevices()
+{
+    std::vector<OpenCL_Device> devices;
+    std::vector<cl_platform_id> platforms;
+
+    #ifdef FPGA_OCL
         // Get the OpenCL platform.
-        
-        m_platform = aocl_utils::findPlatform("Intel(R) FPGA");
-        if(m_platform == NULL)
+        cl_platform_id platform = aocl_utils::findPlatform("Intel(R) FPGA");
+        if(platform == NULL)
         {
             printf("ERROR: Unable to find Intel(R) FPGA OpenCL platform.\n");
             exit(EXIT_FAILURE);
         }
+        platforms.push_back(platform);
+    #else
+        cl_uint num_platforms = 0;
+        if ( (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS) || (num_platforms == 0) )
+            return devices;
+
+        platforms.resize(num_platforms);
+        clGetPlatformIDs(num_platforms, platforms.data(), NULL);
+    #endif
+
+    for (size_t p=0; p<platforms.size(); p++)
+    {
+        cl_uint num_devices = 0;
+        if ( (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices) != CL_SUCCESS) || (num_devices == 0) )
+            continue;
+
+        std::vector<cl_device_id> ids(num_devices);
+        clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, num_devices, ids.data(), NULL);
+
+        for (cl_uint k=0; k<num_devices; k++)
+        {
+            char name[STRING_BUFFER_LEN] = "";
+            OpenCL_Device device;
+            device.platform = platforms[p];
+            device.device = ids[k];
+            device.type = CL_DEVICE_TYPE_DEFAULT;
+            clGetDeviceInfo(ids[k], CL_DEVICE_TYPE, sizeof(device.type), &device.type, NULL);
+            clGetDeviceInfo(ids[k], CL_DEVICE_NAME, STRING_BUFFER_LEN, name, NULL);
+            device.name = name;
+
+            cl_device_local_mem_type local_mem_type = CL_GLOBAL;
+            device.local_mem_size = 0;
+            clGetDeviceInfo(ids[k], CL_DEVICE_LOCAL_MEM_TYPE, sizeof(local_mem_type), &local_mem_type, NULL);
+            if (local_mem_type == CL_LOCAL)
+                clGetDeviceInfo(ids[k], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(device.local_mem_size), &device.local_mem_size, NULL);
+
+            devices.push_back(device);
+        }
+    }
+
+    return devices;
+}
+
+void OpenCL_Interface::showDevices()
+{
+    std::vector<OpenCL_Device> devices = getDevices();
+
+    printf("OpenCL devices:\n");
+    for (size_t k=0; k<devices.size(); k++)
+        printf("  [%zu] %s (%s)\n", k, devices[k].name.c_str(), getDeviceTypeName(devices[k].type));
+    if (devices.empty())
+        printf("  none\n");
+}
+
+int OpenCL_Interface::getDefaultDevice(const std::vector<OpenCL_Device>& devices)
+{
+    for (size_t k=0; k<devices.size(); k++)
+    {
+        if (devices[k].type & CL_DEVICE_TYPE_GPU)
+            return (int) k;
+    }
 
+    return 0;
+}
+
+bool OpenCL_Interface::usesRowKernel(const OpenCL_Device& device)
+{
+    return (device.type & CL_DEVICE_TYPE_CPU) && !m_cpu_kernel_file.empty();
+}
+
+OpenCL_Interface::OpenCL_Interface(int device_index)
+{
+    
+    cl_int status;
+
+    #ifdef FPGA_OCL
+        if(!aocl_utils::setCwdToExeDir())
+            exit(EXIT_FAILURE);
+    #endif
+
+    std::vector<OpenCL_Device> devices = getDevices();
+    if (devices.empty())
+    {
+        printf("[ERROR] No OpenCL devices found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // by default the first GPU (the first device of the FPGA platform)
+    if (device_index < 0)
+        device_index = getDefaultDevice(devices);
+
+    if (device_index >= (int) devices.size())
+    {
+        printf("[ERROR] OpenCL device %d does not exist, there are %zu devices\n", device_index, devices.size());
+        showDevices();
+        exit(EXIT_FAILURE);
+    }
+
+    m_device_index = (unsigned int) device_index;
+    m_platform = devices[device_index].platform;
+    m_device = devices[device_index].device;
+
+    // a work-item per pixel costs more to schedule than to compute on a CPU device
+    m_row_kernel = usesRowKernel(devices[device_index]);
+    m_device_kernel_file = m_row_kernel ? m_cpu_kernel_file : m_kernel_file;
+    m_device_kernel_name = m_row_kernel ? m_cpu_kernel_name : m_kernel_name;
+    m_kernel = NULL;
+    m_program = NULL;
+    m_run_time = 0;
+    for (unsigned int k=0; k<PROFILE_STAGES; k++)
+    {
+        m_stage_time[k] = 0;
+        m_stage_count[k] = 0;
+    }
+    m_free_records.reserve(EVENT_RECORDS);
+    for (unsigned int k=0; k<EVENT_RECORDS; k++)
+        m_free_records.push_back(EVENT_RECORDS - 1 - k);
+    m_pending_callbacks = 0;
+    m_run = 0;
+    m_run_pending = 0;
+    
+    #ifdef FPGA_OCL
         char char_buffer[STRING_BUFFER_LEN]; 
         printf("Querying platform for info:\n");
         printf("==========================\n");
@@ -93,21 +244,13 @@ OpenCL_Interface::OpenCL_Interface()
         printf("%-40s = %s\n", "CL_PLATFORM_VENDOR ", char_buffer);
         clGetPlatformInfo(m_platform, CL_PLATFORM_VERSION, STRING_BUFFER_LEN, char_buffer, NULL);
         printf("%-40s = %s\n\n", "CL_PLATFORM_VERSION ", char_buffer);
-
-        // Query the available OpenCL devices.
-        aocl_utils::scoped_array<cl_device_id> devices;
-
-        devices.reset(aocl_utils::getDevices(m_platform, CL_DEVICE_TYPE_ALL, &num_devices));
-
-        // We'll just use the first device.
-        m_device = devices[0];  
     #else
         FILE *fp;
         char *source_str;
         size_t source_size;
 
         /* Load the source code containing the kernel*/
-        fp = fopen((m_kernel_file).c_str(), "r");
+        fp = fopen((m_device_kernel_file).c_str(), "r");
         if (!fp)
         {
             std::cerr << "Failed to load kernel!" << std::endl;
@@ -118,14 +261,32 @@ OpenCL_Interface::OpenCL_Interface()
         source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
         fclose(fp);
 
-        /* Get Platform and Device Info */
-        status = clGetPlatformIDs(1, &m_platform, &num_platforms);
-        status |= clGetDeviceIDs(m_platform, CL_DEVICE_TYPE_GPU, 1, &m_device, &num_devices);
-        checkError(status, "Error calling clGetPlatformIDs");
+        // kept for the variants built later (selectProgram())
+        m_source.assign(source_str, source_size);
+
+        /* Kernels of addKernelSource(), in the same program */
+        for (size_t i=0; i<m_extra_kernel_files.size(); i++)
+        {
+            fp = fopen(m_extra_kernel_files[i].c_str(), "r");
+            if (!fp)
+            {
+                std::cerr << "Failed to load kernel " << m_extra_kernel_files[i] << "!" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+
+            source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
+            fclose(fp);
+
+            m_source.append("\n");
+            m_source.append(source_str, source_size);
+        }
+        free(source_str); //malloc of source code
 
-        std::cout << "Detected OpenCL platforms: " << num_platforms << std::endl;
     #endif
 
+    std::cout << "OpenCL device " << m_device_index << ": " << devices[device_index].name
+              << " (" << getDeviceTypeName(devices[device_index].type) << ")" << std::endl;
+
     /* Create OpenCL context */
     // @TODO use &oclContextCallback
     m_context = clCreateContext(NULL, 1, &m_device, NULL, NULL, &status);
@@ -134,36 +295,110 @@ OpenCL_Interface::OpenCL_Interface()
     /* Create Command Queue */
     m_command_queue = clCreateCommandQueue(m_context, m_device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create Comman Queue");
+
+    /* Transfer Queues of the pipelined mode */
+    m_write_queue = clCreateCommandQueue(m_context, m_device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create Write Queue");
+    m_read_queue = clCreateCommandQueue(m_context, m_device, CL_QUEUE_PROFILING_ENABLE, &status);
+    checkError(status, "Failed to create Read Queue");
     
     #ifdef FPGA_OCL
         // Create the kernel Program from the binary file
-        std::string binary_file = aocl_utils::getBoardBinaryFile(m_kernel_file.c_str(), m_device);
+        std::string binary_file = aocl_utils::getBoardBinaryFile(m_device_kernel_file.c_str(), m_device);
         printf("Using AOCX: %s\n", binary_file.c_str());
         m_program = aocl_utils::createProgramFromBinary(m_context, binary_file.c_str(), &m_device, 1);
         status = clBuildProgram(m_program, 0, NULL, "", NULL, NULL);
         checkError(status, "Failed to build program");
+
+        /* Create OpenCL Kernel */
+        m_kernel = clCreateKernel(m_program, m_device_kernel_name.c_str(), &status);
+        checkError(status && m_kernel, "Failed to Create Kernel");
     #else
+        /* Build (or take from the cache) the program with the options given before the interface was created */
+        selectProgram(m_build_options);
+    #endif
+    
+}
+
+#ifndef FPGA_OCL
+/*
+ * Program of the kernel source built with build_options: the binary of a
+ * previous run if the source, options, device and driver are the same,
+ * otherwise a build from source that refreshes the cache.
+ */
+cl_program OpenCL_Interface::buildProgram(const std::string& build_options)
+{
+    cl_int status;
+    cl_program program = NULL;
+    const char* source_str = m_source.data();
+    size_t source_size = m_source.size();
+
+    std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+
+    ProgramCache cache(m_program_cache);
+    std::string cache_key;
+    if (!m_program_cache.empty())
+    {
+        cache_key = ProgramCache::getKey(m_platform, m_device, source_str, source_size, build_options.c_str());
+        program = cache.load(m_context, m_device, cache_key, build_options.c_str());
+    }
+    bool cache_hit = (program != NULL);
+
+    if (!cache_hit)
+    {
         /* Create Kernel Program from the source */
-        m_program = clCreateProgramWithSource(m_context, 1, (const char **) &source_str, (const size_t *) &source_size, &status);
+        program = clCreateProgramWithSource(m_context, 1, (const char **) &source_str, (const size_t *) &source_size, &status);
         checkError(status, "Failed to create Program with Source");
         
         /* Build Kernel Program */
-        status = clBuildProgram(m_program, 1, &m_device, NULL, NULL, NULL);
+        status = clBuildProgram(program, 1, &m_device, build_options.c_str(), NULL, NULL);
         if (status != CL_SUCCESS) {
             size_t len;
             char buffer[2048];
-            clGetProgramBuildInfo(m_program, m_device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+            clGetProgramBuildInfo(program, m_device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
             std::cout << buffer << std::endl;
             checkError(status, "Failed to Build Program");
         }
-    
-        free(source_str); //malloc of source code
-    #endif
 
-    /* Create OpenCL Kernel */
-    m_kernel = clCreateKernel(m_program, m_kernel_name.c_str(), &status);
-    checkError(status && m_kernel, "Failed to Create Kernel");
-    
+        if (!m_program_cache.empty() && !cache.store(program, cache_key))
+            printf("[WARNING] Failed to store the program binary in %s\n", m_program_cache.c_str());
+    }
+
+    std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+    std::cout << "OpenCL program " << m_device_kernel_file << " [" << build_options << "]: "
+              << (m_program_cache.empty() ? "built from source (no cache)" : (cache_hit ? "cache hit" : "cache miss, built from source"))
+              << " in " << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms" << std::endl;
+
+    return program;
+}
+#endif
+
+/*
+ * Make the variant of the program built with build_options the current one
+ * (run() and createKernel() use it). Variants are built once and kept until
+ * the interface is destroyed, so switching back does not rebuild. The
+ * arguments belong to the kernel of each variant: they are set again after a
+ * switch. The FPGA image is compiled offline for its parameters and has a
+ * single variant.
+ */
+void OpenCL_Interface::selectProgram(const std::string& build_options)
+{
+    #ifndef FPGA_OCL
+    std::map<std::string, Program>::iterator variant = m_programs.find(build_options);
+    if (variant == m_programs.end())
+    {
+        cl_int status;
+        Program program;
+        program.program = buildProgram(build_options);
+        program.kernel = clCreateKernel(program.program, m_device_kernel_name.c_str(), &status);
+        checkError(status, "Failed to Create Kernel");
+
+        variant = m_programs.insert(std::make_pair(build_options, program)).first;
+    }
+
+    m_program = variant->second.program;
+    m_kernel = variant->second.kernel;
+    #endif
 }
 
 /*OpenCL_Interface::OpenCL_Interface(const size_t* global_item_size, const size_t* local_item_size, cl_uint dim_item_size)
@@ -179,9 +414,26 @@ OpenCL_Interface::~OpenCL_Interface()
 
     status = clFlush(m_command_queue);
     status |= clFinish(m_command_queue);
+    status |= clFinish(m_write_queue);
+    status |= clFinish(m_read_queue);
+
+    // the callbacks use the interface
+    waitForCallbacks();
+
+    #ifdef FPGA_OCL
     status |= clReleaseKernel(m_kernel);
     status |= clReleaseProgram(m_program);
+    #else
+    for (std::map<std::string, Program>::iterator variant = m_programs.begin(); variant != m_programs.end(); ++variant)
+    {
+        status |= clReleaseKernel(variant->second.kernel);
+        status |= clReleaseProgram(variant->second.program);
+    }
+    m_programs.clear();
+    #endif
     status |= clReleaseCommandQueue(m_command_queue);
+    status |= clReleaseCommandQueue(m_write_queue);
+    status |= clReleaseCommandQueue(m_read_queue);
     status |= clReleaseContext(m_context);
 
     checkError(status, "Failed to Close OpenCL");
@@ -202,6 +454,351 @@ cl_int OpenCL_Interface::checkError(cl_int status, const char* msg)
     return EXIT_SUCCESS;
 }
 
+void OpenCL_Interface::setKernelSource(const std::string& kernel_file, const std::string& kernel_name)
+{
+    m_kernel_file = kernel_file;
+    m_kernel_name = kernel_name;
+}
+
+void OpenCL_Interface::setCpuKernelSource(const std::string& kernel_file, const std::string& kernel_name)
+{
+    m_cpu_kernel_file = kernel_file;
+    m_cpu_kernel_name = kernel_name;
+}
+
+void OpenCL_Interface::addKernelSource(const std::string& kernel_file)
+{
+    m_extra_kernel_files.push_back(kernel_file);
+}
+
+void OpenCL_Interface::setBuildOptions(const std::string& build_options)
+{
+    m_build_options = build_options;
+}
+
+unsigned int OpenCL_Interface::getDeviceIndex()
+{
+    return m_device_index;
+}
+
+bool OpenCL_Interface::isRowKernel()
+{
+    return m_row_kernel;
+}
+
+std::string OpenCL_Interface::getDeviceName()
+{
+    char name[STRING_BUFFER_LEN] = "";
+    clGetDeviceInfo(m_device, CL_DEVICE_NAME, STRING_BUFFER_LEN, name, NULL);
+
+    return name;
+}
+
+void OpenCL_Interface::setProgramCache(const std::string& dir)
+{
+    m_program_cache = dir;
+}
+
+void OpenCL_Interface::setNDRange(cl_uint dim_item_size, const size_t* global_item_size, const size_t* local_item_size)
+{
+    m_dim_item_size = dim_item_size;
+    m_global_item_size = global_item_size;
+    m_local_item_size = local_item_size;
+}
+
+cl_kernel OpenCL_Interface::createKernel(const char* kernel_name)
+{
+    cl_int status;
+    cl_kernel kernel = clCreateKernel(m_program, kernel_name, &status);
+    checkError(status, "Failed to Create Kernel");
+
+    return kernel;
+}
+
+/*
+ * Enqueue a kernel created with createKernel() over the NDRange of the main
+ * kernel. The queue is in order, so run() sees its results.
+ */
+void OpenCL_Interface::enqueueKernel(cl_kernel kernel)
+{
+    cl_int status;
+    cl_event event;
+
+    status = enqueueNDRange(kernel, 0, NULL, &event);
+    checkError(status, "Failed to Enqueue NDRange Kernel");
+
+    profileEvent(event, PROFILE_KERNEL, Profiler::getFrame());
+    releaseEvent(event);
+}
+
+/*
+ * Enqueue the main kernel, its output stays in the device (e.g. it is mapped
+ * afterwards). The queue is in order, so a blocking map waits for it.
+ */
+void OpenCL_Interface::enqueueRun()
+{
+    cl_int status;
+    cl_event event_ndr;
+
+    startRun();
+
+    status = enqueueNDRange(m_kernel, 0, NULL, &event_ndr);
+    checkError(status, "Failed to Enqueue NDRange Kernel");
+
+    trackEvent(event_ndr, PROFILE_KERNEL, Profiler::getFrame(), true);
+    releaseEvent(event_ndr);
+}
+
+void OpenCL_Interface::unmapBuffer(cl_mem memory, void* ptr)
+{
+    cl_int status;
+    status = clEnqueueUnmapMemObject(m_command_queue, memory, ptr, 0, NULL, NULL);
+    checkError(status, "Failed to Unmap Buffer");
+}
+
+cl_event OpenCL_Interface::enqueueKernelAsync(cl_kernel kernel, cl_uint num_events, const cl_event* wait_list)
+{
+    cl_int status;
+    cl_event event;
+
+    if (kernel == NULL)
+        kernel = m_kernel;
+
+    status = enqueueNDRange(kernel, num_events, wait_list, &event);
+    checkError(status, "Failed to Enqueue NDRange Kernel");
+
+    return event;
+}
+
+/*
+ * Submit the commands of the three queues to the device without waiting for them
+ */
+void OpenCL_Interface::flush()
+{
+    cl_int status;
+
+    status = clFlush(m_write_queue);
+    status |= clFlush(m_command_queue);
+    status |= clFlush(m_read_queue);
+    checkError(status, "Failed to Flush Command Queues");
+}
+
+void OpenCL_Interface::waitForEvent(cl_event event)
+{
+    cl_int status;
+    status = clWaitForEvents(1, &event);
+    checkError(status, "Failed to Wait for Events");
+}
+
+// Whether a command is done, without waiting for it
+bool OpenCL_Interface::isEventComplete(cl_event event)
+{
+    cl_int status;
+    cl_int execution_status;
+
+    status = clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(execution_status), &execution_status, NULL);
+    checkError(status, "Failed to query event status");
+
+    return (execution_status == CL_COMPLETE);
+}
+
+void OpenCL_Interface::releaseEvent(cl_event event)
+{
+    cl_int status;
+    status = clReleaseEvent(event);
+    checkError(status, "Failed to Release Event");
+}
+
+void OpenCL_Interface::profileEvent(cl_event event, ProfileStage stage, unsigned int frame)
+{
+    trackEvent(event, stage, frame, false);
+}
+
+int OpenCL_Interface::holdEvent(cl_event event, ProfileStage stage, unsigned int frame)
+{
+    return trackEvent(event, stage, frame, false, true);
+}
+
+/*
+ * Profile a command from the callback of its event, run_time adds it to the
+ * time of the current run. The record comes from the fixed pool: when every
+ * one is in use the queues are flushed, so the pending commands complete
+ * and their callbacks return theirs. The callback keeps its own reference to
+ * the event, so the caller releases its one as usual. Returns the record, -1
+ * when the command is not profiled.
+ */
+int OpenCL_Interface::trackEvent(cl_event event, ProfileStage stage, unsigned int frame, bool run_time, bool hold)
+{
+    if (!hold && !m_use_opencl_events && !Profiler::isEnabled())
+        return -1;
+
+    cl_int status;
+    EventRecord* record;
+    {
+        std::unique_lock<std::mutex> lock(m_records_mutex);
+        if (m_free_records.empty())
+        {
+            lock.unlock();
+            flush();
+            lock.lock();
+            m_records_done.wait(lock, [this] { return !m_free_records.empty(); });
+        }
+
+        record = &m_records[m_free_records.back()];
+        m_free_records.pop_back();
+        record->openCL = this;
+        record->stage = stage;
+        record->frame = frame;
+        record->run_time = run_time;
+        record->run = m_run;
+        record->held = hold;
+        record->done = false;
+        record->queued = 0;
+        record->start = 0;
+        record->end = 0;
+
+        m_pending_callbacks++;
+        if (run_time)
+            m_run_pending++;
+    }
+
+    status = clRetainEvent(event);
+    status |= clSetEventCallback(event, CL_COMPLETE, &OpenCL_Interface::eventCallback, record);
+    checkError(status, "Failed to Set Event Callback");
+
+    return (int) (record - m_records);
+}
+
+/*
+ * Completion of a profiled command, on a thread of the OpenCL runtime: its
+ * interval goes to the lock-free buffer of the profiler and its time to the
+ * atomic totals of the interface. The event is released, and the record
+ * returned to the pool unless the caller holds it.
+ */
+void CL_CALLBACK OpenCL_Interface::eventCallback(cl_event event, cl_int status, void* user_data)
+{
+    EventRecord* record = (EventRecord*) user_data;
+    OpenCL_Interface* openCL = record->openCL;
+    cl_ulong queued = 0;
+    cl_ulong start = 0;
+    cl_ulong end = 0;
+
+    // a negative status is a command that failed, it has no times
+    if ( (status == CL_COMPLETE)
+         && (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(queued), &queued, NULL) == CL_SUCCESS)
+         && (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS)
+         && (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS) )
+    {
+        Profiler::recordDevice(record->stage, record->frame, start, end, openCL->m_device_index);
+        openCL->m_stage_time[record->stage] += end - start;
+        openCL->m_stage_count[record->stage]++;
+    }
+    else
+        queued = start = end = 0;
+    clReleaseEvent(event);
+
+    std::lock_guard<std::mutex> lock(openCL->m_records_mutex);
+
+    // the callbacks of a previous run that come late do not count in this one
+    if (record->run_time && (record->run == openCL->m_run))
+    {
+        openCL->m_run_time += end - start;
+        openCL->m_run_pending--;
+    }
+
+    record->queued = queued;
+    record->start = start;
+    record->end = end;
+    record->done = true;
+    if (!record->held)
+        openCL->m_free_records.push_back((unsigned int) (record - openCL->m_records));
+
+    openCL->m_pending_callbacks--;
+    openCL->m_records_done.notify_all();
+}
+
+// Device time (ns) of a held command, once its callback ran
+cl_ulong OpenCL_Interface::getRecordElapsedTime(int record)
+{
+    std::unique_lock<std::mutex> lock(m_records_mutex);
+    m_records_done.wait(lock, [this, record] { return m_records[record].done; });
+
+    return m_records[record].end - m_records[record].start;
+}
+
+/*
+ * Both times are on the clock of the device, so the interval counts the
+ * waits of the commands in the queues as a host clock would
+ */
+cl_ulong OpenCL_Interface::getRecordInterval(int first, int last)
+{
+    std::unique_lock<std::mutex> lock(m_records_mutex);
+    m_records_done.wait(lock, [this, first, last] { return m_records[first].done && m_records[last].done; });
+
+    cl_ulong queued = m_records[first].queued;
+    cl_ulong end = m_records[last].end;
+
+    return (end > queued) ? (end - queued) : 0;
+}
+
+void OpenCL_Interface::releaseRecord(int record)
+{
+    std::unique_lock<std::mutex> lock(m_records_mutex);
+    m_records_done.wait(lock, [this, record] { return m_records[record].done; });
+
+    m_records[record].held = false;
+    m_free_records.push_back((unsigned int) record);
+    m_records_done.notify_all();
+}
+
+/*
+ * A new run(): the time of its commands starts from 0, the callbacks still to
+ * come of the previous one are left out of it instead of waited for
+ */
+void OpenCL_Interface::startRun()
+{
+    std::lock_guard<std::mutex> lock(m_records_mutex);
+
+    m_run++;
+    m_run_time = 0;
+    m_run_pending = 0;
+}
+
+// Only at the flush of the stage times and at shutdown, the frames do not wait for the callbacks
+void OpenCL_Interface::waitForCallbacks()
+{
+    std::unique_lock<std::mutex> lock(m_records_mutex);
+    m_records_done.wait(lock, [this] { return m_pending_callbacks == 0; });
+}
+
+/*
+ * The end of a marker on the compute queue, waited for. The host time right
+ * after the wait is the same instant up to the completion latency (us).
+ */
+cl_ulong OpenCL_Interface::getDeviceTimestamp()
+{
+    cl_int status;
+    cl_event event;
+    cl_ulong timestamp;
+
+    status = clEnqueueMarkerWithWaitList(m_command_queue, 0, NULL, &event);
+    checkError(status, "Failed to Enqueue Marker");
+    waitForEvent(event);
+
+    status = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(timestamp), &timestamp, NULL);
+    checkError(status, "Failed to query event end time");
+    releaseEvent(event);
+
+    return timestamp;
+}
+
+void OpenCL_Interface::freeKernel(cl_kernel kernel)
+{
+    cl_int status;
+    status = clReleaseKernel(kernel);
+    checkError(status, "Failed to Release Kernel");
+}
+
 void OpenCL_Interface::freeOpenCLMemory(cl_mem mem)
 {
     cl_int status;
@@ -212,13 +809,27 @@ void OpenCL_Interface::freeOpenCLMemory(cl_mem mem)
 // @TODO: Encapsulate the function DisplayInfio. Now are in Utils.h
 void OpenCL_Interface::showInfo()
 {
-    printf("Using %s (__kernel %s)", (m_kernel_file).c_str(), (m_kernel_name).c_str());
+    printf("Using %s (__kernel %s)", (m_device_kernel_file).c_str(), (m_device_kernel_name).c_str());
     deviceInfo();
     kernelInfo();
     printf("[USER] GlobalGrup-Size = (%zu, %zu, %zu)\n", m_global_item_size[0], m_global_item_size[1], m_global_item_size[2]);
     printf("[USER] WorkGrup-Size = (%zu, %zu, %zu)\n", m_local_item_size[0], m_local_item_size[1], m_local_item_size[2]);
 }
 
+/*
+ * Enqueue a kernel over the NDRange given with setNDRange(). The row kernel of
+ * the CPU devices runs instead one work-item per row of it: a 1D NDRange of
+ * its second dimension, the work-group size left to the runtime.
+ */
+cl_int OpenCL_Interface::enqueueNDRange(cl_kernel kernel, cl_uint num_events, const cl_event* wait_list, cl_event* event)
+{
+    if (m_row_kernel && (kernel == m_kernel))
+        return clEnqueueNDRangeKernel(m_command_queue, kernel, 1, NULL, &m_global_item_size[1], NULL, num_events, wait_list, event);
+
+    return clEnqueueNDRangeKernel(m_command_queue, kernel, m_dim_item_size, NULL, m_global_item_size, m_local_item_size,
+                                  num_events, wait_list, event);
+}
+
 /*
  * Return the OpenCL Event elsapsed time in nanoseconds
  */
@@ -241,7 +852,21 @@ cl_ulong OpenCL_Interface::getStartEndTime(cl_event ev)
  */
 cl_ulong OpenCL_Interface::getTotalElapsedTime()
 {
-    return total_elapsed_time;
+    // the commands of the run are done, their callbacks may still be running
+    std::unique_lock<std::mutex> lock(m_records_mutex);
+    m_records_done.wait(lock, [this] { return m_run_pending == 0; });
+
+    return m_run_time;
+}
+
+cl_ulong OpenCL_Interface::getStageTime(ProfileStage stage)
+{
+    return m_stage_time[stage];
+}
+
+unsigned long OpenCL_Interface::getStageCount(ProfileStage stage)
+{
+    return m_stage_count[stage];
 }
 
 void OpenCL_Interface::deviceInfo()
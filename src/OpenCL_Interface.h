@@ -29,22 +29,99 @@
 #include <CL/cl.h>
 #endif
 
+#include <iostream>
 #include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "Profiler.h"
 
 #define MAX_SOURCE_SIZE (0x100000)
 
+// Commands profiled at once by an interface (their callback pending, or held by the caller)
+#define EVENT_RECORDS (256)
+
+// Widest image of the row kernel of the CPU devices, a row of costs is kept in private memory
+#define ROW_KERNEL_MAX_WIDTH (8192)
+
+/*
+ * OpenCL device found by OpenCL_Interface::getDevices()
+ */
+struct OpenCL_Device {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_device_type type;
+    std::string name;
+    cl_ulong local_mem_size; // 0 when the local memory is emulated in global memory
+};
+
+/*
+ * One OpenCL device: its context, queues and programs. The kernel source,
+ * build options and NDRange are shared by every instance (static), so an
+ * application drives several devices with one interface per device.
+ */
 class OpenCL_Interface{
 
 private:
     static std::string m_kernel_file;
     static std::string m_kernel_name;
-    static cl_platform_id m_platform;
-    static cl_device_id m_device;
-    static cl_context m_context;
-    static cl_command_queue m_command_queue;
-    static cl_kernel m_kernel;
-    static cl_program m_program;
-    cl_ulong total_elapsed_time;
+    static std::string m_cpu_kernel_file;
+    static std::string m_cpu_kernel_name;
+    static std::vector<std::string> m_extra_kernel_files;
+    static std::string m_program_cache;
+    static std::string m_build_options;
+    std::string m_source;
+    std::string m_device_kernel_file; // kernel of this device: the one of setKernelSource() or the CPU one
+    std::string m_device_kernel_name;
+    bool m_row_kernel;
+    unsigned int m_device_index;
+    cl_platform_id m_platform;
+    cl_device_id m_device;
+    cl_context m_context;
+    cl_command_queue m_command_queue;
+    cl_command_queue m_write_queue;
+    cl_command_queue m_read_queue;
+    cl_kernel m_kernel;
+    cl_program m_program;
+
+    // Variants of the program by build options, m_program/m_kernel are the current one
+    struct Program {
+        cl_program program;
+        cl_kernel kernel;
+    };
+    std::map<std::string, Program> m_programs;
+
+    // Device time of the profiled commands, added by their completion callbacks (eventCallback())
+    std::atomic<cl_ulong> m_run_time; // commands of the last run(), enqueueRun() + enqueueReadBuffer()
+    std::atomic<cl_ulong> m_stage_time[PROFILE_STAGES];
+    std::atomic<unsigned long> m_stage_count[PROFILE_STAGES];
+
+    // Command of a profiled event, given to its callback. The callback fills its times (ns, device clock)
+    struct EventRecord {
+        OpenCL_Interface* openCL;
+        ProfileStage stage;
+        unsigned int frame;
+        bool run_time;
+        unsigned long run;  // run() the command belongs to
+        bool held;          // kept for the caller until releaseRecord()
+        bool done;
+        cl_ulong queued;
+        cl_ulong start;
+        cl_ulong end;
+    };
+
+    // Fixed pool of the records, free ones in m_free_records. m_records_mutex guards them and the counters below,
+    // m_records_done is notified by every callback and released record
+    EventRecord m_records[EVENT_RECORDS];
+    std::vector<unsigned int> m_free_records;
+    std::mutex m_records_mutex;
+    std::condition_variable m_records_done;
+    unsigned int m_pending_callbacks;
+    unsigned long m_run;
+    unsigned int m_run_pending;     // callbacks of the commands of the current run
 
 public:
     static bool m_use_opencl_events;
@@ -52,16 +129,64 @@ public:
     static const size_t* m_global_item_size;
     static const size_t* m_local_item_size;
 
-    OpenCL_Interface();
+    // Device device_index of getDevices(), by default the first GPU
+    OpenCL_Interface(int device_index = -1);
     //OpenCL_Interface(size_t* global_item_size, size_t* local_item_size, cl_uint dim_item_size);
     ~OpenCL_Interface();
+
+    // Devices of every platform (of the FPGA platform in the FPGA build), in platform order
+    static std::vector<OpenCL_Device> getDevices();
+    static void showDevices();
+
+    // Index of the device used by default: the first GPU, otherwise the first device
+    static int getDefaultDevice(const std::vector<OpenCL_Device>& devices);
+
+    // The interface of the device would run the row kernel (up to ROW_KERNEL_MAX_WIDTH pixels wide)
+    static bool usesRowKernel(const OpenCL_Device& device);
+
+    unsigned int getDeviceIndex();
+    std::string getDeviceName();
+
+    // The main kernel is the row kernel of the CPU devices (setCpuKernelSource())
+    bool isRowKernel();
     
     // @TODO
     //void initOpenCL();
     //void initOpenCL_FPGA();
 
+    // Device time (ns) of the commands of the last run() with the OpenCL events, waits for their callbacks
     cl_ulong getTotalElapsedTime();
 
+    // Device time (ns) and number of the commands of a stage profiled with the OpenCL events
+    cl_ulong getStageTime(ProfileStage stage);
+    unsigned long getStageCount(ProfileStage stage);
+
+    // Select the kernel file and __kernel run by run(), before the interface is created
+    static void setKernelSource(const std::string& kernel_file, const std::string& kernel_name);
+
+    // Kernel of the CPU devices (CL_DEVICE_TYPE_CPU), run with one work-item per row of the NDRange. Empty for the one of setKernelSource()
+    static void setCpuKernelSource(const std::string& kernel_file, const std::string& kernel_name);
+
+    // Kernel file appended to the source of the program (e.g. an output stage of the main kernel), its kernels with createKernel()
+    static void addKernelSource(const std::string& kernel_file);
+
+    // Options of the first build (e.g. -DKERNEL=5), given before the interface is created
+    static void setBuildOptions(const std::string& build_options);
+
+    // Build the variant of the program for these options if needed, and make it the current one
+    void selectProgram(const std::string& build_options);
+
+    // Directory of the program binary cache of the GPU build, empty to always build from source
+    static void setProgramCache(const std::string& dir);
+
+    // NDRange of the kernels, the arrays are read at every enqueue (they can be updated in place)
+    static void setNDRange(cl_uint dim_item_size, const size_t* global_item_size, const size_t* local_item_size);
+
+    // Extra kernels of the same program (e.g. a pre-pass of the main kernel), enqueued with the same NDRange
+    cl_kernel createKernel(const char* kernel_name);
+    void enqueueKernel(cl_kernel kernel);
+    void freeKernel(cl_kernel kernel);
+
     template <class Memory>
     void setKernelArgs(Memory mem, cl_uint arg)
     {
@@ -71,6 +196,14 @@ public:
         checkError(status, "Failed to Set Kernel Arguments");
     }
 
+    template <class Memory>
+    void setKernelArgs(cl_kernel kernel, Memory mem, cl_uint arg)
+    {
+        cl_int status;
+        status = clSetKernelArg(kernel, arg, sizeof(Memory), (void *) &mem);
+        checkError(status, "Failed to Set Kernel Arguments");
+    }
+
     template <class Buffer>
     void setMemoryBuffer(cl_mem& memory, size_t size, cl_mem_flags type)
     {
@@ -87,14 +220,26 @@ public:
         cl_int status;
         cl_event event;
 
-        if (!m_use_opencl_events)
-            event = NULL;
-        
         status = clEnqueueWriteBuffer(m_command_queue, memory, type, 0, size*sizeof(Buffer), (void *) input, 0, NULL, &event);
         checkError(status, "Failed to Enqueue Write Buffer");
 
-        if (m_use_opencl_events)
-            std::cout << "Elapsed Write Buffer (us): " << getStartEndTime(event)*1e-3 << std::endl;
+        profileEvent(event, PROFILE_WRITE, Profiler::getFrame());
+        releaseEvent(event);
+    }
+
+    // Read of an output after enqueueRun(), its time counts in getTotalElapsedTime() as the read of run()
+    template <class Buffer>
+    void enqueueReadBuffer(cl_mem memory, Buffer* output, size_t size, cl_bool type)
+    {
+        /* Enqueue Read Buffer */
+        cl_int status;
+        cl_event event;
+
+        status = clEnqueueReadBuffer(m_command_queue, memory, type, 0, size*sizeof(Buffer), (void *) output, 0, NULL, &event);
+        checkError(status, "Failed to Enqueue Read Buffer");
+
+        trackEvent(event, PROFILE_READ, Profiler::getFrame(), true);
+        releaseEvent(event);
     }
 
     template <class Buffer>
@@ -105,16 +250,11 @@ public:
         cl_int status;
         cl_event event_ndr;
         cl_event event_read;
-        total_elapsed_time = 0;
 
-        if (!m_use_opencl_events)
-        {
-            event_ndr = NULL;
-            event_read = NULL;
-        }
+        startRun();
 
         /* Execute NDRange Kernel */
-        status = clEnqueueNDRangeKernel(m_command_queue, m_kernel, m_dim_item_size, NULL, m_global_item_size, m_local_item_size, 0, NULL, &event_ndr);
+        status = enqueueNDRange(m_kernel, 0, NULL, &event_ndr);
         //status = clEnqueueTask(command_queue, kernel, 0, NULL,NULL);
         checkError(status, "Failed to Enqueue NDRange Kernel");
 
@@ -122,24 +262,125 @@ public:
         status = clEnqueueReadBuffer(m_command_queue, output_mem, type, 0, size*sizeof(Buffer), (void *) output, 0, NULL, &event_read);
         checkError(status, "Failed to Enqueue Read Buffer");
 
-        if (m_use_opencl_events)
-        {
-            cl_ulong eta_ndr = getStartEndTime(event_ndr);
-            cl_ulong eta_read = getStartEndTime(event_read);
-            
-            std::cout << "Elapsed Enqueue NDRange Kernel (us): " << eta_ndr*1e-3 << std::endl;
-            std::cout << "Elapsed Read Buffer (us): " << eta_read*1e-3 << std::endl;
-            
-            total_elapsed_time += (eta_ndr + eta_read);
-        }
+        // the times are taken when the commands complete, the host does not wait for them here
+        trackEvent(event_ndr, PROFILE_KERNEL, Profiler::getFrame(), true);
+        trackEvent(event_read, PROFILE_READ, Profiler::getFrame(), true);
+        releaseEvent(event_ndr);
+        releaseEvent(event_read);
     }
 
+    /*
+     * Non-blocking enqueues for the pipelined mode. Uploads, kernels and readbacks go
+     * to three in-order queues chained by events, so the upload of a frame overlaps the
+     * kernel of the previous one and its readback the kernel of the next one. The
+     * returned events belong to the caller (releaseEvent()).
+     */
+    template <class Buffer>
+    cl_event enqueueWriteBufferAsync(cl_mem memory, const Buffer* input, size_t size)
+    {
+        cl_int status;
+        cl_event event;
+
+        status = clEnqueueWriteBuffer(m_write_queue, memory, CL_FALSE, 0, size*sizeof(Buffer), (const void *) input, 0, NULL, &event);
+        checkError(status, "Failed to Enqueue Write Buffer");
+
+        return event;
+    }
+
+    // offset: first element of the buffer read
+    template <class Buffer>
+    cl_event enqueueReadBufferAsync(cl_mem memory, Buffer* output, size_t size, cl_event wait_event, size_t offset = 0)
+    {
+        cl_int status;
+        cl_event event;
+
+        status = clEnqueueReadBuffer(m_read_queue, memory, CL_FALSE, offset*sizeof(Buffer), size*sizeof(Buffer), (void *) output, 1, &wait_event, &event);
+        checkError(status, "Failed to Enqueue Read Buffer");
+
+        return event;
+    }
+
+    // Fill the buffer with value on the kernel queue, so the kernels enqueued after it see it
+    template <class Buffer>
+    cl_event enqueueFillBufferAsync(cl_mem memory, Buffer value, size_t size, cl_uint num_events, const cl_event* wait_list)
+    {
+        cl_int status;
+        cl_event event;
+
+        status = clEnqueueFillBuffer(m_command_queue, memory, (const void *) &value, sizeof(Buffer), 0, size*sizeof(Buffer), num_events, wait_list, &event);
+        checkError(status, "Failed to Enqueue Fill Buffer");
+
+        return event;
+    }
+
+    /*
+     * Zero-copy access to a buffer created with CL_MEM_ALLOC_HOST_PTR: the host
+     * works on the returned pointer, and the buffer is unmapped before a kernel
+     * uses it. On CPU and integrated devices the mapping does not copy.
+     */
+    template <class Buffer>
+    Buffer* mapBuffer(cl_mem memory, size_t size, cl_map_flags flags)
+    {
+        cl_int status;
+        void* ptr = clEnqueueMapBuffer(m_command_queue, memory, CL_TRUE, flags, 0, size*sizeof(Buffer), 0, NULL, NULL, &status);
+        checkError(status, "Failed to Map Buffer");
+
+        return (Buffer*) ptr;
+    }
+
+    void unmapBuffer(cl_mem memory, void* ptr);
+
+    // Enqueue the main kernel without reading its output back
+    void enqueueRun();
+
+    // kernel NULL is the main kernel (the one of run())
+    cl_event enqueueKernelAsync(cl_kernel kernel, cl_uint num_events, const cl_event* wait_list);
+    void flush();
+    void waitForEvent(cl_event event);
+    bool isEventComplete(cl_event event);
+    void releaseEvent(cl_event event);
+
+    /*
+     * Record a command of a frame in the profiler and in the stage times when it
+     * completes, from a callback of its event: the host does not wait for it, and
+     * the event can be released right away. Nothing without the profiler and the
+     * OpenCL events.
+     */
+    void profileEvent(cl_event event, ProfileStage stage, unsigned int frame);
+
+    /*
+     * As profileEvent(), recorded even without the profiler, and the record is
+     * kept for the times of the command: the getters wait for its callback (not
+     * for the command, the caller does), then the caller releases the record.
+     */
+    int holdEvent(cl_event event, ProfileStage stage, unsigned int frame);
+    cl_ulong getRecordElapsedTime(int record);
+    // Wall time (ns) from the enqueue of the command of first to the end of the one of last
+    cl_ulong getRecordInterval(int first, int last);
+    void releaseRecord(int record);
+
+    // Wait until the callbacks of the commands profiled so far have run (before the stage times are read)
+    void waitForCallbacks();
+
+    // Current time (ns) of the clock of the profiling events, to align it with the host one
+    cl_ulong getDeviceTimestamp();
+
     void freeOpenCLMemory(cl_mem mem);
 
     void showInfo();
 
 private:
     cl_ulong getStartEndTime(cl_event ev);
+    void startRun();
+    int trackEvent(cl_event event, ProfileStage stage, unsigned int frame, bool run_time, bool hold = false);
+    static void CL_CALLBACK eventCallback(cl_event event, cl_int status, void* user_data);
+    cl_int enqueueNDRange(cl_kernel kernel, cl_uint num_events, const cl_event* wait_list, cl_event* event);
+
+    OpenCL_Interface(const OpenCL_Interface&) = delete;
+    OpenCL_Interface& operator=(const OpenCL_Interface&) = delete;
+    #ifndef FPGA_OCL
+    cl_program buildProgram(const std::string& build_options);
+    #endif
     cl_int checkError(cl_int status, const char* msg);
     void showError(cl_int error);
     void kernelInfo();
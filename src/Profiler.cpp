@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <algorithm>
+#include "Profiler.h"
+
+std::vector<ProfileEvent> Profiler::m_events;
+std::atomic<unsigned long> Profiler::m_next(0);
+std::atomic<int> Profiler::m_threads(0);
+std::vector<long long> Profiler::m_device_offsets;
+bool Profiler::m_enabled = false;
+
+static std::chrono::steady_clock::time_point t_origin = std::chrono::steady_clock::now();
+
+// number of the calling thread in the trace, and its current frame
+static thread_local int t_thread = -1;
+static thread_local unsigned int t_frame = 0;
+
+// Chrome trace rows of the device, one per queue
+static const char* device_track[PROFILE_STAGES] = {"", "", "write queue", "compute queue", "read queue", "normalize kernels", "", ""};
+
+/*
+ * Allocate the buffer of capacity events. Called before the threads that
+ * record are started.
+ */
+void Profiler::enable(size_t capacity)
+{
+    if (capacity == 0)
+        capacity = 1;
+
+    m_events.resize(capacity);
+    m_next = 0;
+    t_origin = std::chrono::steady_clock::now();
+    m_enabled = true;
+}
+
+bool Profiler::isEnabled()
+{
+    return m_enabled;
+}
+
+long long Profiler::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t_origin).count();
+}
+
+void Profiler::setFrame(unsigned int frame)
+{
+    t_frame = frame;
+}
+
+unsigned int Profiler::getFrame()
+{
+    return t_frame;
+}
+
+void Profiler::push(const ProfileEvent& event)
+{
+    // the slot is only written by this thread until the ring wraps a whole capacity, the reader waits for the
+    // threads to finish
+    unsigned long k = m_next.fetch_add(1, std::memory_order_relaxed);
+    m_events[k % m_events.size()] = event;
+}
+
+void Profiler::record(ProfileStage stage, unsigned int frame, long long start, long long end)
+{
+    if (!m_enabled)
+        return;
+
+    if (t_thread < 0)
+        t_thread = m_threads.fetch_add(1);
+
+    ProfileEvent event = {(unsigned int) stage, frame, t_thread, start, end};
+    push(event);
+}
+
+void Profiler::record(ProfileStage stage, long long start, long long end)
+{
+    record(stage, t_frame, start, end);
+}
+
+void Profiler::recordDevice(ProfileStage stage, unsigned int frame, unsigned long long start, unsigned long long end,
+                            unsigned int device)
+{
+    if (!m_enabled)
+        return;
+
+    long long offset = (device < m_device_offsets.size()) ? m_device_offsets[device] : 0;
+    ProfileEvent event = {(unsigned int) stage, frame, -1 - (int) device, (long long) start + offset, (long long) end + offset};
+    push(event);
+}
+
+/*
+ * Offset between the clock of the OpenCL events of a device and the host
+ * one, from a device timestamp taken at host time host_time. Called before
+ * the device records.
+ */
+void Profiler::setDeviceClock(unsigned long long device_time, long long host_time, unsigned int device)
+{
+    if (device >= m_device_offsets.size())
+        m_device_offsets.resize(device + 1, 0);
+
+    m_device_offsets[device] = host_time - (long long) device_time;
+}
+
+// Events in the ring (the last capacity ones), by start time
+std::vector<ProfileEvent> Profiler::getEvents()
+{
+    std::vector<ProfileEvent> events(m_events.begin(), m_events.begin() + std::min<unsigned long>(m_next.load(), m_events.size()));
+    std::sort(events.begin(), events.end(), [](const ProfileEvent& a, const ProfileEvent& b) { return a.start < b.start; });
+
+    return events;
+}
+
+unsigned long Profiler::getOverruns()
+{
+    unsigned long count = m_next.load();
+    return (count > m_events.size()) ? (count - m_events.size()) : 0;
+}
+
+unsigned long Profiler::getGeneration()
+{
+    return m_events.empty() ? 0 : m_next.load()/m_events.size();
+}
+
+bool Profiler::writeChromeTrace(const char* file)
+{
+    FILE* fp = fopen(file, "w");
+    if (!fp)
+        return false;
+
+    std::vector<ProfileEvent> events = getEvents();
+
+    // the host is process 0, the OpenCL device k the process 1 + k
+    int num_devices = 0;
+    for (size_t k=0; k<events.size(); k++)
+        num_devices = std::max(num_devices, -events[k].thread);
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    fprintf(fp, "  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"name\": \"Host\"}}");
+    for (int d=0; d<num_devices; d++)
+    {
+        fprintf(fp, ",\n  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": \"OpenCL device %d\"}}", 1 + d, d);
+        for (unsigned int s=0; s<PROFILE_STAGES; s++)
+        {
+            if (device_track[s][0] == '\0')
+                continue;
+            fprintf(fp, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                    1 + d, s, device_track[s]);
+        }
+    }
+
+    // complete events ("X"), timestamps in us
+    for (size_t k=0; k<events.size(); k++)
+    {
+        const ProfileEvent& e = events[k];
+        bool device = (e.thread < 0);
+        fprintf(fp, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, "
+                    "\"args\": {\"frame\": %u}}",
+                getStageName((ProfileStage) e.stage), device ? "device" : "host", e.start*1e-3, (e.end - e.start)*1e-3,
+                device ? -e.thread : 0, device ? (int) e.stage : e.thread, e.frame);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+
+    return true;
+}
+
+bool Profiler::writeCsv(const char* file)
+{
+    FILE* fp = fopen(file, "w");
+    if (!fp)
+        return false;
+
+    std::vector<ProfileEvent> events = getEvents();
+
+    // thread is the host thread, or the device for the device intervals
+    fprintf(fp, "frame,stage,source,thread,start_us,end_us,duration_us\n");
+    for (size_t k=0; k<events.size(); k++)
+    {
+        const ProfileEvent& e = events[k];
+        fprintf(fp, "%u,%s,%s,%d,%.3f,%.3f,%.3f\n", e.frame, getStageName((ProfileStage) e.stage), (e.thread < 0) ? "device" : "host",
+                (e.thread < 0) ? (-1 - e.thread) : e.thread, e.start*1e-3, e.end*1e-3, (e.end - e.start)*1e-3);
+    }
+    fclose(fp);
+
+    return true;
+}
+
+/*
+ * Mean and total time of every recorded stage
+ */
+void Profiler::showSummary()
+{
+    unsigned long count = std::min<unsigned long>(m_next.load(), m_events.size());
+    unsigned long num[PROFILE_STAGES] = {0};
+    double total[PROFILE_STAGES] = {0};
+
+    for (unsigned long k=0; k<count; k++)
+    {
+        num[m_events[k].stage]++;
+        total[m_events[k].stage] += (m_events[k].end - m_events[k].start)*1e-6;
+    }
+
+    printf("> Profile (%lu events):\n", count);
+    if (getOverruns() > 0)
+        printf("[WARNING] Profiler ring wrapped %lu times, the %lu oldest events were overwritten (--profile-events)\n",
+               getGeneration(), getOverruns());
+    for (unsigned int s=0; s<PROFILE_STAGES; s++)
+    {
+        if (num[s] > 0)
+            printf("  - %-11s %6lu x %8.3f ms (total %.1f ms)\n", getStageName((ProfileStage) s), num[s], total[s]/num[s], total[s]);
+    }
+}
+
+const char* Profiler::getStageName(ProfileStage stage)
+{
+    switch (stage)
+    {
+        case PROFILE_DECODE: return "decode";
+        case PROFILE_HOST_COPY: return "host_copy";
+        case PROFILE_WRITE: return "write";
+        case PROFILE_KERNEL: return "kernel";
+        case PROFILE_READ: return "read";
+        case PROFILE_NORMALIZE: return "normalize";
+        case PROFILE_OUTPUT: return "output";
+        case PROFILE_QUEUE_WAIT: return "queue_wait";
+        default: return "unknown";
+    }
+}
+
+ProfileScope::ProfileScope(ProfileStage stage)
+{
+    m_stage = stage;
+    m_frame = Profiler::getFrame();
+    m_start = Profiler::isEnabled() ? Profiler::now() : 0;
+}
+
+ProfileScope::ProfileScope(ProfileStage stage, unsigned int frame)
+{
+    m_stage = stage;
+    m_frame = frame;
+    m_start = Profiler::isEnabled() ? Profiler::now() : 0;
+}
+
+ProfileScope::~ProfileScope()
+{
+    if (Profiler::isEnabled())
+        Profiler::record(m_stage, m_frame, m_start, Profiler::now());
+}
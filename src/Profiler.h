@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISPARITYMAP_PROFILER_H
+#define DISPARITYMAP_PROFILER_H
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+enum ProfileStage {
+    PROFILE_DECODE,     // PNG decode of a pair (decoder threads)
+    PROFILE_HOST_COPY,  // host side copies: map/unmap of zero-copy buffers, copy of a map into the writer queue
+    PROFILE_WRITE,      // upload of a pair to the device
+    PROFILE_KERNEL,     // OpenCL kernels, or the C++ engine
+    PROFILE_READ,       // readback of a disparity map
+    PROFILE_NORMALIZE,  // 8-bit normalization of an OpenCL map
+    PROFILE_OUTPUT,     // display and/or queue to the writer
+    PROFILE_QUEUE_WAIT, // frame loop waiting on the loader or the writer queue
+    PROFILE_STAGES
+};
+
+/*
+ * Interval of a stage of a frame, in ns since Profiler::enable(). Device
+ * intervals come from the OpenCL events, moved to the host clock.
+ */
+struct ProfileEvent {
+    unsigned int stage;
+    unsigned int frame;
+    int thread;         // host thread number, -1 - k for the OpenCL device k
+    long long start;
+    long long end;
+};
+
+/*
+ * Per-stage timing of the frames. record() only takes a slot of a ring of
+ * fixed capacity with an atomic increment, so any thread records without a
+ * lock. Past the capacity the ring wraps and the newest events overwrite the
+ * oldest ones, counted as overruns. The events are exported once the threads
+ * are done, as a Chrome trace (chrome://tracing, Perfetto) or as CSV.
+ * Disabled, record() and ProfileScope do nothing.
+ */
+class Profiler {
+
+public:
+    static void enable(size_t capacity);
+    static bool isEnabled();
+
+    // Host time (ns since enable())
+    static long long now();
+
+    // Frame the intervals of the calling thread belong to
+    static void setFrame(unsigned int frame);
+    static unsigned int getFrame();
+
+    static void record(ProfileStage stage, unsigned int frame, long long start, long long end);
+    static void record(ProfileStage stage, long long start, long long end);
+
+    // Device timestamps (ns) of the OpenCL events of a device, aligned with its setDeviceClock()
+    static void recordDevice(ProfileStage stage, unsigned int frame, unsigned long long start, unsigned long long end,
+                             unsigned int device = 0);
+    static void setDeviceClock(unsigned long long device_time, long long host_time, unsigned int device = 0);
+
+    static bool writeChromeTrace(const char* file);
+    static bool writeCsv(const char* file);
+    static void showSummary();
+    // Events overwritten by newer ones, and times the ring wrapped
+    static unsigned long getOverruns();
+    static unsigned long getGeneration();
+
+    static const char* getStageName(ProfileStage stage);
+
+private:
+    static std::vector<ProfileEvent> m_events;
+    static std::atomic<unsigned long> m_next;
+    static std::atomic<int> m_threads;
+    static std::vector<long long> m_device_offsets;
+    static bool m_enabled;
+
+    static std::vector<ProfileEvent> getEvents();
+    static void push(const ProfileEvent& event);
+};
+
+/*
+ * Records the lifetime of the scope as a stage of the current frame (or of
+ * the given one)
+ */
+class ProfileScope {
+
+public:
+    explicit ProfileScope(ProfileStage stage);
+    ProfileScope(ProfileStage stage, unsigned int frame);
+    ~ProfileScope();
+
+private:
+    ProfileStage m_stage;
+    unsigned int m_frame;
+    long long m_start;
+
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#endif //DISPARITYMAP_PROFILER_H
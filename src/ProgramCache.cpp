@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "ProgramCache.h"
+#include "File.h"
+
+// first line of an entry, the second one is its key and the binary follows
+#define CACHE_MAGIC "DisparityMap OpenCL program cache v1"
+#define INFO_BUFFER_LEN 1024
+
+ProgramCache::ProgramCache(const std::string& dir)
+{
+    m_dir = dir;
+}
+
+ProgramCache::~ProgramCache()
+{
+}
+
+// 64-bit FNV-1a
+unsigned long long ProgramCache::hash(const void* data, size_t size, unsigned long long seed)
+{
+    const unsigned char* bytes = (const unsigned char*) data;
+    unsigned long long h = seed;
+
+    for (size_t k=0; k<size; k++)
+    {
+        h ^= bytes[k];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+std::string ProgramCache::getKey(cl_platform_id platform, cl_device_id device, const char* source, size_t source_size,
+                                 const char* options)
+{
+    char platform_version[INFO_BUFFER_LEN] = "";
+    char device_name[INFO_BUFFER_LEN] = "";
+    char device_version[INFO_BUFFER_LEN] = "";
+    char driver_version[INFO_BUFFER_LEN] = "";
+
+    clGetPlatformInfo(platform, CL_PLATFORM_VERSION, INFO_BUFFER_LEN, platform_version, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, INFO_BUFFER_LEN, device_name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_VERSION, INFO_BUFFER_LEN, device_version, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, INFO_BUFFER_LEN, driver_version, NULL);
+
+    if (options == NULL)
+        options = "";
+
+    char source_hash[32];
+    sprintf(source_hash, "%016llx", hash(source, source_size, 0xcbf29ce484222325ULL));
+
+    return std::string(platform_version) + "|" + device_name + "|" + device_version + "|" + driver_version +
+           "|" + source_hash + "|" + options;
+}
+
+std::string ProgramCache::getPath(const std::string& key)
+{
+    char name[32];
+    sprintf(name, "%016llx.bin", hash(key.data(), key.size(), 0xcbf29ce484222325ULL));
+
+    return m_dir + "/" + name;
+}
+
+cl_program ProgramCache::load(cl_context context, cl_device_id device, const std::string& key, const char* options)
+{
+    FILE* fp = fopen(getPath(key).c_str(), "rb");
+    if (!fp)
+        return NULL;
+
+    // the key of the entry must be the one asked for (a hash collision would be another program)
+    std::string header = std::string(CACHE_MAGIC) + "\n" + key + "\n";
+    std::vector<char> stored(header.size());
+    if ( (fread(stored.data(), 1, stored.size(), fp) != stored.size()) || (std::string(stored.begin(), stored.end()) != header) )
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    std::vector<unsigned char> binary;
+    unsigned char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        binary.insert(binary.end(), buffer, buffer + n);
+    fclose(fp);
+
+    if (binary.empty())
+        return NULL;
+
+    cl_int status, binary_status;
+    const unsigned char* binaries[] = {binary.data()};
+    size_t binary_size = binary.size();
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binary_size, binaries, &binary_status, &status);
+    if ( (status != CL_SUCCESS) || (binary_status != CL_SUCCESS) )
+    {
+        if (program != NULL)
+            clReleaseProgram(program);
+        return NULL;
+    }
+
+    // a binary still has to be built (linked) for the device
+    status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+bool ProgramCache::store(cl_program program, const std::string& key)
+{
+    cl_int status;
+    size_t binary_size;
+
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
+    if ( (status != CL_SUCCESS) || (binary_size == 0) )
+        return false;
+
+    std::vector<unsigned char> binary(binary_size);
+    unsigned char* binaries[] = {binary.data()};
+    status = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL);
+    if (status != CL_SUCCESS)
+        return false;
+
+    File dir(m_dir.c_str());
+    if (!dir.exists())
+        dir.mkdirs();
+
+    // written aside and renamed, so a concurrent job never loads half an entry
+    std::string path = getPath(key);
+    std::string tmp_path = path + "." + std::to_string(getpid()) + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    std::string header = std::string(CACHE_MAGIC) + "\n" + key + "\n";
+    bool ok = (fwrite(header.data(), 1, header.size(), fp) == header.size()) &&
+              (fwrite(binary.data(), 1, binary.size(), fp) == binary.size());
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || (rename(tmp_path.c_str(), path.c_str()) != 0))
+    {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
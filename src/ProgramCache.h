@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef DISPARITYMAP_PROGRAMCACHE_H
+#define DISPARITYMAP_PROGRAMCACHE_H
+
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+
+#ifdef FPGA_OCL
+#include "CL/opencl.h"
+#else
+#include <CL/cl.h>
+#endif
+
+#include <string>
+
+/*
+ * On-disk cache of OpenCL program binaries, one file per key in dir. The key
+ * holds the platform, device and driver versions and a hash of the source
+ * and build options, so an update of any of them is a miss. load() gives
+ * NULL on a miss or when the device rejects the binary (stale entry), and
+ * the caller builds from source and store()s the result.
+ */
+class ProgramCache {
+
+public:
+    ProgramCache(const std::string& dir);
+    ~ProgramCache();
+
+    static std::string getKey(cl_platform_id platform, cl_device_id device, const char* source, size_t source_size,
+                              const char* options);
+
+    cl_program load(cl_context context, cl_device_id device, const std::string& key, const char* options);
+    bool store(cl_program program, const std::string& key);
+
+private:
+    std::string m_dir;
+
+    std::string getPath(const std::string& key);
+    static unsigned long long hash(const void* data, size_t size, unsigned long long seed);
+};
+
+#endif //DISPARITYMAP_PROGRAMCACHE_H
@@ -0,0 +1,771 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "SIMD_Kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar fallback
+ */
+static void addAbsDiff_scalar(const unsigned char* l, const unsigned char* r, unsigned int* col, int n)
+{
+    for (int x=0; x<n; x++)
+        col[x] += abs(l[x] - r[x]);
+}
+
+static void slideAbsDiff_scalar(const unsigned char* l_in, const unsigned char* r_in,
+                                const unsigned char* l_out, const unsigned char* r_out, unsigned int* col, int n)
+{
+    for (int x=0; x<n; x++)
+        col[x] += abs(l_in[x] - r_in[x]) - abs(l_out[x] - r_out[x]);
+}
+
+static void rollAbsDiff_scalar(const unsigned char* l_in, const unsigned char* r_in, unsigned char* ring, unsigned int* col, int n)
+{
+    for (int x=0; x<n; x++)
+    {
+        unsigned char ad = (unsigned char) abs(l_in[x] - r_in[x]);
+        col[x] += ad - ring[x];
+        ring[x] = ad;
+    }
+}
+
+static void prefixSum_scalar(const unsigned int* col, unsigned int* prefix, int n)
+{
+    prefix[0] = 0;
+    for (int x=0; x<n; x++)
+        prefix[x+1] = prefix[x] + col[x];
+}
+
+static void argminUpdate_scalar(const unsigned int* hi, const unsigned int* lo,
+                                unsigned int* best_cost, unsigned int* best_disp, unsigned int d, int n)
+{
+    for (int x=0; x<n; x++)
+    {
+        unsigned int cost = hi[x] - lo[x];
+        if (cost < best_cost[x])
+        {
+            best_cost[x] = cost;
+            best_disp[x] = d;
+        }
+    }
+}
+
+static void argminUpdateLR_scalar(const unsigned int* hi, const unsigned int* lo,
+                                  unsigned int* best_cost, unsigned int* best_disp,
+                                  unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    for (int x=0; x<n; x++)
+    {
+        unsigned int cost = hi[x] - lo[x];
+        if (cost < best_cost[x])
+        {
+            best_cost[x] = cost;
+            best_disp[x] = d;
+        }
+        if (cost < right_cost[x])
+        {
+            right_cost[x] = cost;
+            right_disp[x] = d;
+        }
+    }
+}
+
+/*
+ * Census matching: the cost of a candidate is the Hamming distance between the
+ * descriptors of the left and right pixels. The compiler emits the popcnt
+ * instruction when the calling kernel is built for it.
+ */
+static inline __attribute__((always_inline))
+void hammingArgminRow(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                      unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    if (right_cost == NULL)
+    {
+        for (int x=0; x<n; x++)
+        {
+            unsigned int cost = (unsigned int) __builtin_popcountll(l[x] ^ r[x]);
+            if (cost < best_cost[x])
+            {
+                best_cost[x] = cost;
+                best_disp[x] = d;
+            }
+        }
+        return;
+    }
+
+    for (int x=0; x<n; x++)
+    {
+        unsigned int cost = (unsigned int) __builtin_popcountll(l[x] ^ r[x]);
+        if (cost < best_cost[x])
+        {
+            best_cost[x] = cost;
+            best_disp[x] = d;
+        }
+        if (cost < right_cost[x])
+        {
+            right_cost[x] = cost;
+            right_disp[x] = d;
+        }
+    }
+}
+
+static void hammingArgmin_scalar(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                                 unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    hammingArgminRow(l, r, best_cost, best_disp, right_cost, right_disp, d, n);
+}
+
+static const SIMD_Kernels kernels_scalar = {
+    SIMD_ISA_SCALAR, addAbsDiff_scalar, slideAbsDiff_scalar, rollAbsDiff_scalar, prefixSum_scalar, argminUpdate_scalar, argminUpdateLR_scalar,
+    hammingArgmin_scalar
+};
+
+#ifdef SIMD_X86
+
+/*
+ * SSE4.1: 16 absolute differences per instruction, 4 costs per lane group
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i absDiff_sse41(__m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+}
+
+__attribute__((target("sse4.1")))
+static void addAbsDiff_sse41(const unsigned char* l, const unsigned char* r, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m128i ad = absDiff_sse41(_mm_loadu_si128((const __m128i*) (l + x)), _mm_loadu_si128((const __m128i*) (r + x)));
+        for (int k=0; k<4; k++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i*) (col + x + 4*k));
+            c = _mm_add_epi32(c, _mm_cvtepu8_epi32(ad));
+            _mm_storeu_si128((__m128i*) (col + x + 4*k), c);
+            ad = _mm_srli_si128(ad, 4);
+        }
+    }
+    addAbsDiff_scalar(l + x, r + x, col + x, n - x);
+}
+
+__attribute__((target("sse4.1")))
+static void slideAbsDiff_sse41(const unsigned char* l_in, const unsigned char* r_in,
+                               const unsigned char* l_out, const unsigned char* r_out, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m128i ad_in = absDiff_sse41(_mm_loadu_si128((const __m128i*) (l_in + x)), _mm_loadu_si128((const __m128i*) (r_in + x)));
+        __m128i ad_out = absDiff_sse41(_mm_loadu_si128((const __m128i*) (l_out + x)), _mm_loadu_si128((const __m128i*) (r_out + x)));
+        for (int k=0; k<4; k++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i*) (col + x + 4*k));
+            c = _mm_add_epi32(c, _mm_cvtepu8_epi32(ad_in));
+            c = _mm_sub_epi32(c, _mm_cvtepu8_epi32(ad_out));
+            _mm_storeu_si128((__m128i*) (col + x + 4*k), c);
+            ad_in = _mm_srli_si128(ad_in, 4);
+            ad_out = _mm_srli_si128(ad_out, 4);
+        }
+    }
+    slideAbsDiff_scalar(l_in + x, r_in + x, l_out + x, r_out + x, col + x, n - x);
+}
+
+__attribute__((target("sse4.1")))
+static void rollAbsDiff_sse41(const unsigned char* l_in, const unsigned char* r_in, unsigned char* ring, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m128i ad_in = absDiff_sse41(_mm_loadu_si128((const __m128i*) (l_in + x)), _mm_loadu_si128((const __m128i*) (r_in + x)));
+        __m128i ad_out = _mm_loadu_si128((const __m128i*) (ring + x));
+        _mm_storeu_si128((__m128i*) (ring + x), ad_in);
+        for (int k=0; k<4; k++)
+        {
+            __m128i c = _mm_loadu_si128((const __m128i*) (col + x + 4*k));
+            c = _mm_add_epi32(c, _mm_cvtepu8_epi32(ad_in));
+            c = _mm_sub_epi32(c, _mm_cvtepu8_epi32(ad_out));
+            _mm_storeu_si128((__m128i*) (col + x + 4*k), c);
+            ad_in = _mm_srli_si128(ad_in, 4);
+            ad_out = _mm_srli_si128(ad_out, 4);
+        }
+    }
+    rollAbsDiff_scalar(l_in + x, r_in + x, ring + x, col + x, n - x);
+}
+
+__attribute__((target("sse4.1")))
+static void prefixSum_sse41(const unsigned int* col, unsigned int* prefix, int n)
+{
+    __m128i carry = _mm_setzero_si128();
+    int x = 0;
+
+    prefix[0] = 0;
+    for (; x+4<=n; x+=4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*) (col + x));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, carry);
+        _mm_storeu_si128((__m128i*) (prefix + x + 1), v);
+        carry = _mm_shuffle_epi32(v, 0xFF);
+    }
+    for (; x<n; x++)
+        prefix[x+1] = prefix[x] + col[x];
+}
+
+__attribute__((target("sse4.1")))
+static void argminUpdate_sse41(const unsigned int* hi, const unsigned int* lo,
+                               unsigned int* best_cost, unsigned int* best_disp, unsigned int d, int n)
+{
+    const __m128i disp = _mm_set1_epi32((int) d);
+    int x = 0;
+    for (; x+4<=n; x+=4)
+    {
+        __m128i cost = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (hi + x)), _mm_loadu_si128((const __m128i*) (lo + x)));
+        __m128i bc = _mm_loadu_si128((const __m128i*) (best_cost + x));
+        __m128i bd = _mm_loadu_si128((const __m128i*) (best_disp + x));
+        // unsigned less-than: min(cost, bc) != bc
+        __m128i lt = _mm_andnot_si128(_mm_cmpeq_epi32(_mm_min_epu32(cost, bc), bc), _mm_set1_epi32(-1));
+        _mm_storeu_si128((__m128i*) (best_cost + x), _mm_min_epu32(cost, bc));
+        _mm_storeu_si128((__m128i*) (best_disp + x), _mm_blendv_epi8(bd, disp, lt));
+    }
+    argminUpdate_scalar(hi + x, lo + x, best_cost + x, best_disp + x, d, n - x);
+}
+
+__attribute__((target("sse4.1")))
+static inline void argminStore_sse41(__m128i cost, __m128i disp, unsigned int* best_cost, unsigned int* best_disp)
+{
+    __m128i bc = _mm_loadu_si128((const __m128i*) best_cost);
+    __m128i bd = _mm_loadu_si128((const __m128i*) best_disp);
+    __m128i min = _mm_min_epu32(cost, bc);
+    __m128i ge = _mm_cmpeq_epi32(min, bc);
+    _mm_storeu_si128((__m128i*) best_cost, min);
+    _mm_storeu_si128((__m128i*) best_disp, _mm_blendv_epi8(disp, bd, ge));
+}
+
+__attribute__((target("sse4.1")))
+static void argminUpdateLR_sse41(const unsigned int* hi, const unsigned int* lo,
+                                 unsigned int* best_cost, unsigned int* best_disp,
+                                 unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    const __m128i disp = _mm_set1_epi32((int) d);
+    int x = 0;
+    for (; x+4<=n; x+=4)
+    {
+        __m128i cost = _mm_sub_epi32(_mm_loadu_si128((const __m128i*) (hi + x)), _mm_loadu_si128((const __m128i*) (lo + x)));
+        argminStore_sse41(cost, disp, best_cost + x, best_disp + x);
+        argminStore_sse41(cost, disp, right_cost + x, right_disp + x);
+    }
+    argminUpdateLR_scalar(hi + x, lo + x, best_cost + x, best_disp + x, right_cost + x, right_disp + x, d, n - x);
+}
+
+static const SIMD_Kernels kernels_sse41 = {
+    SIMD_ISA_SSE41, addAbsDiff_sse41, slideAbsDiff_sse41, rollAbsDiff_sse41, prefixSum_sse41, argminUpdate_sse41, argminUpdateLR_sse41,
+    hammingArgmin_scalar
+};
+
+/*
+ * AVX2: 32 absolute differences per instruction, 8 costs per lane group
+ */
+__attribute__((target("avx2")))
+static inline __m256i absDiff_avx2(__m256i a, __m256i b)
+{
+    return _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+}
+
+__attribute__((target("avx2")))
+static void addAbsDiff_avx2(const unsigned char* l, const unsigned char* r, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+32<=n; x+=32)
+    {
+        __m256i ad = absDiff_avx2(_mm256_loadu_si256((const __m256i*) (l + x)), _mm256_loadu_si256((const __m256i*) (r + x)));
+        __m128i half[2] = { _mm256_castsi256_si128(ad), _mm256_extracti128_si256(ad, 1) };
+        for (int k=0; k<4; k++)
+        {
+            __m128i bytes = (k & 1) ? _mm_srli_si128(half[k >> 1], 8) : half[k >> 1];
+            __m256i c = _mm256_loadu_si256((const __m256i*) (col + x + 8*k));
+            c = _mm256_add_epi32(c, _mm256_cvtepu8_epi32(bytes));
+            _mm256_storeu_si256((__m256i*) (col + x + 8*k), c);
+        }
+    }
+    addAbsDiff_scalar(l + x, r + x, col + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void slideAbsDiff_avx2(const unsigned char* l_in, const unsigned char* r_in,
+                              const unsigned char* l_out, const unsigned char* r_out, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+32<=n; x+=32)
+    {
+        __m256i ad_in = absDiff_avx2(_mm256_loadu_si256((const __m256i*) (l_in + x)), _mm256_loadu_si256((const __m256i*) (r_in + x)));
+        __m256i ad_out = absDiff_avx2(_mm256_loadu_si256((const __m256i*) (l_out + x)), _mm256_loadu_si256((const __m256i*) (r_out + x)));
+        __m128i half_in[2] = { _mm256_castsi256_si128(ad_in), _mm256_extracti128_si256(ad_in, 1) };
+        __m128i half_out[2] = { _mm256_castsi256_si128(ad_out), _mm256_extracti128_si256(ad_out, 1) };
+        for (int k=0; k<4; k++)
+        {
+            __m128i bytes_in = (k & 1) ? _mm_srli_si128(half_in[k >> 1], 8) : half_in[k >> 1];
+            __m128i bytes_out = (k & 1) ? _mm_srli_si128(half_out[k >> 1], 8) : half_out[k >> 1];
+            __m256i c = _mm256_loadu_si256((const __m256i*) (col + x + 8*k));
+            c = _mm256_add_epi32(c, _mm256_cvtepu8_epi32(bytes_in));
+            c = _mm256_sub_epi32(c, _mm256_cvtepu8_epi32(bytes_out));
+            _mm256_storeu_si256((__m256i*) (col + x + 8*k), c);
+        }
+    }
+    slideAbsDiff_scalar(l_in + x, r_in + x, l_out + x, r_out + x, col + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void rollAbsDiff_avx2(const unsigned char* l_in, const unsigned char* r_in, unsigned char* ring, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+32<=n; x+=32)
+    {
+        __m256i ad_in = absDiff_avx2(_mm256_loadu_si256((const __m256i*) (l_in + x)), _mm256_loadu_si256((const __m256i*) (r_in + x)));
+        __m256i ad_out = _mm256_loadu_si256((const __m256i*) (ring + x));
+        _mm256_storeu_si256((__m256i*) (ring + x), ad_in);
+        __m128i half_in[2] = { _mm256_castsi256_si128(ad_in), _mm256_extracti128_si256(ad_in, 1) };
+        __m128i half_out[2] = { _mm256_castsi256_si128(ad_out), _mm256_extracti128_si256(ad_out, 1) };
+        for (int k=0; k<4; k++)
+        {
+            __m128i bytes_in = (k & 1) ? _mm_srli_si128(half_in[k >> 1], 8) : half_in[k >> 1];
+            __m128i bytes_out = (k & 1) ? _mm_srli_si128(half_out[k >> 1], 8) : half_out[k >> 1];
+            __m256i c = _mm256_loadu_si256((const __m256i*) (col + x + 8*k));
+            c = _mm256_add_epi32(c, _mm256_cvtepu8_epi32(bytes_in));
+            c = _mm256_sub_epi32(c, _mm256_cvtepu8_epi32(bytes_out));
+            _mm256_storeu_si256((__m256i*) (col + x + 8*k), c);
+        }
+    }
+    rollAbsDiff_scalar(l_in + x, r_in + x, ring + x, col + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void prefixSum_avx2(const unsigned int* col, unsigned int* prefix, int n)
+{
+    const __m256i last_low = _mm256_set1_epi32(3);
+    const __m256i last = _mm256_set1_epi32(7);
+    __m256i carry = _mm256_setzero_si256();
+    int x = 0;
+
+    prefix[0] = 0;
+    for (; x+8<=n; x+=8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (col + x));
+        // prefix inside each 128-bit lane, then carry the low lane into the high one
+        v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+        v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+        v = _mm256_add_epi32(v, _mm256_blend_epi32(_mm256_setzero_si256(), _mm256_permutevar8x32_epi32(v, last_low), 0xF0));
+        v = _mm256_add_epi32(v, carry);
+        _mm256_storeu_si256((__m256i*) (prefix + x + 1), v);
+        carry = _mm256_permutevar8x32_epi32(v, last);
+    }
+    for (; x<n; x++)
+        prefix[x+1] = prefix[x] + col[x];
+}
+
+__attribute__((target("avx2")))
+static void argminUpdate_avx2(const unsigned int* hi, const unsigned int* lo,
+                              unsigned int* best_cost, unsigned int* best_disp, unsigned int d, int n)
+{
+    const __m256i disp = _mm256_set1_epi32((int) d);
+    int x = 0;
+    for (; x+8<=n; x+=8)
+    {
+        __m256i cost = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (hi + x)), _mm256_loadu_si256((const __m256i*) (lo + x)));
+        __m256i bc = _mm256_loadu_si256((const __m256i*) (best_cost + x));
+        __m256i bd = _mm256_loadu_si256((const __m256i*) (best_disp + x));
+        __m256i min = _mm256_min_epu32(cost, bc);
+        __m256i ge = _mm256_cmpeq_epi32(min, bc);
+        _mm256_storeu_si256((__m256i*) (best_cost + x), min);
+        _mm256_storeu_si256((__m256i*) (best_disp + x), _mm256_blendv_epi8(disp, bd, ge));
+    }
+    argminUpdate_scalar(hi + x, lo + x, best_cost + x, best_disp + x, d, n - x);
+}
+
+__attribute__((target("avx2")))
+static inline void argminStore_avx2(__m256i cost, __m256i disp, unsigned int* best_cost, unsigned int* best_disp)
+{
+    __m256i bc = _mm256_loadu_si256((const __m256i*) best_cost);
+    __m256i bd = _mm256_loadu_si256((const __m256i*) best_disp);
+    __m256i min = _mm256_min_epu32(cost, bc);
+    __m256i ge = _mm256_cmpeq_epi32(min, bc);
+    _mm256_storeu_si256((__m256i*) best_cost, min);
+    _mm256_storeu_si256((__m256i*) best_disp, _mm256_blendv_epi8(disp, bd, ge));
+}
+
+__attribute__((target("avx2")))
+static void argminUpdateLR_avx2(const unsigned int* hi, const unsigned int* lo,
+                                unsigned int* best_cost, unsigned int* best_disp,
+                                unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    const __m256i disp = _mm256_set1_epi32((int) d);
+    int x = 0;
+    for (; x+8<=n; x+=8)
+    {
+        __m256i cost = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*) (hi + x)), _mm256_loadu_si256((const __m256i*) (lo + x)));
+        argminStore_avx2(cost, disp, best_cost + x, best_disp + x);
+        argminStore_avx2(cost, disp, right_cost + x, right_disp + x);
+    }
+    argminUpdateLR_scalar(hi + x, lo + x, best_cost + x, best_disp + x, right_cost + x, right_disp + x, d, n - x);
+}
+
+// every AVX2 CPU has the popcnt instruction (SSE4.1 alone does not guarantee it), used for the row tails
+__attribute__((target("popcnt")))
+static void hammingArgmin_popcnt(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                                 unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    hammingArgminRow(l, r, best_cost, best_disp, right_cost, right_disp, d, n);
+}
+
+// bits set in each 64-bit lane, with a 4-bit lookup table
+__attribute__((target("avx2")))
+static inline __m256i popcount64_avx2(__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                                  _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    return _mm256_sad_epu8(cnt, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static void hammingArgmin_avx2(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                               unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    const __m256i disp = _mm256_set1_epi32((int) d);
+    const __m256i order = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    int x = 0;
+    for (; x+8<=n; x+=8)
+    {
+        __m256i a = popcount64_avx2(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (l + x)), _mm256_loadu_si256((const __m256i*) (r + x))));
+        __m256i b = popcount64_avx2(_mm256_xor_si256(_mm256_loadu_si256((const __m256i*) (l + x + 4)), _mm256_loadu_si256((const __m256i*) (r + x + 4))));
+        // 8 costs of 32 bits in pixel order
+        __m256i cost = _mm256_permutevar8x32_epi32(_mm256_blend_epi32(a, _mm256_slli_epi64(b, 32), 0xAA), order);
+        argminStore_avx2(cost, disp, best_cost + x, best_disp + x);
+        if (right_cost != NULL)
+            argminStore_avx2(cost, disp, right_cost + x, right_disp + x);
+    }
+    hammingArgmin_popcnt(l + x, r + x, best_cost + x, best_disp + x,
+                         (right_cost != NULL) ? (right_cost + x) : NULL, (right_disp != NULL) ? (right_disp + x) : NULL, d, n - x);
+}
+
+static const SIMD_Kernels kernels_avx2 = {
+    SIMD_ISA_AVX2, addAbsDiff_avx2, slideAbsDiff_avx2, rollAbsDiff_avx2, prefixSum_avx2, argminUpdate_avx2, argminUpdateLR_avx2,
+    hammingArgmin_avx2
+};
+
+/*
+ * AVX-512BW: 64 absolute differences per instruction, 16 costs per lane group
+ */
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i absDiff_avx512(__m512i a, __m512i b)
+{
+    return _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void addAbsDiff_avx512(const unsigned char* l, const unsigned char* r, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+64<=n; x+=64)
+    {
+        __m512i ad = absDiff_avx512(_mm512_loadu_si512((const void*) (l + x)), _mm512_loadu_si512((const void*) (r + x)));
+        __m512i c;
+        c = _mm512_add_epi32(_mm512_loadu_si512((const void*) (col + x)), _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(ad, 0)));
+        _mm512_storeu_si512((void*) (col + x), c);
+        c = _mm512_add_epi32(_mm512_loadu_si512((const void*) (col + x + 16)), _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(ad, 1)));
+        _mm512_storeu_si512((void*) (col + x + 16), c);
+        c = _mm512_add_epi32(_mm512_loadu_si512((const void*) (col + x + 32)), _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(ad, 2)));
+        _mm512_storeu_si512((void*) (col + x + 32), c);
+        c = _mm512_add_epi32(_mm512_loadu_si512((const void*) (col + x + 48)), _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(ad, 3)));
+        _mm512_storeu_si512((void*) (col + x + 48), c);
+    }
+    addAbsDiff_scalar(l + x, r + x, col + x, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void slideLane_avx512(unsigned int* col, __m128i in, __m128i out)
+{
+    __m512i c = _mm512_loadu_si512((const void*) col);
+    c = _mm512_add_epi32(c, _mm512_cvtepu8_epi32(in));
+    c = _mm512_sub_epi32(c, _mm512_cvtepu8_epi32(out));
+    _mm512_storeu_si512((void*) col, c);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void slideAbsDiff_avx512(const unsigned char* l_in, const unsigned char* r_in,
+                                const unsigned char* l_out, const unsigned char* r_out, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+64<=n; x+=64)
+    {
+        __m512i ad_in = absDiff_avx512(_mm512_loadu_si512((const void*) (l_in + x)), _mm512_loadu_si512((const void*) (r_in + x)));
+        __m512i ad_out = absDiff_avx512(_mm512_loadu_si512((const void*) (l_out + x)), _mm512_loadu_si512((const void*) (r_out + x)));
+        slideLane_avx512(col + x, _mm512_extracti32x4_epi32(ad_in, 0), _mm512_extracti32x4_epi32(ad_out, 0));
+        slideLane_avx512(col + x + 16, _mm512_extracti32x4_epi32(ad_in, 1), _mm512_extracti32x4_epi32(ad_out, 1));
+        slideLane_avx512(col + x + 32, _mm512_extracti32x4_epi32(ad_in, 2), _mm512_extracti32x4_epi32(ad_out, 2));
+        slideLane_avx512(col + x + 48, _mm512_extracti32x4_epi32(ad_in, 3), _mm512_extracti32x4_epi32(ad_out, 3));
+    }
+    slideAbsDiff_scalar(l_in + x, r_in + x, l_out + x, r_out + x, col + x, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void rollAbsDiff_avx512(const unsigned char* l_in, const unsigned char* r_in, unsigned char* ring, unsigned int* col, int n)
+{
+    int x = 0;
+    for (; x+64<=n; x+=64)
+    {
+        __m512i ad_in = absDiff_avx512(_mm512_loadu_si512((const void*) (l_in + x)), _mm512_loadu_si512((const void*) (r_in + x)));
+        __m512i ad_out = _mm512_loadu_si512((const void*) (ring + x));
+        _mm512_storeu_si512((void*) (ring + x), ad_in);
+        slideLane_avx512(col + x, _mm512_extracti32x4_epi32(ad_in, 0), _mm512_extracti32x4_epi32(ad_out, 0));
+        slideLane_avx512(col + x + 16, _mm512_extracti32x4_epi32(ad_in, 1), _mm512_extracti32x4_epi32(ad_out, 1));
+        slideLane_avx512(col + x + 32, _mm512_extracti32x4_epi32(ad_in, 2), _mm512_extracti32x4_epi32(ad_out, 2));
+        slideLane_avx512(col + x + 48, _mm512_extracti32x4_epi32(ad_in, 3), _mm512_extracti32x4_epi32(ad_out, 3));
+    }
+    rollAbsDiff_scalar(l_in + x, r_in + x, ring + x, col + x, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void prefixSum_avx512(const unsigned int* col, unsigned int* prefix, int n)
+{
+    const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i last = _mm512_set1_epi32(15);
+    __m512i carry = _mm512_setzero_si512();
+    int x = 0;
+
+    prefix[0] = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m512i v = _mm512_loadu_si512((const void*) (col + x));
+        for (int s=1; s<16; s<<=1)
+        {
+            __mmask16 m = (__mmask16) (0xFFFF << s);
+            v = _mm512_add_epi32(v, _mm512_maskz_permutexvar_epi32(m, _mm512_sub_epi32(iota, _mm512_set1_epi32(s)), v));
+        }
+        v = _mm512_add_epi32(v, carry);
+        _mm512_storeu_si512((void*) (prefix + x + 1), v);
+        carry = _mm512_permutexvar_epi32(last, v);
+    }
+    for (; x<n; x++)
+        prefix[x+1] = prefix[x] + col[x];
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void argminUpdate_avx512(const unsigned int* hi, const unsigned int* lo,
+                                unsigned int* best_cost, unsigned int* best_disp, unsigned int d, int n)
+{
+    const __m512i disp = _mm512_set1_epi32((int) d);
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m512i cost = _mm512_sub_epi32(_mm512_loadu_si512((const void*) (hi + x)), _mm512_loadu_si512((const void*) (lo + x)));
+        __m512i bc = _mm512_loadu_si512((const void*) (best_cost + x));
+        __mmask16 lt = _mm512_cmplt_epu32_mask(cost, bc);
+        _mm512_mask_storeu_epi32((void*) (best_cost + x), lt, cost);
+        _mm512_mask_storeu_epi32((void*) (best_disp + x), lt, disp);
+    }
+    argminUpdate_scalar(hi + x, lo + x, best_cost + x, best_disp + x, d, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void argminUpdateLR_avx512(const unsigned int* hi, const unsigned int* lo,
+                                  unsigned int* best_cost, unsigned int* best_disp,
+                                  unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    const __m512i disp = _mm512_set1_epi32((int) d);
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m512i cost = _mm512_sub_epi32(_mm512_loadu_si512((const void*) (hi + x)), _mm512_loadu_si512((const void*) (lo + x)));
+        __mmask16 lt = _mm512_cmplt_epu32_mask(cost, _mm512_loadu_si512((const void*) (best_cost + x)));
+        _mm512_mask_storeu_epi32((void*) (best_cost + x), lt, cost);
+        _mm512_mask_storeu_epi32((void*) (best_disp + x), lt, disp);
+        lt = _mm512_cmplt_epu32_mask(cost, _mm512_loadu_si512((const void*) (right_cost + x)));
+        _mm512_mask_storeu_epi32((void*) (right_cost + x), lt, cost);
+        _mm512_mask_storeu_epi32((void*) (right_disp + x), lt, disp);
+    }
+    argminUpdateLR_scalar(hi + x, lo + x, best_cost + x, best_disp + x, right_cost + x, right_disp + x, d, n - x);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i popcount64_avx512(__m512i v)
+{
+    const __m512i lut = _mm512_broadcast_i32x4(_mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4));
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    __m512i cnt = _mm512_add_epi8(_mm512_shuffle_epi8(lut, _mm512_and_si512(v, low)),
+                                  _mm512_shuffle_epi8(lut, _mm512_and_si512(_mm512_srli_epi16(v, 4), low)));
+    return _mm512_sad_epu8(cnt, _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void hammingArgmin_avx512(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                                 unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n)
+{
+    const __m512i disp = _mm512_set1_epi32((int) d);
+    const __m512i order = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    int x = 0;
+    for (; x+16<=n; x+=16)
+    {
+        __m512i a = popcount64_avx512(_mm512_xor_si512(_mm512_loadu_si512((const void*) (l + x)), _mm512_loadu_si512((const void*) (r + x))));
+        __m512i b = popcount64_avx512(_mm512_xor_si512(_mm512_loadu_si512((const void*) (l + x + 8)), _mm512_loadu_si512((const void*) (r + x + 8))));
+        // 16 costs of 32 bits in pixel order
+        __m512i cost = _mm512_permutex2var_epi32(a, order, b);
+        __mmask16 lt = _mm512_cmplt_epu32_mask(cost, _mm512_loadu_si512((const void*) (best_cost + x)));
+        _mm512_mask_storeu_epi32((void*) (best_cost + x), lt, cost);
+        _mm512_mask_storeu_epi32((void*) (best_disp + x), lt, disp);
+        if (right_cost != NULL)
+        {
+            lt = _mm512_cmplt_epu32_mask(cost, _mm512_loadu_si512((const void*) (right_cost + x)));
+            _mm512_mask_storeu_epi32((void*) (right_cost + x), lt, cost);
+            _mm512_mask_storeu_epi32((void*) (right_disp + x), lt, disp);
+        }
+    }
+    hammingArgmin_popcnt(l + x, r + x, best_cost + x, best_disp + x,
+                         (right_cost != NULL) ? (right_cost + x) : NULL, (right_disp != NULL) ? (right_disp + x) : NULL, d, n - x);
+}
+
+static const SIMD_Kernels kernels_avx512 = {
+    SIMD_ISA_AVX512BW, addAbsDiff_avx512, slideAbsDiff_avx512, rollAbsDiff_avx512, prefixSum_avx512, argminUpdate_avx512, argminUpdateLR_avx512,
+    hammingArgmin_avx512
+};
+
+#endif // SIMD_X86
+
+std::atomic<const SIMD_Kernels*> SIMD_Dispatch::m_kernels(NULL);
+std::mutex SIMD_Dispatch::m_mutex;
+
+/*
+ * Widest instruction set supported by the CPU (and enabled by the OS)
+ */
+SIMD_Isa SIMD_Dispatch::detect()
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return SIMD_ISA_AVX512BW;
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return SIMD_ISA_SSE41;
+#endif
+    return SIMD_ISA_SCALAR;
+}
+
+/*
+ * Select the kernels of an instruction set. It is clamped to the one detected
+ * at runtime, so the returned value is the ISA really in use.
+ */
+SIMD_Isa SIMD_Dispatch::select(SIMD_Isa isa)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    return selectLocked(isa)->isa;
+}
+
+// select() with m_mutex held
+const SIMD_Kernels* SIMD_Dispatch::selectLocked(SIMD_Isa isa)
+{
+    SIMD_Isa supported = detect();
+    if (isa > supported)
+        isa = supported;
+
+    const SIMD_Kernels* kernels;
+    switch (isa)
+    {
+#ifdef SIMD_X86
+        case SIMD_ISA_AVX512BW:
+            kernels = &kernels_avx512;
+            break;
+        case SIMD_ISA_AVX2:
+            kernels = &kernels_avx2;
+            break;
+        case SIMD_ISA_SSE41:
+            kernels = &kernels_sse41;
+            break;
+#endif
+        default:
+            kernels = &kernels_scalar;
+    }
+
+    m_kernels.store(kernels, std::memory_order_release);
+    return kernels;
+}
+
+SIMD_Isa SIMD_Dispatch::getIsa()
+{
+    return getKernels().isa;
+}
+
+const SIMD_Kernels& SIMD_Dispatch::getKernels()
+{
+    const SIMD_Kernels* kernels = m_kernels.load(std::memory_order_acquire);
+    if (kernels == NULL)
+    {
+        // first use, possibly from several pool threads: one of them selects, the others see its table
+        std::lock_guard<std::mutex> lock(m_mutex);
+        kernels = m_kernels.load(std::memory_order_acquire);
+        if (kernels == NULL)
+            kernels = selectLocked(detect());
+    }
+
+    return *kernels;
+}
+
+const char* SIMD_Dispatch::getIsaName(SIMD_Isa isa)
+{
+    switch (isa)
+    {
+        case SIMD_ISA_SCALAR:
+            return "scalar";
+        case SIMD_ISA_SSE41:
+            return "sse4.1";
+        case SIMD_ISA_AVX2:
+            return "avx2";
+        case SIMD_ISA_AVX512BW:
+            return "avx512bw";
+    }
+
+    return "unknown";
+}
+
+bool SIMD_Dispatch::parseIsa(const char* name, SIMD_Isa& isa)
+{
+    if (!strcmp(name, "scalar"))
+        isa = SIMD_ISA_SCALAR;
+    else if (!strcmp(name, "sse4.1"))
+        isa = SIMD_ISA_SSE41;
+    else if (!strcmp(name, "avx2"))
+        isa = SIMD_ISA_AVX2;
+    else if (!strcmp(name, "avx512bw"))
+        isa = SIMD_ISA_AVX512BW;
+    else
+        return false;
+
+    return true;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_SIMD_KERNELS_H
+#define DISPARITYMAP_SIMD_KERNELS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+/*
+ * Instruction sets with a vectorized implementation of the matching-cost
+ * kernels. They are sorted, a higher value is a wider vector unit.
+ */
+enum SIMD_Isa {
+    SIMD_ISA_SCALAR,
+    SIMD_ISA_SSE41,
+    SIMD_ISA_AVX2,
+    SIMD_ISA_AVX512BW
+};
+
+/*
+ * Matching-cost primitives used by the box-filter, rolling and census engines.
+ * All of them work along a row of n pixels and give the same result in every ISA.
+ */
+struct SIMD_Kernels {
+    SIMD_Isa isa;
+
+    // col[x] += |l[x] - r[x]|
+    void (*addAbsDiff)(const unsigned char* l, const unsigned char* r, unsigned int* col, int n);
+
+    // col[x] += |l_in[x] - r_in[x]| - |l_out[x] - r_out[x]|
+    void (*slideAbsDiff)(const unsigned char* l_in, const unsigned char* r_in,
+                         const unsigned char* l_out, const unsigned char* r_out, unsigned int* col, int n);
+
+    // ad = |l_in[x] - r_in[x]|; col[x] += ad - ring[x]; ring[x] = ad (ring keeps the outgoing row)
+    void (*rollAbsDiff)(const unsigned char* l_in, const unsigned char* r_in, unsigned char* ring, unsigned int* col, int n);
+
+    // prefix[0] = 0, prefix[x+1] = prefix[x] + col[x]
+    void (*prefixSum)(const unsigned int* col, unsigned int* prefix, int n);
+
+    // cost = hi[x] - lo[x]; if cost < best_cost[x] then best_cost[x] = cost, best_disp[x] = d
+    void (*argminUpdate)(const unsigned int* hi, const unsigned int* lo,
+                         unsigned int* best_cost, unsigned int* best_disp, unsigned int d, int n);
+
+    // argminUpdate of the left (best_*) and right-referenced (right_*) disparities with the same costs
+    void (*argminUpdateLR)(const unsigned int* hi, const unsigned int* lo,
+                           unsigned int* best_cost, unsigned int* best_disp,
+                           unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n);
+
+    // cost = popcount(l[x] ^ r[x]), argminUpdate of best_* and, when right_cost is not NULL, of right_*
+    void (*hammingArgmin)(const uint64_t* l, const uint64_t* r, unsigned int* best_cost, unsigned int* best_disp,
+                          unsigned int* right_cost, unsigned int* right_disp, unsigned int d, int n);
+};
+
+/*
+ * Kernels of the selected ISA. The first getKernels() selects the detected one;
+ * it is reached from the pool threads, so the table is published atomically and
+ * select() and the first initialization are serialized by the same mutex.
+ */
+class SIMD_Dispatch {
+
+public:
+    static SIMD_Isa detect();
+    static SIMD_Isa select(SIMD_Isa isa);
+    static SIMD_Isa getIsa();
+    static const SIMD_Kernels& getKernels();
+
+    static const char* getIsaName(SIMD_Isa isa);
+    static bool parseIsa(const char* name, SIMD_Isa& isa);
+
+private:
+    static std::atomic<const SIMD_Kernels*> m_kernels;
+    static std::mutex m_mutex;
+
+    static const SIMD_Kernels* selectLocked(SIMD_Isa isa);
+};
+
+#endif //DISPARITYMAP_SIMD_KERNELS_H
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(unsigned int num_threads)
+{
+    m_task = NULL;
+    m_context = NULL;
+    m_num_tasks = 0;
+    m_next_task = 0;
+    m_active = 0;
+    m_generation = 0;
+    m_stop = false;
+
+    for (unsigned int k=1; k<num_threads; k++)
+        m_workers.push_back(std::thread(&ThreadPool::worker, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv_start.notify_all();
+
+    for (size_t k=0; k<m_workers.size(); k++)
+        m_workers[k].join();
+}
+
+unsigned int ThreadPool::getNumThreads()
+{
+    return (unsigned int) m_workers.size() + 1;
+}
+
+void ThreadPool::run(Task task, void* context, unsigned int num_tasks)
+{
+    if (m_workers.empty() || (num_tasks <= 1))
+    {
+        for (unsigned int k=0; k<num_tasks; k++)
+            task(context, k);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = task;
+        m_context = context;
+        m_num_tasks = num_tasks;
+        m_next_task = 0;
+        m_active = (unsigned int) m_workers.size();
+        m_generation++;
+    }
+    m_cv_start.notify_all();
+
+    work();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv_done.wait(lock, [this] { return m_active == 0; });
+}
+
+void ThreadPool::worker()
+{
+    unsigned long generation = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv_start.wait(lock, [this, generation] { return m_stop || (m_generation != generation); });
+            if (m_stop)
+                return;
+            generation = m_generation;
+        }
+
+        work();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_active == 0)
+                m_cv_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::work()
+{
+    unsigned int k;
+    while ((k = m_next_task++) < m_num_tasks)
+        m_task(m_context, k);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2018 Universitat Autonoma de Barcelona 
+ * Arnau Casadevall Saiz <arnau.casadevall@uab.cat>
+ * 
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISPARITYMAP_THREADPOOL_H
+#define DISPARITYMAP_THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/*
+ * Persistent pool of worker threads. The threads are created once and wait
+ * for work between calls to run(), so the pool can be reused every frame.
+ */
+class ThreadPool {
+
+public:
+    typedef void (*Task)(void* context, unsigned int index);
+
+    ThreadPool(unsigned int num_threads);
+    ~ThreadPool();
+
+    unsigned int getNumThreads();
+
+    // Call task(context, k) for every k in [0, num_tasks) and wait until all of them are done.
+    // The calling thread also runs tasks, so num_threads includes it.
+    void run(Task task, void* context, unsigned int num_tasks);
+
+private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_start;
+    std::condition_variable m_cv_done;
+
+    Task m_task;
+    void* m_context;
+    unsigned int m_num_tasks;
+    std::atomic<unsigned int> m_next_task;
+    unsigned int m_active;
+    unsigned long m_generation;
+    bool m_stop;
+
+    void worker();
+    void work();
+};
+
+#endif //DISPARITYMAP_THREADPOOL_H
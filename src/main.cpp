@@ -20,12 +20,20 @@
 #include <iostream>
 #include <string>
 #include <chrono>
+#include <deque>
 #include <dirent.h>
 
 #include "BM_Disparity.h"
+#include "DisparityNormalizer.h"
+#include "SIMD_Kernels.h"
 #include "Utils.h"
 #include "OpenCL_Interface.h"
 #include "File.h"
+#include "ImageLoader.h"
+#include "DisparityWriter.h"
+#include "BufferPool.h"
+#include "Profiler.h"
+#include "CoScheduler.h"
 
 #define MAX_SOURCE_SIZE (0x100000)
 
@@ -33,49 +41,638 @@ using namespace std::chrono;
 using namespace std;
 using namespace cv;
 
-static cl_mem left_memobj = NULL;
-static cl_mem right_memobj = NULL;
-static cl_mem disp_memobj = NULL;
+static DisparityWriter* writer = NULL;
 
+// NDRange of the main kernel, given to the OpenCL interface at startup
 #ifdef FPGA_OCL
-std::string OpenCL_Interface::m_kernel_file = "./kernel/DisparityAOCL_640x480";
-std::string OpenCL_Interface::m_kernel_name = "BM_Disparity_WorkGroup";
+static const char* ocl_window = "Image OpenCL_FPGA";
 cl_uint dim_item_size = 1;
 static const size_t global_item_size[] = {1, 1, 1};
 static const size_t local_item_size[] = {1, 1, 1};
 #else
-std::string OpenCL_Interface::m_kernel_file = "./kernel/BM_Disparity-GPU.cl";
-std::string OpenCL_Interface::m_kernel_name = "BM_Disparity";
+static const char* ocl_window = "Image OpenCL_GPU";
 cl_uint dim_item_size = 2;
-static const size_t global_item_size[] = {640, 480, 1};
+static size_t global_item_size[] = {640, 480, 1}; // image size padded to the work-group, set by setupOpenCLBuffers()
 static const size_t local_item_size[] = {20, 15, 1};
 #endif
 
-cl_platform_id OpenCL_Interface::m_platform = NULL;
-cl_device_id OpenCL_Interface::m_device = NULL;
-cl_context OpenCL_Interface::m_context = NULL;
-cl_command_queue OpenCL_Interface::m_command_queue = NULL;
-cl_kernel OpenCL_Interface::m_kernel = NULL;
-cl_program OpenCL_Interface::m_program = NULL;
-
-bool OpenCL_Interface::m_use_opencl_events = true;
-
-cl_uint OpenCL_Interface::m_dim_item_size = dim_item_size;
-const size_t* OpenCL_Interface::m_global_item_size = global_item_size;
-const size_t* OpenCL_Interface::m_local_item_size = local_item_size;
-
 /* Global Arguments */
 unsigned int max_d = 16;
 unsigned int kernel_size = 7;
 bool opencl_vs_cpp = false;
+bool coschedule = false;
 bool use_opencl = false;
 bool use_opencl_events = false;
 bool kernel_info = false;
+BM_Engine engine = BM_ENGINE_NAIVE;
+BM_Cost cost = BM_COST_SAD;
+SIMD_Isa simd_isa = SIMD_Dispatch::detect();
+unsigned int num_threads = 1;
+bool specialized = true;
+bool lr_check = false;
+unsigned int lr_threshold = 1;
+bool fixed_range = false;
+bool device_normalize = false; // the OpenCL maps are normalized on the device, only their 8-bit version is read back
+unsigned int prefetch = 4;
+unsigned int num_decoders = 2;
+unsigned int in_flight = 1;
+bool zero_copy = false;
+bool headless = false;
+const char* output_dir = NULL;
+DisparityFormat output_format = DISPARITY_FORMAT_PNG;
+unsigned int output_queue = 8;
+const char* profile_file = NULL;
+const char* profile_csv = NULL;
+unsigned int profile_events = 65536;
+std::vector<int> device_ids; // OpenCL devices of getDevices(), empty for the default one
+bool all_devices = false;
+bool local_kernel = true; // tiled SAD kernel when the local memory of the devices holds its strips
+
+/*
+ * Frame of the pipelined OpenCL mode (--in-flight): its own device buffers,
+ * the decoded pair (kept alive until its upload is done) and the events of
+ * its commands.
+ */
+struct InFlightFrame {
+    cl_mem left_memobj;
+    cl_mem right_memobj;
+    cl_mem disp_memobj;
+    cl_mem census_left_memobj;
+    cl_mem census_right_memobj;
+    cl_mem norm_memobj;
+    cl_mem max_memobj;
+    unsigned int* disp_image;
+    unsigned char* norm_image; // read back instead of disp_image with --device-normalize
+    StereoFrame frame;
+    cl_event write_left;
+    cl_event write_right;
+    cl_event census;
+    cl_event ndr;
+    cl_event normalize[3];
+    cl_event read;
+    bool busy;
+};
+
+/*
+ * OpenCL device of the frame loop: its interface (context, queues and
+ * programs), buffers, census and normalization kernels, the buffers of the
+ * synchronous path and its frames in flight. With several devices (--device, --all-devices)
+ * the pipelined mode hands each frame to a device with a free slot.
+ */
+struct OpenCLDevice {
+    OpenCL_Interface* openCL;
+    BufferPool* pool;
+    cl_kernel census_kernel;
+    cl_kernel max_kernel;
+    cl_kernel norm_kernel;
+    cl_mem left_memobj;
+    cl_mem right_memobj;
+    cl_mem disp_memobj;
+    cl_mem census_left_memobj;
+    cl_mem census_right_memobj;
+    cl_mem norm_memobj;
+    cl_mem max_memobj;
+    std::vector<InFlightFrame> slots;
+    unsigned int busy;
+    unsigned long frames;
+};
+
+/*
+ * Input pair of the zero-copy mode (--zero-copy): buffers created with
+ * CL_MEM_ALLOC_HOST_PTR and their mapped pointers, where the loader decodes.
+ * Each pair has its own size, it follows the size of the frames decoded in it.
+ */
+struct ZeroCopyBuffers {
+    unsigned int id; // buffer ids of the pair in the pool, id + BUFFER_LEFT and id + BUFFER_RIGHT
+    cl_mem left_memobj;
+    cl_mem right_memobj;
+    unsigned char* left;
+    unsigned char* right;
+    unsigned int width;
+    unsigned int height;
+};
+
+/*
+ * Output stage on the device (--device-normalize) of the map in disp_memobj,
+ * after wait_event (NULL for the commands already in the queue): the maximum
+ * of the map in max_memobj, unless the range is fixed, and the 8-bit map in
+ * norm_memobj. events gets the fill, max (NULL with a fixed range) and
+ * normalize commands, returns the last one.
+ */
+static cl_event enqueueNormalize(OpenCLDevice& device, cl_mem disp_memobj, cl_mem max_memobj, cl_mem norm_memobj,
+                                 cl_event wait_event, cl_event* events)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+
+    events[0] = openCL.enqueueFillBufferAsync<cl_uint>(max_memobj, 0, 1, (wait_event != NULL) ? 1 : 0, (wait_event != NULL) ? &wait_event : NULL);
+    events[1] = NULL;
+    if (!fixed_range)
+    {
+        openCL.setKernelArgs(device.max_kernel, disp_memobj, 0);
+        openCL.setKernelArgs(device.max_kernel, max_memobj, 1);
+        events[1] = openCL.enqueueKernelAsync(device.max_kernel, 1, &events[0]);
+    }
+
+    openCL.setKernelArgs(device.norm_kernel, disp_memobj, 0);
+    openCL.setKernelArgs(device.norm_kernel, max_memobj, 1);
+    openCL.setKernelArgs(device.norm_kernel, norm_memobj, 2);
+    events[2] = openCL.enqueueKernelAsync(device.norm_kernel, 1, fixed_range ? &events[0] : &events[1]);
+
+    return events[2];
+}
+
+/*
+ * Profile a finished command, and return its device time (ns) from the record
+ * of its completion callback with the OpenCL events, 0 otherwise
+ */
+static cl_ulong profileCommand(OpenCL_Interface& openCL, cl_event event, ProfileStage stage, unsigned int frame)
+{
+    if (!use_opencl_events)
+    {
+        openCL.profileEvent(event, stage, frame);
+        return 0;
+    }
+
+    int record = openCL.holdEvent(event, stage, frame);
+    cl_ulong elapsed = openCL.getRecordElapsedTime(record);
+    openCL.releaseRecord(record);
+
+    return elapsed;
+}
+
+/*
+ * Profile and release the commands of enqueueNormalize() once they are done.
+ * Returns their device time (ns) when the OpenCL events are used, 0 otherwise.
+ */
+static cl_ulong finishNormalize(OpenCLDevice& device, cl_event* events, unsigned int frame)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    cl_ulong elapsed = 0;
+
+    for (unsigned int k=0; k<3; k++)
+    {
+        if (events[k] == NULL)
+            continue;
+
+        elapsed += profileCommand(openCL, events[k], PROFILE_NORMALIZE, frame);
+        openCL.releaseEvent(events[k]);
+        events[k] = NULL;
+    }
+
+    return elapsed;
+}
+
+/*
+ * Synchronous frame with the output stage on the device (--device-normalize):
+ * the map stays in the device and only its 8-bit version is read into norm.
+ * Returns the device time of the output stage (ns) with the OpenCL events.
+ */
+static cl_ulong runNormalized(OpenCLDevice& device, unsigned char* norm, size_t size)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    cl_event events[3];
+
+    openCL.enqueueRun();
+    enqueueNormalize(device, device.disp_memobj, device.max_memobj, device.norm_memobj, NULL, events);
+    openCL.enqueueReadBuffer(device.norm_memobj, norm, size, CL_TRUE);
+
+    return finishNormalize(device, events, Profiler::getFrame());
+}
+
+/*
+ * Enqueue the upload, kernels and readback of a frame without waiting: each
+ * command waits on the event of the previous one, so the queues overlap the
+ * upload of this frame with the kernel of the previous one.
+ */
+static void submitFrame(OpenCLDevice& device, InFlightFrame& slot, const StereoFrame& frame, size_t size)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    cl_kernel census_kernel = device.census_kernel;
+
+    slot.frame = frame;
+    slot.write_left = openCL.enqueueWriteBufferAsync(slot.left_memobj, slot.frame.left.data, size);
+    slot.write_right = openCL.enqueueWriteBufferAsync(slot.right_memobj, slot.frame.right.data, size);
+    cl_event writes[] = {slot.write_left, slot.write_right};
+
+    // the kernel arguments are taken when the kernel is enqueued, so every slot sets its own buffers
+    if (census_kernel != NULL)
+    {
+        openCL.setKernelArgs(census_kernel, slot.left_memobj, 0);
+        openCL.setKernelArgs(census_kernel, slot.right_memobj, 1);
+        openCL.setKernelArgs(census_kernel, slot.census_left_memobj, 2);
+        openCL.setKernelArgs(census_kernel, slot.census_right_memobj, 3);
+        slot.census = openCL.enqueueKernelAsync(census_kernel, 2, writes);
+
+        openCL.setKernelArgs(slot.census_left_memobj, 0);
+        openCL.setKernelArgs(slot.census_right_memobj, 1);
+        openCL.setKernelArgs(slot.disp_memobj, 2);
+        slot.ndr = openCL.enqueueKernelAsync(NULL, 1, &slot.census);
+    }
+    else
+    {
+        openCL.setKernelArgs(slot.left_memobj, 0);
+        openCL.setKernelArgs(slot.right_memobj, 1);
+        openCL.setKernelArgs(slot.disp_memobj, 2);
+        slot.census = NULL;
+        slot.ndr = openCL.enqueueKernelAsync(NULL, 2, writes);
+    }
+
+    if (device_normalize)
+    {
+        cl_event last = enqueueNormalize(device, slot.disp_memobj, slot.max_memobj, slot.norm_memobj, slot.ndr, slot.normalize);
+        slot.read = openCL.enqueueReadBufferAsync(slot.norm_memobj, slot.norm_image, size, last);
+    }
+    else
+        slot.read = openCL.enqueueReadBufferAsync(slot.disp_memobj, slot.disp_image, size, slot.ndr);
+    openCL.flush();
+    slot.busy = true;
+    device.busy++;
+}
+
+/*
+ * Wait for the readback of a frame and release its events. Returns the device
+ * time of its kernels (ns) when the OpenCL events are used, 0 otherwise.
+ */
+static cl_ulong retireFrame(OpenCLDevice& device, InFlightFrame& slot)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    cl_ulong elapsed = 0;
+
+    openCL.waitForEvent(slot.read);
+
+    openCL.profileEvent(slot.write_left, PROFILE_WRITE, slot.frame.index);
+    openCL.profileEvent(slot.write_right, PROFILE_WRITE, slot.frame.index);
+    if (slot.census != NULL)
+        elapsed += profileCommand(openCL, slot.census, PROFILE_KERNEL, slot.frame.index);
+    elapsed += profileCommand(openCL, slot.ndr, PROFILE_KERNEL, slot.frame.index);
+    openCL.profileEvent(slot.read, PROFILE_READ, slot.frame.index);
+    elapsed += finishNormalize(device, slot.normalize, slot.frame.index);
+
+    openCL.releaseEvent(slot.write_left);
+    openCL.releaseEvent(slot.write_right);
+    if (slot.census != NULL)
+        openCL.releaseEvent(slot.census);
+    openCL.releaseEvent(slot.ndr);
+    openCL.releaseEvent(slot.read);
+
+    slot.frame = StereoFrame();
+    slot.busy = false;
+    device.busy--;
+    device.frames++;
+
+    return elapsed;
+}
+
+/*
+ * Co-scheduled frame (--coschedule): the device computes the bottom rows of
+ * the map while the C++ engine computes the top ones. The device gets its
+ * rows plus the half_kernel rows above them (the halo of its first windows)
+ * as an image of their height, and its map is read back at the split row.
+ * host_time and device_time (ms) are the wall time of each side from the
+ * enqueue of the device commands, for the next split.
+ */
+static void coscheduleFrame(OpenCLDevice& device, BM_Disparity& disparity, unsigned int split,
+                            const unsigned char* left, const unsigned char* right, unsigned int* disp,
+                            unsigned int width, unsigned int height, double& host_time, double& device_time)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    unsigned int half = kernel_size/2;
+    unsigned int first = split - half;
+    unsigned int sub_height = height - first;
+    unsigned int device_rows = height - half - split;
+
+    // the kernels see an image of sub_height rows, and the NDRange covers them
+    openCL.setKernelArgs(sub_height, 5);
+    if (device.census_kernel != NULL)
+        openCL.setKernelArgs(device.census_kernel, sub_height, 5);
+    #ifndef FPGA_OCL
+    global_item_size[1] = ((sub_height + local_item_size[1] - 1)/local_item_size[1])*local_item_size[1];
+    #endif
+
+    cl_event writes[2];
+    cl_event census = NULL;
+    cl_event ndr;
+    high_resolution_clock::time_point t1 = high_resolution_clock::now();
+    writes[0] = openCL.enqueueWriteBufferAsync(device.left_memobj, left + first*width, sub_height*width);
+    writes[1] = openCL.enqueueWriteBufferAsync(device.right_memobj, right + first*width, sub_height*width);
+    if (device.census_kernel != NULL)
+    {
+        census = openCL.enqueueKernelAsync(device.census_kernel, 2, writes);
+        ndr = openCL.enqueueKernelAsync(NULL, 1, &census);
+    }
+    else
+        ndr = openCL.enqueueKernelAsync(NULL, 2, writes);
+    cl_event read = openCL.enqueueReadBufferAsync(device.disp_memobj, disp + split*width, device_rows*width, ndr, half*width);
+    openCL.flush();
+
+    // the records of the first and last commands give the device time when their callbacks run
+    unsigned int frame = Profiler::getFrame();
+    int first_record = openCL.holdEvent(writes[0], PROFILE_WRITE, frame);
+    int last_record = openCL.holdEvent(read, PROFILE_READ, frame);
+
+    // meanwhile the host computes its rows (the windows of the last ones read the first device rows of the images)
+    {
+        ProfileScope compute(PROFILE_KERNEL);
+        disparity.computeRows(left, right, disp, 0, split);
+    }
+    host_time = duration_cast<microseconds>(high_resolution_clock::now() - t1).count()*1e-3;
+
+    openCL.waitForEvent(read);
+
+    // the border columns of the rows read back are zeros of the pool (cleared when created), the bottom rows are not read
+    memset(disp + (height - half)*width, 0, half*width*sizeof(unsigned int));
+
+    // from the enqueue of the upload to the end of the readback, without the wait of the host after its rows
+    device_time = openCL.getRecordInterval(first_record, last_record)*1e-6;
+    openCL.releaseRecord(first_record);
+    openCL.releaseRecord(last_record);
+
+    openCL.profileEvent(writes[1], PROFILE_WRITE, frame);
+    if (census != NULL)
+        openCL.profileEvent(census, PROFILE_KERNEL, frame);
+    openCL.profileEvent(ndr, PROFILE_KERNEL, frame);
+
+    openCL.releaseEvent(writes[0]);
+    openCL.releaseEvent(writes[1]);
+    if (census != NULL)
+        openCL.releaseEvent(census);
+    openCL.releaseEvent(ndr);
+    openCL.releaseEvent(read);
+}
+
+// Ids of the OpenCL buffers in the pool: the buffers of frame slot k are k*BUFFERS_PER_SLOT + BUFFER_*
+enum {
+    BUFFER_LEFT,
+    BUFFER_RIGHT,
+    BUFFER_DISP,
+    BUFFER_CENSUS_LEFT,
+    BUFFER_CENSUS_RIGHT,
+    BUFFER_NORM,
+    BUFFER_MAX,
+    BUFFERS_PER_SLOT
+};
+
+static cl_mem_flags inputFlags()
+{
+    #ifdef FPGA_OCL
+    return CL_MEM_ALLOC_HOST_PTR;
+    #else
+    return zero_copy ? (CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR) : CL_MEM_READ_ONLY;
+    #endif
+}
+
+static cl_mem_flags outputFlags()
+{
+    #ifdef FPGA_OCL
+    return CL_MEM_ALLOC_HOST_PTR;
+    #else
+    return zero_copy ? (CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR) : CL_MEM_WRITE_ONLY;
+    #endif
+}
+
+// Build options of the GPU kernels: window, disparity range and row pitch are constants of the program
+static std::string buildOptions(unsigned int width)
+{
+    char options[128];
+    sprintf(options, "-DKERNEL=%u -DMAX_D=%u -DWIDTH=%u", kernel_size, max_d, width);
+    if (local_kernel)
+        sprintf(options + strlen(options), " -DTILE_W=%zu -DTILE_H=%zu", local_item_size[0], local_item_size[1]);
+    if (device_normalize)
+        sprintf(options + strlen(options), " -DDISP_TYPE=%s", (max_d > 256) ? "ushort" : "uchar");
+
+    return options;
+}
+
+// The row kernel of the CPU devices keeps a row of costs in private memory, up to ROW_KERNEL_MAX_WIDTH pixels
+static void checkRowKernelWidth(bool row_kernel, unsigned int width)
+{
+    if (row_kernel && (width > ROW_KERNEL_MAX_WIDTH))
+    {
+        printf("[ERROR] Images of %u pixels wide, the OpenCL row kernel of the CPU devices takes up to %u\n", width, ROW_KERNEL_MAX_WIDTH);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Bytes of a disparity of the device maps: unsigned int, or DISP_TYPE when they are normalized on the device
+static size_t dispElementSize()
+{
+    if (!device_normalize)
+        return sizeof(unsigned int);
+
+    return (max_d > 256) ? sizeof(unsigned short) : sizeof(unsigned char);
+}
+
+// Local memory of a work-group of BM_Disparity_Local: the strips of the tile and its halo, the right one max_d - 1 columns wider
+static size_t localKernelBytes()
+{
+    size_t half = kernel_size/2;
+    size_t strip_height = local_item_size[1] + 2*half;
+    size_t left_width = local_item_size[0] + 2*half;
+
+    return strip_height*(left_width + left_width + max_d - 1);
+}
+
+/*
+ * Size the OpenCL side for images of width x height: the buffers of every
+ * frame slot (the pool only reallocates them when the size changed), the
+ * kernel arguments of the synchronous path and the NDRange, padded to the
+ * work-group size. The FPGA kernels are compiled for their NDRange.
+ */
+static void setupOpenCLBuffers(OpenCLDevice& device, unsigned int width, unsigned int height)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    BufferPool& pool = *device.pool;
+    size_t size = (size_t) width*height;
+
+    #ifndef FPGA_OCL
+    // the variant of the program for this width (kept, so a resolution seen before does not rebuild)
+    checkRowKernelWidth(openCL.isRowKernel(), width);
+    openCL.selectProgram(buildOptions(width));
+    #endif
+
+    // the descriptors stay in the device, BM_Census reads them instead of the images
+    if (cost == BM_COST_CENSUS)
+    {
+        if (device.census_kernel != NULL)
+            openCL.freeKernel(device.census_kernel);
+        device.census_kernel = openCL.createKernel("Census_Transform");
+    }
+
+    // output stage of --device-normalize, appended to the program of the main kernel
+    if (device_normalize)
+    {
+        if (device.max_kernel != NULL)
+            openCL.freeKernel(device.max_kernel);
+        if (device.norm_kernel != NULL)
+            openCL.freeKernel(device.norm_kernel);
+        device.max_kernel = openCL.createKernel("Disparity_Max");
+        device.norm_kernel = openCL.createKernel("Disparity_Normalize");
+
+        openCL.setKernelArgs(device.max_kernel, max_d, 2);
+        openCL.setKernelArgs(device.max_kernel, width, 3);
+        openCL.setKernelArgs(device.max_kernel, height, 4);
+        openCL.setKernelArgs(device.norm_kernel, fixed_range ? max_d - 1 : 0, 3);
+        openCL.setKernelArgs(device.norm_kernel, width, 4);
+        openCL.setKernelArgs(device.norm_kernel, height, 5);
+    }
+
+    for (unsigned int k=0; k<std::max<size_t>(device.slots.size(), 1); k++)
+    {
+        unsigned int id = k*BUFFERS_PER_SLOT;
+        cl_mem left = pool.get(id + BUFFER_LEFT, size, inputFlags());
+        cl_mem right = pool.get(id + BUFFER_RIGHT, size, inputFlags());
+        cl_mem census_left = NULL;
+        cl_mem census_right = NULL;
+        if (device.census_kernel != NULL)
+        {
+            census_left = pool.get(id + BUFFER_CENSUS_LEFT, size*sizeof(cl_ulong), CL_MEM_READ_WRITE);
+            census_right = pool.get(id + BUFFER_CENSUS_RIGHT, size*sizeof(cl_ulong), CL_MEM_READ_WRITE);
+        }
+
+        // with --device-normalize the map stays in the device, the 8-bit one is the output. The kernels do not write
+        // its half_kernel border, zeros as in the maps of the C++ engines
+        cl_mem disp = pool.get(id + BUFFER_DISP, size*dispElementSize(), device_normalize ? CL_MEM_READ_WRITE : outputFlags(), true);
+        cl_mem norm = NULL;
+        cl_mem max = NULL;
+        if (device_normalize)
+        {
+            norm = pool.get(id + BUFFER_NORM, size, outputFlags());
+            max = pool.get(id + BUFFER_MAX, sizeof(cl_uint), CL_MEM_READ_WRITE);
+        }
+
+        if (k == 0)
+        {
+            device.left_memobj = left;
+            device.right_memobj = right;
+            device.disp_memobj = disp;
+            device.census_left_memobj = census_left;
+            device.census_right_memobj = census_right;
+            device.norm_memobj = norm;
+            device.max_memobj = max;
+        }
+
+        if (k < device.slots.size())
+        {
+            InFlightFrame& slot = device.slots[k];
+            slot.left_memobj = left;
+            slot.right_memobj = right;
+            slot.disp_memobj = disp;
+            slot.census_left_memobj = census_left;
+            slot.census_right_memobj = census_right;
+            slot.norm_memobj = norm;
+            slot.max_memobj = max;
+            delete[] slot.disp_image;
+            delete[] slot.norm_image;
+            slot.disp_image = device_normalize ? NULL : new unsigned int[size];
+            slot.norm_image = device_normalize ? new unsigned char[size] : NULL;
+        }
+    }
+
+    if (device.census_kernel != NULL)
+    {
+        openCL.setKernelArgs(device.census_kernel, device.left_memobj, 0);
+        openCL.setKernelArgs(device.census_kernel, device.right_memobj, 1);
+        openCL.setKernelArgs(device.census_kernel, device.census_left_memobj, 2);
+        openCL.setKernelArgs(device.census_kernel, device.census_right_memobj, 3);
+        openCL.setKernelArgs(device.census_kernel, width, 4);
+        openCL.setKernelArgs(device.census_kernel, height, 5);
+
+        openCL.setKernelArgs(device.census_left_memobj, 0);
+        openCL.setKernelArgs(device.census_right_memobj, 1);
+    }
+    else
+    {
+        openCL.setKernelArgs(device.left_memobj, 0);
+        openCL.setKernelArgs(device.right_memobj, 1);
+    }
+    openCL.setKernelArgs(device.disp_memobj, 2);
+    openCL.setKernelArgs(max_d, 3);
+
+    #ifndef FPGA_OCL
+    openCL.setKernelArgs(width, 4);
+    openCL.setKernelArgs(height, 5);
+
+    global_item_size[0] = ((width + local_item_size[0] - 1)/local_item_size[0])*local_item_size[0];
+    global_item_size[1] = ((height + local_item_size[1] - 1)/local_item_size[1])*local_item_size[1];
+    #endif
+}
+
+/*
+ * Map a pair of the zero-copy mode for images of width x height. A mapped
+ * pair is unmapped first, so the pool can reallocate its buffers when the
+ * size changed.
+ */
+static void mapZeroCopyPair(OpenCLDevice& device, ZeroCopyBuffers& pair, unsigned int width, unsigned int height)
+{
+    OpenCL_Interface& openCL = *device.openCL;
+    size_t size = (size_t) width*height;
+
+    if (pair.left != NULL)
+    {
+        openCL.unmapBuffer(pair.left_memobj, pair.left);
+        openCL.unmapBuffer(pair.right_memobj, pair.right);
+    }
+
+    pair.left_memobj = device.pool->get(pair.id + BUFFER_LEFT, size, inputFlags());
+    pair.right_memobj = device.pool->get(pair.id + BUFFER_RIGHT, size, inputFlags());
+    pair.left = openCL.mapBuffer<unsigned char>(pair.left_memobj, size, CL_MAP_WRITE);
+    pair.right = openCL.mapBuffer<unsigned char>(pair.right_memobj, size, CL_MAP_WRITE);
+    pair.width = width;
+    pair.height = height;
+}
+
+/*
+ * Device of the next frame of the pipelined mode: an idle device (nothing in
+ * flight or all of it done) if there is one, otherwise the one with fewer
+ * frames in flight. -1 when every slot is busy.
+ */
+static int selectDevice(std::vector<OpenCLDevice>& devices)
+{
+    int selected = -1;
+
+    for (unsigned int d=0; d<devices.size(); d++)
+    {
+        OpenCLDevice& device = devices[d];
+        if (device.busy >= device.slots.size())
+            continue;
+
+        bool idle = true;
+        for (unsigned int k=0; k<device.slots.size() && idle; k++)
+            idle = !device.slots[k].busy || device.openCL->isEventComplete(device.slots[k].read);
+        if (idle)
+            return (int) d;
+
+        if ( (selected < 0) || (device.busy < devices[selected].busy) )
+            selected = (int) d;
+    }
+
+    return selected;
+}
+
+/*
+ * Output of a disparity map: queued to the writer with --output, and shown
+ * unless --headless (HighGUI is never called then).
+ */
+static void outputDisparity(DisparityWriter* writer, const char* window, const std::string& name,
+                            unsigned char* norm, const unsigned int* disp, unsigned int width, unsigned int height, int delay)
+{
+    ProfileScope output(PROFILE_OUTPUT);
+
+    if (writer != NULL)
+        writer->push(name, norm, disp, width, height);
+
+    if (!headless)
+    {
+        Mat disp_image(height, width, CV_8UC1, norm); // uint8 to Mat
+        imshow(window, disp_image);
+        waitKey(delay);
+    }
+}
 
 void helper()
 {
     //cout << "Usage: disparity <LeftImage_Path> <RightImage_Path> [-max-d <value>] [-k <value>] [--use-opencl]" << endl;
-    cout << "Usage: disparity <path_images> [-max-d <value>] [-k <value>] [--use-opencl] [--kernel-info] [--use-events] [--opencl-vs-cpp]" << endl;
+    cout << "Usage: disparity <path_images> [-max-d <value>] [-k <value>] [--engine <naive|box|rolling>] [--cost <sad|census>] [--simd <scalar|sse4.1|avx2|avx512bw>] [--threads <value>] [--no-specialize] [--lr-check] [--lr-threshold <value>] [--fixed-range] [--device-normalize] [--prefetch <value>] [--decoders <value>] [--use-opencl] [--in-flight <value>] [--zero-copy] [--headless] [--output <dir>] [--output-format <u8|u16|pgm|png>] [--output-queue <value>] [--profile <trace.json>] [--profile-csv <file>] [--profile-events <value>] [--program-cache <dir>] [--no-program-cache] [--device <index,...>] [--all-devices] [--list-devices] [--no-local-kernel] [--kernel-info] [--use-events] [--opencl-vs-cpp] [--coschedule]" << endl;
 
     exit(EXIT_SUCCESS);
 }
@@ -90,8 +687,109 @@ void parseArg(int argc, char** argv)
                 kernel_size = (unsigned int) atoi(argv[++k]);
             else if (!strcmp(argv[k], "--max-d"))
                 max_d = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--engine"))
+            {
+                if (++k >= argc || !BM_Disparity::parseEngine(argv[k], engine))
+                {
+                    printf("[ERROR] Unrecognized engine = %s\n", (k < argc) ? argv[k] : "");
+                    helper();
+                }
+            }
+            else if (!strcmp(argv[k], "--cost"))
+            {
+                if (++k >= argc || !BM_Disparity::parseCost(argv[k], cost))
+                {
+                    printf("[ERROR] Unrecognized matching cost = %s\n", (k < argc) ? argv[k] : "");
+                    helper();
+                }
+            }
+            else if (!strcmp(argv[k], "--simd"))
+            {
+                if (++k >= argc || !SIMD_Dispatch::parseIsa(argv[k], simd_isa))
+                {
+                    printf("[ERROR] Unrecognized SIMD instruction set = %s\n", (k < argc) ? argv[k] : "");
+                    helper();
+                }
+            }
+            else if (!strcmp(argv[k], "--threads"))
+                num_threads = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--no-specialize"))
+                specialized = false;
+            else if (!strcmp(argv[k], "--lr-check"))
+                lr_check = true;
+            else if (!strcmp(argv[k], "--lr-threshold"))
+                lr_threshold = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--fixed-range"))
+                fixed_range = true;
+            else if (!strcmp(argv[k], "--device-normalize"))
+                device_normalize = true;
+            else if (!strcmp(argv[k], "--prefetch"))
+                prefetch = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--decoders"))
+                num_decoders = (unsigned int) atoi(argv[++k]);
             else if (!strcmp(argv[k], "--use-opencl"))
                 use_opencl = true;
+            else if (!strcmp(argv[k], "--in-flight"))
+                in_flight = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--zero-copy"))
+                zero_copy = true;
+            else if (!strcmp(argv[k], "--headless"))
+                headless = true;
+            else if (!strcmp(argv[k], "--output"))
+            {
+                if (++k >= argc)
+                    helper();
+                output_dir = argv[k];
+            }
+            else if (!strcmp(argv[k], "--output-format"))
+            {
+                if (++k >= argc || !DisparityWriter::parseFormat(argv[k], output_format))
+                {
+                    printf("[ERROR] Unrecognized output format = %s\n", (k < argc) ? argv[k] : "");
+                    helper();
+                }
+            }
+            else if (!strcmp(argv[k], "--output-queue"))
+                output_queue = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--profile"))
+            {
+                if (++k >= argc)
+                    helper();
+                profile_file = argv[k];
+            }
+            else if (!strcmp(argv[k], "--profile-csv"))
+            {
+                if (++k >= argc)
+                    helper();
+                profile_csv = argv[k];
+            }
+            else if (!strcmp(argv[k], "--profile-events"))
+                profile_events = (unsigned int) atoi(argv[++k]);
+            else if (!strcmp(argv[k], "--program-cache"))
+            {
+                if (++k >= argc)
+                    helper();
+                OpenCL_Interface::setProgramCache(argv[k]);
+            }
+            else if (!strcmp(argv[k], "--no-program-cache"))
+                OpenCL_Interface::setProgramCache("");
+            else if (!strcmp(argv[k], "--device"))
+            {
+                if (++k >= argc)
+                    helper();
+                // comma-separated indices of --list-devices
+                for (char* index = strtok(argv[k], ","); index != NULL; index = strtok(NULL, ","))
+                    device_ids.push_back(atoi(index));
+            }
+            else if (!strcmp(argv[k], "--all-devices"))
+                all_devices = true;
+            else if (!strcmp(argv[k], "--no-local-kernel"))
+                local_kernel = false;
+            else if (!strcmp(argv[k], "--list-devices"))
+            {
+                OpenCL_Interface::showDevices();
+                exit(EXIT_SUCCESS);
+            }
             else if (!strcmp(argv[k], "--kernel-info"))
                 kernel_info = true;
             else if (!strcmp(argv[k], "--use-events"))
@@ -101,6 +799,8 @@ void parseArg(int argc, char** argv)
                 opencl_vs_cpp = true;
                 use_opencl_events = true;
             }
+            else if (!strcmp(argv[k], "--coschedule"))
+                coschedule = true;
             else if (!(strcmp(argv[k], "-h")) || !(strcmp(argv[k], "--help")))
                 helper();
             else
@@ -116,12 +816,90 @@ void parseArg(int argc, char** argv)
             printf("Executing with C++ ...\n\n");
         }
 
+        if (in_flight == 0)
+            in_flight = 1;
+
+        if ( (in_flight > 1) && !use_opencl )
+            printf("[WARNING] Frames in flight are only used with --use-opencl\n");
+
+        if (zero_copy && !use_opencl)
+        {
+            zero_copy = false;
+            printf("[WARNING] Zero-copy buffers are only used with --use-opencl\n");
+        }
+
+        // the mapped buffers are shared with the device, there is no transfer to overlap
+        if (zero_copy && (in_flight > 1))
+        {
+            in_flight = 1;
+            printf("[WARNING] Zero-copy buffers use the synchronous OpenCL path, ignoring --in-flight\n");
+        }
+
         if (use_opencl && opencl_vs_cpp)
         {
             use_opencl = false;
             printf("[WARNING] You have indicated the 'Cpp vs OpenCL' method. Do not need to activate OpenCL with --use-opencl\n");
         }
 
+        #ifdef FPGA_OCL
+        if (coschedule)
+        {
+            coschedule = false;
+            printf("[WARNING] The FPGA kernels are compiled for whole frames, --coschedule is not available\n");
+        }
+        #endif
+
+        // every frame is split between C++ and OpenCL, the other modes are not used
+        if (coschedule && (use_opencl || opencl_vs_cpp))
+        {
+            use_opencl = false;
+            opencl_vs_cpp = false;
+            printf("[WARNING] --coschedule computes the frames on C++ and OpenCL, ignoring --use-opencl and --opencl-vs-cpp\n");
+        }
+
+        #ifdef FPGA_OCL
+        if (device_normalize)
+        {
+            device_normalize = false;
+            printf("[WARNING] The FPGA kernels write unsigned int maps, --device-normalize is not available\n");
+        }
+        #endif
+
+        if (device_normalize && !use_opencl && !opencl_vs_cpp)
+        {
+            device_normalize = false;
+            printf("[WARNING] --device-normalize is only used with --use-opencl or --opencl-vs-cpp\n");
+        }
+
+        // the raw16 files are the disparities, they are not read back
+        if (device_normalize && (output_dir != NULL) && (output_format == DISPARITY_FORMAT_RAW16))
+        {
+            device_normalize = false;
+            printf("[WARNING] The raw16 output needs the raw maps, ignoring --device-normalize\n");
+        }
+
+        if (coschedule && lr_check)
+        {
+            lr_check = false;
+            printf("[WARNING] The LR check is only done by the C++ engine, disabled with --coschedule\n");
+        }
+
+        // frames are distributed by the pipelined mode, the other paths run on one device
+        if ( (all_devices || (device_ids.size() > 1)) && (!use_opencl || zero_copy) )
+        {
+            all_devices = false;
+            device_ids.resize(std::min<size_t>(device_ids.size(), 1));
+            printf("[WARNING] Several OpenCL devices are only used by --use-opencl without --zero-copy, using one device\n");
+        }
+
+        #ifdef FPGA_OCL
+        if ( (cost == BM_COST_CENSUS) && (use_opencl || opencl_vs_cpp) )
+        {
+            cost = BM_COST_SAD;
+            printf("[WARNING] The FPGA kernels do not implement the census cost. Using SAD\n");
+        }
+        #endif
+
     } else {
         helper();
     }
@@ -132,13 +910,64 @@ int main(int argc, char** argv)
     const char *dir_images = argv[1];
     parseArg(argc, argv);
 
-    // @TODO Automaticate this assignment
-    unsigned int width = 640;
-    unsigned int height = 480;
+    OpenCL_Interface::setNDRange(dim_item_size, global_item_size, local_item_size);
+
+    // before the decoder threads start, they record too
+    if ( (profile_file != NULL) || (profile_csv != NULL) )
+        Profiler::enable(profile_events);
+
+    if (SIMD_Dispatch::select(simd_isa) != simd_isa)
+        printf("[WARNING] SIMD instruction set '%s' not supported by this CPU\n", SIMD_Dispatch::getIsaName(simd_isa));
+
+    const char *left_dir = "left";
+    const char *right_dir = "right";
+    char dir_left_images[PATH_MAX];
+    char dir_right_images[PATH_MAX];
+
+    sprintf(dir_left_images, "%s/%s", dir_images, left_dir); // Left Images
+    sprintf(dir_right_images, "%s/%s", dir_images, right_dir); // Right Images
+
+    File imageFiles(dir_left_images);
+    std::vector<std::string> list_files = imageFiles.getListFiles();
+    //imageFiles.showListFiles(list_files);
+
+    if (list_files.empty())
+    {
+        cerr << "[ERROR] No images in " << dir_left_images << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // The size of the dataset is the one of its first frame, a frame of another size resizes the OpenCL side
+    Mat first_image = imread(std::string(dir_left_images) + "/" + list_files[0], IMREAD_GRAYSCALE);
+    if (!first_image.data)
+    {
+        cerr << "[ERROR] No image data" << endl;
+        exit(EXIT_FAILURE);
+    }
+    unsigned int width = (unsigned int) first_image.cols;
+    unsigned int height = (unsigned int) first_image.rows;
+    first_image.release();
 
     cout << "-------- INFO -------- " << endl;
     cout << "> Max Disparity: " << max_d << endl;
     cout << "> Kernel Size: " << kernel_size << endl;
+    cout << "> Matching Cost: " << BM_Disparity::getCostName(cost) << endl;
+    cout << "> C++ Engine: " << BM_Disparity::getEngineName(engine) << endl;
+    cout << "> SIMD: " << SIMD_Dispatch::getIsaName(SIMD_Dispatch::getIsa()) << endl;
+    if (lr_check)
+        cout << "> LR Check Threshold (C++): " << lr_threshold << endl;
+    cout << "> Normalization: " << (fixed_range ? "fixed range" : "frame range") << endl;
+    if (device_normalize)
+        cout << "> OpenCL Normalization: device (" << dispElementSize()*8 << "-bit maps, 8-bit readback)" << endl;
+    if (output_dir != NULL)
+        cout << "> Output: " << output_dir << " (" << DisparityWriter::getFormatName(output_format) << ", queue " << output_queue << ")" << endl;
+    if (headless)
+        cout << "> Headless: yes" << endl;
+    if (coschedule)
+        cout << "> Co-scheduling: C++ and OpenCL" << endl;
+    if (Profiler::isEnabled())
+        cout << "> Profile: " << (profile_file ? profile_file : "") << (profile_file && profile_csv ? ", " : "")
+             << (profile_csv ? profile_csv : "") << " (" << profile_events << " events)" << endl;
     cout << "> Width: " << width << endl;
     cout << "> Height: " << height << endl;
     cout << "---------------------- " << endl;
@@ -150,57 +979,201 @@ int main(int argc, char** argv)
     unsigned int *disp_image_uint8_ocl = new unsigned int[width * height];
     unsigned char *disp_image_uint8_ocl_norm = new unsigned char[width * height];
 
-    // Create OpenCL Interface
-    OpenCL_Interface openCL;
+    // 8-bit output stage of the OpenCL maps, same table as the C++ engine
+    DisparityNormalizer normalizer(max_d);
+    normalizer.setFixedRange(fixed_range);
+
+    // OpenCL devices of the frame loop, by index of getDevices() (-1 the default one)
+    std::vector<int> ids = device_ids;
+    if (all_devices)
+    {
+        ids.clear();
+        for (unsigned int k=0; k<OpenCL_Interface::getDevices().size(); k++)
+            ids.push_back((int) k);
+    }
+    if (ids.empty())
+        ids.push_back(-1);
+
+    #ifndef FPGA_OCL
+    if (cost == BM_COST_CENSUS)
+    {
+        // the census kernels also run on the CPU devices, the row kernel is SAD
+        local_kernel = false;
+        OpenCL_Interface::setKernelSource("./kernel/BM_Census-GPU.cl", "BM_Census");
+        OpenCL_Interface::setCpuKernelSource("", "");
+    }
+    else if (local_kernel && (use_opencl || opencl_vs_cpp || coschedule))
+    {
+        // the GPUs run the same program, so the tiled kernel needs the strips to fit in all of them (the CPUs run the row kernel)
+        std::vector<OpenCL_Device> all = OpenCL_Interface::getDevices();
+        for (unsigned int d=0; d<ids.size(); d++)
+        {
+            int index = (ids[d] < 0) ? OpenCL_Interface::getDefaultDevice(all) : ids[d];
+            if ( (index < (int) all.size()) && !(all[index].type & CL_DEVICE_TYPE_CPU) && (all[index].local_mem_size < localKernelBytes()) )
+                local_kernel = false;
+        }
+
+        if (local_kernel)
+            OpenCL_Interface::setKernelSource("./kernel/BM_Disparity_Local-GPU.cl", "BM_Disparity_Local");
+        cout << "> OpenCL Kernel: " << (local_kernel ? "local memory tiles (" : "global memory (tiles need ")
+             << localKernelBytes() << " bytes per work-group)" << endl;
+    }
+    // the output stage is built in the same program, so it reads the map of the main kernel in the device
+    if (device_normalize)
+        OpenCL_Interface::addKernelSource("./kernel/Disparity_Normalize-GPU.cl");
+    OpenCL_Interface::setBuildOptions(buildOptions(width));
+
+    // the interfaces build the program for this width when they are created
+    if (use_opencl || opencl_vs_cpp || coschedule)
+    {
+        std::vector<OpenCL_Device> all = OpenCL_Interface::getDevices();
+        for (unsigned int d=0; d<ids.size(); d++)
+        {
+            int index = (ids[d] < 0) ? OpenCL_Interface::getDefaultDevice(all) : ids[d];
+            if (index < (int) all.size())
+                checkRowKernelWidth(OpenCL_Interface::usesRowKernel(all[index]), width);
+        }
+    }
+    #endif
+
+    // OpenCL devices of the frame loop, the synchronous paths use the first one
+    std::vector<OpenCLDevice> devices;
+    unsigned int ocl_width = width;
+    unsigned int ocl_height = height;
     
-    if (use_opencl || opencl_vs_cpp)
+    if (use_opencl || opencl_vs_cpp || coschedule)
     {
-        openCL.m_use_opencl_events = use_opencl_events;
+        OpenCL_Interface::m_use_opencl_events = use_opencl_events;
+
+        devices.resize(ids.size());
+        for (unsigned int d=0; d<devices.size(); d++)
+        {
+            // Create OpenCL Interface
+            OpenCLDevice& device = devices[d];
+            device.openCL = new OpenCL_Interface(ids[d]);
+            device.pool = new BufferPool(*device.openCL);
+            device.census_kernel = NULL;
+            device.max_kernel = NULL;
+            device.norm_kernel = NULL;
+            device.busy = 0;
+            device.frames = 0;
 
-        if (kernel_info)
-            openCL.showInfo();
+            if (kernel_info)
+                device.openCL->showInfo();
 
-        #ifdef FPGA_OCL
-        openCL.setMemoryBuffer<unsigned char>(left_memobj, width*height, CL_MEM_ALLOC_HOST_PTR);
-        openCL.setMemoryBuffer<unsigned char>(right_memobj, width*height, CL_MEM_ALLOC_HOST_PTR);
-        openCL.setMemoryBuffer<unsigned int>(disp_memobj, width*height, CL_MEM_ALLOC_HOST_PTR);
-        #else
-        openCL.setMemoryBuffer<unsigned char>(left_memobj, width*height, CL_MEM_READ_ONLY);
-        openCL.setMemoryBuffer<unsigned char>(right_memobj, width*height, CL_MEM_READ_ONLY);
-        openCL.setMemoryBuffer<unsigned int>(disp_memobj, width*height, CL_MEM_WRITE_ONLY);
-        #endif
+            // the device intervals of the trace are moved to the host clock
+            if (Profiler::isEnabled())
+                Profiler::setDeviceClock(device.openCL->getDeviceTimestamp(), Profiler::now(), device.openCL->getDeviceIndex());
+
+            // Pipelined mode: one set of buffers per frame in flight, the first one is the set of the synchronous path
+            if (use_opencl && ((in_flight > 1) || (ids.size() > 1)))
+            {
+                device.slots.resize(in_flight);
+                for (unsigned int k=0; k<in_flight; k++)
+                {
+                    device.slots[k].busy = false;
+                    device.slots[k].disp_image = NULL;
+                    device.slots[k].norm_image = NULL;
+                    for (unsigned int e=0; e<3; e++)
+                        device.slots[k].normalize[e] = NULL;
+                }
+            }
 
-        openCL.setKernelArgs(left_memobj, 0);
-        openCL.setKernelArgs(right_memobj, 1);
-        openCL.setKernelArgs(disp_memobj, 2);
-        openCL.setKernelArgs(max_d, 3);
+            setupOpenCLBuffers(device, width, height);
+        }
+
+        if (!devices[0].slots.empty())
+            cout << "> OpenCL Frames in Flight: " << in_flight << (devices.size() > 1 ? " per device" : "") << endl;
+        cout << "> OpenCL NDRange: " << global_item_size[0] << "x" << global_item_size[1] << endl;
     }
+    // frames in flight of the pipelined mode (device, slot), in submission order
+    std::deque<std::pair<unsigned int, unsigned int> > pending;
+    high_resolution_clock::time_point t_last_frame = high_resolution_clock::now();
+    unsigned int pipeline_frames = 0;
+    cl_ulong pipeline_kernel_time = 0;
 
-    const char *left_dir = "left";
-    const char *right_dir = "right";
-    char dir_left_images[PATH_MAX];
-    char dir_right_images[PATH_MAX];
-    char left_image_file[PATH_MAX];
-    char right_image_file[PATH_MAX];
+    // Maps are encoded and written by a background thread, the frame loop only copies them
+    if (output_dir != NULL)
+        writer = new DisparityWriter(output_dir, output_format, output_queue);
 
-    sprintf(dir_left_images, "%s/%s", dir_images, left_dir); // Left Images
-    sprintf(dir_right_images, "%s/%s", dir_images, right_dir); // Right Images
+    // Decoders read the pairs ahead of the frame loop, so the compute does not wait on disk or PNG decode
+    ImageLoader loader(dir_left_images, dir_right_images, list_files, prefetch, num_decoders,
+                       zero_copy ? width : 0, zero_copy ? height : 0);
 
-    File imageFiles(dir_left_images);
-    std::vector<std::string> list_files = imageFiles.getListFiles();
-    //imageFiles.showListFiles(list_files);
+    // Zero-copy mode: the decoders write into mapped input buffers, one pair per queued frame plus the one being computed
+    std::vector<ZeroCopyBuffers> zero_copy_buffers;
+    if (zero_copy)
+    {
+        zero_copy_buffers.resize(loader.getQueueSize() + 1);
+        for (unsigned int k=0; k<zero_copy_buffers.size(); k++)
+        {
+            // after the buffers of the frame slots, so a new resolution (setupOpenCLBuffers()) does not reallocate a mapped pair
+            ZeroCopyBuffers& pair = zero_copy_buffers[k];
+            pair.id = (in_flight + k)*BUFFERS_PER_SLOT;
+            pair.left = NULL;
+            pair.right = NULL;
+            mapZeroCopyPair(devices[0], pair, width, height);
+            loader.addHostBuffer(k, pair.left, pair.right, pair.width, pair.height);
+        }
+        cout << "> OpenCL Zero-Copy Buffers: " << zero_copy_buffers.size() << endl;
+    }
+    StereoFrame frame;
+    unsigned long queue_depth_sum = 0;
+    unsigned long num_frames = 0;
+
+    // Retire the oldest frame in flight and output its map, returns the time of its kernels (ns) with events
+    auto finishInFlight = [&](unsigned int width, unsigned int height) -> cl_ulong
+    {
+        OpenCLDevice& device = devices[pending.front().first];
+        InFlightFrame& slot = device.slots[pending.front().second];
+        pending.pop_front();
+
+        std::string name = slot.frame.name;
+        unsigned int frame_index = Profiler::getFrame();
+        Profiler::setFrame(slot.frame.index);
+        cl_ulong elapsed = retireFrame(device, slot);
+
+        // the map read back is the 8-bit one with --device-normalize
+        if (device_normalize)
+            outputDisparity(writer, ocl_window, name, slot.norm_image, NULL, width, height, 1);
+        else
+        {
+            {
+                ProfileScope normalize(PROFILE_NORMALIZE);
+                normalizer.normalize(slot.disp_image, disp_image_uint8_ocl_norm, width*height);
+            }
+            outputDisparity(writer, ocl_window, name, disp_image_uint8_ocl_norm, slot.disp_image, width, height, 1);
+        }
+
+        Profiler::setFrame(frame_index);
+        return elapsed;
+    };
     
+    // C++ engine and its output buffers, kept between frames so its thread pool and workspace are created only once
+    BM_Disparity* disparity = NULL;
+    unsigned int disparity_width = 0;
+    unsigned int disparity_height = 0;
+    unsigned char* disp_image_uint8_norm = NULL;
+    unsigned int* disp_image_raw = NULL;
+    unsigned char* out_diff = NULL;
+    unsigned long disparity_allocations = 0;
+
+    // rows of the co-scheduled frames on each side, from the time per row of the last frames
+    CoScheduler scheduler;
+
     int time_elapsed = 0;
-    for(int i=0; i< (int) list_files.size(); ++i)
+    while (loader.next(frame))
     {
-        sprintf(left_image_file, "%s/%s", dir_left_images, list_files[i].c_str()); // Left Image
-        sprintf(right_image_file, "%s/%s", dir_right_images, list_files[i].c_str()); // Right Image
+        // pairs already decoded when this one was taken
+        queue_depth_sum += loader.getQueueDepth();
+        num_frames++;
+        Profiler::setFrame(frame.index);
 
         // @TODO Try to avoid OpenCV for read images and show them
-        Mat left_image = imread(left_image_file, IMREAD_GRAYSCALE); // grayscale Left image
-        Mat right_image = imread(right_image_file, IMREAD_GRAYSCALE); // grayscale Right image
+        Mat& left_image = frame.left; // grayscale Left image
+        Mat& right_image = frame.right; // grayscale Right image
 
-        if (!left_image.data && !right_image.data)
+        if (!left_image.data || !right_image.data)
         {
             cerr << "[ERROR] No image data" << endl;
             exit(EXIT_FAILURE);
@@ -211,34 +1184,227 @@ int main(int argc, char** argv)
 
         unsigned int width = (unsigned int) left_image.cols;
         unsigned int height = (unsigned int) left_image.rows;
+
+        if ((use_opencl || opencl_vs_cpp || coschedule) && ((width != ocl_width) || (height != ocl_height)))
+        {
+            // the frames in flight were computed with the old size
+            while (!pending.empty())
+                finishInFlight(ocl_width, ocl_height);
+
+            for (unsigned int d=0; d<devices.size(); d++)
+                setupOpenCLBuffers(devices[d], width, height);
+            delete[] disp_image_uint8_ocl;
+            delete[] disp_image_uint8_ocl_norm;
+            disp_image_uint8_ocl = new unsigned int[width * height];
+            disp_image_uint8_ocl_norm = new unsigned char[width * height];
+            ocl_width = width;
+            ocl_height = height;
+            cout << "> OpenCL Resolution: " << width << "x" << height << ", NDRange: " << global_item_size[0] << "x" << global_item_size[1] << endl;
+        }
+
+        if (!use_opencl && ((disparity == NULL) || (disparity_width != width) || (disparity_height != height)))
+        {
+            delete disparity;
+            delete[] disp_image_uint8_norm;
+            delete[] disp_image_raw;
+            delete[] out_diff;
+            disparity = new BM_Disparity(width, height, max_d, kernel_size);
+            disparity->setEngine(engine);
+            disparity->setCost(cost);
+            disparity->setNumThreads(num_threads);
+            disparity->setSpecialized(specialized);
+            disparity->setLRCheck(lr_check, lr_threshold);
+            disparity->setFixedRange(fixed_range);
+            disp_image_uint8_norm = new unsigned char[width*height];
+            disp_image_raw = ((writer != NULL) && writer->needsRaw()) ? new unsigned int[width*height] : NULL;
+            out_diff = new unsigned char[width*height];
+            disparity_width = width;
+            disparity_height = height;
+            disparity_allocations = BM_Disparity::getAllocationCount();
+            cout << "> C++ Threads: " << disparity->getNumThreads() << endl;
+            cout << "> C++ Working Set per Thread: " << disparity->getWorkingSetBytes()/1024 << " KiB" << endl;
+            if (engine == BM_ENGINE_NAIVE)
+                cout << "> C++ Specialized (k=" << kernel_size << ", max-d=" << max_d << "): " << (disparity->isSpecialized() ? "yes" : "no (generic)") << endl;
+        }
         
-        unsigned char *left_image_uint8 = matToUint8(left_image);
-        unsigned char *right_image_uint8 = matToUint8(right_image);
-        //left_image_uint8 = matToUint8(left_image);
-        //right_image_uint8 = matToUint8(right_image);
+        // imread gives continuous grayscale images, their data is used without a copy
+        unsigned char *left_image_uint8 = left_image.data;
+        unsigned char *right_image_uint8 = right_image.data;
         
         //printf("Pointer Left %p\n", left_image_uint8);
         //printf("Pointer Right %p\n", right_image_uint8);
 
-        if (use_opencl)
+        if (use_opencl && !devices[0].slots.empty())
         {
+            // maps leave in submission order: the frames done at the head of the queue, then the oldest until a slot is free
+            while (!pending.empty())
+            {
+                OpenCLDevice& oldest = devices[pending.front().first];
+                if (!oldest.openCL->isEventComplete(oldest.slots[pending.front().second].read))
+                    break;
+
+                pipeline_kernel_time += finishInFlight(width, height);
+                pipeline_frames++;
+            }
+
+            int selected;
+            while ((selected = selectDevice(devices)) < 0)
+            {
+                pipeline_kernel_time += finishInFlight(width, height);
+                pipeline_frames++;
+            }
+
+            OpenCLDevice& device = devices[selected];
+            unsigned int k = 0;
+            while (device.slots[k].busy)
+                k++;
+
+            submitFrame(device, device.slots[k], frame, width*height);
+            pending.push_back(std::make_pair((unsigned int) selected, k));
+
+            // in steady state the frame period is max(transfer, compute) instead of their sum
+            high_resolution_clock::time_point t_now = high_resolution_clock::now();
+            double period = duration_cast<microseconds>(t_now - t_last_frame).count()*1e-3;
+            if ( (pipeline_frames > 0) && (period >= 500) )
+            {
+                cout << "Time (ms): " << period/pipeline_frames << "  FPS: " << pipeline_frames/period*1e3;
+                if (use_opencl_events)
+                    cout << "  Kernel (ms): " << pipeline_kernel_time*1e-6/pipeline_frames;
+                cout << endl;
+
+                t_last_frame = t_now;
+                pipeline_frames = 0;
+                pipeline_kernel_time = 0;
+            }
+        }
+        else if (use_opencl && zero_copy)
+        {
+            OpenCLDevice& device = devices[0];
+            OpenCL_Interface& openCL = *device.openCL;
+            ZeroCopyBuffers& pair = zero_copy_buffers[frame.buffer];
+
+            high_resolution_clock::time_point t1_ocl = high_resolution_clock::now();
+
+            // a pair of another size than its buffers was decoded into images of its own: the buffers take the new size
+            // and this pair is copied into them, the next pairs of this size are decoded in place
+            if ( (left_image.data != pair.left) || (right_image.data != pair.right) )
+            {
+                ProfileScope copy(PROFILE_HOST_COPY);
+                mapZeroCopyPair(device, pair, width, height);
+                memcpy(pair.left, left_image.data, width*height);
+                memcpy(pair.right, right_image.data, width*height);
+            }
+
+            // the pair was decoded in the mapped memory, the device takes it without a write
+            {
+                ProfileScope copy(PROFILE_HOST_COPY);
+                openCL.unmapBuffer(pair.left_memobj, pair.left);
+                openCL.unmapBuffer(pair.right_memobj, pair.right);
+            }
+            if (device.census_kernel != NULL)
+            {
+                openCL.setKernelArgs(device.census_kernel, pair.left_memobj, 0);
+                openCL.setKernelArgs(device.census_kernel, pair.right_memobj, 1);
+                openCL.enqueueKernel(device.census_kernel);
+            }
+            else
+            {
+                openCL.setKernelArgs(pair.left_memobj, 0);
+                openCL.setKernelArgs(pair.right_memobj, 1);
+            }
+            openCL.enqueueRun();
+
+            // nor a read: the map waits for the kernel and the normalization reads the device buffer
+            unsigned int* disp_mapped = NULL;
+            unsigned char* norm_mapped = NULL;
+            cl_ulong normalize_time = 0;
+            {
+                ProfileScope read(PROFILE_READ);
+                if (device_normalize)
+                {
+                    cl_event normalize[3];
+                    enqueueNormalize(device, device.disp_memobj, device.max_memobj, device.norm_memobj, NULL, normalize);
+                    norm_mapped = openCL.mapBuffer<unsigned char>(device.norm_memobj, width*height, CL_MAP_READ);
+                    normalize_time = finishNormalize(device, normalize, Profiler::getFrame());
+                }
+                else
+                    disp_mapped = openCL.mapBuffer<unsigned int>(device.disp_memobj, width*height, CL_MAP_READ);
+            }
+            high_resolution_clock::time_point t2_ocl = high_resolution_clock::now();
+            cl_ulong device_time = openCL.getTotalElapsedTime() + normalize_time;
+
+            if (use_opencl_events)
+                time_elapsed += device_time*1e-6;
+            else
+                time_elapsed += duration_cast<milliseconds>(t2_ocl - t1_ocl).count();
+
+            if (time_elapsed >= 500)
+            {
+                if (use_opencl_events)
+                    cout << "Time (ms): " << device_time*1e-6 << "  FPS: " << (1.0/device_time)*1e9 << endl;
+                else{
+                    auto duration_ocl = duration_cast<milliseconds>(t2_ocl - t1_ocl).count();
+                    cout << "Time (ms): " << duration_ocl << "  FPS: " << (1.0/duration_ocl)*1e3 << endl;
+                }
+
+                time_elapsed = 0;
+            }
+
+            if (!device_normalize)
+            {
+                ProfileScope normalize(PROFILE_NORMALIZE);
+                normalizer.normalize(disp_mapped, disp_image_uint8_ocl_norm, width*height);
+            }
+
+            // map the pair again and give it back to the decoders
+            {
+                ProfileScope copy(PROFILE_HOST_COPY);
+                pair.left = openCL.mapBuffer<unsigned char>(pair.left_memobj, width*height, CL_MAP_WRITE);
+                pair.right = openCL.mapBuffer<unsigned char>(pair.right_memobj, width*height, CL_MAP_WRITE);
+            }
+            loader.addHostBuffer(frame.buffer, pair.left, pair.right, pair.width, pair.height);
+
+            if (device_normalize)
+            {
+                outputDisparity(writer, ocl_window, frame.name, norm_mapped, NULL, width, height, 1);
+                openCL.unmapBuffer(device.norm_memobj, norm_mapped);
+            }
+            else
+            {
+                outputDisparity(writer, ocl_window, frame.name, disp_image_uint8_ocl_norm, disp_mapped, width, height, 1);
+                openCL.unmapBuffer(device.disp_memobj, disp_mapped);
+            }
+        }
+        else if (use_opencl)
+        {
+            OpenCLDevice& device = devices[0];
+            OpenCL_Interface& openCL = *device.openCL;
+
             /* For each interation */
             high_resolution_clock::time_point t1_ocl = high_resolution_clock::now();
-            openCL.enqueueWriteBuffer(left_memobj, left_image_uint8, width*height, CL_TRUE);
-            openCL.enqueueWriteBuffer(right_memobj, right_image_uint8, width*height, CL_TRUE);
+            openCL.enqueueWriteBuffer(device.left_memobj, left_image_uint8, width*height, CL_TRUE);
+            openCL.enqueueWriteBuffer(device.right_memobj, right_image_uint8, width*height, CL_TRUE);
+            if (device.census_kernel != NULL)
+                openCL.enqueueKernel(device.census_kernel);
 
-            openCL.run(disp_memobj, disp_image_uint8_ocl, width*height, CL_TRUE);
+            // with --device-normalize the 8-bit map is read back, width*height bytes
+            cl_ulong normalize_time = 0;
+            if (device_normalize)
+                normalize_time = runNormalized(device, disp_image_uint8_ocl_norm, width*height);
+            else
+                openCL.run(device.disp_memobj, disp_image_uint8_ocl, width*height, CL_TRUE);
             high_resolution_clock::time_point t2_ocl = high_resolution_clock::now();
+            cl_ulong device_time = openCL.getTotalElapsedTime() + normalize_time;
             
             if (use_opencl_events)
-                time_elapsed += openCL.getTotalElapsedTime()*1e-6;
+                time_elapsed += device_time*1e-6;
             else
                 time_elapsed += duration_cast<milliseconds>(t2_ocl - t1_ocl).count();
             
             if (time_elapsed >= 500)
             {
                 if (use_opencl_events)
-                    cout << "Time (ms): " << openCL.getTotalElapsedTime()*1e-6 << "  FPS: " << (1.0/openCL.getTotalElapsedTime())*1e9 << endl;
+                    cout << "Time (ms): " << device_time*1e-6 << "  FPS: " << (1.0/device_time)*1e9 << endl;
                 else{
                     auto duration_ocl = duration_cast<milliseconds>(t2_ocl - t1_ocl).count();
                     cout << "Time (ms): " << duration_ocl << "  FPS: " << (1.0/duration_ocl)*1e3 << endl;
@@ -248,63 +1414,78 @@ int main(int argc, char** argv)
             }
 
             // Norm for OCL
-            int max_value = 0;
-            int min_value = disp_image_uint8_ocl[0];
-            for (int k = 0; k < (width * height); k++)
+            if (!device_normalize)
             {
-                if (min_value > disp_image_uint8_ocl[k])
-                    min_value = disp_image_uint8_ocl[k];
-
-                if (disp_image_uint8_ocl[k] > max_value)
-                    max_value = disp_image_uint8_ocl[k];
+                ProfileScope normalize(PROFILE_NORMALIZE);
+                normalizer.normalize(disp_image_uint8_ocl, disp_image_uint8_ocl_norm, width*height);
             }
 
-            for (int k = 0; k < (width * height); k++)
-                disp_image_uint8_ocl_norm[k] = static_cast<unsigned char>(disp_image_uint8_ocl[k] * 255 / max_value);
+            outputDisparity(writer, ocl_window, frame.name, disp_image_uint8_ocl_norm, device_normalize ? NULL : disp_image_uint8_ocl, width, height, 1);
+        }
+        else if (coschedule)
+        {
+            unsigned int half = kernel_size/2;
+            unsigned int split = scheduler.getSplitRow(height, half);
+            double host_time = 0;
+            double device_time = 0;
+
+            high_resolution_clock::time_point t1_co = high_resolution_clock::now();
+            if (split + half < height)
+                coscheduleFrame(devices[0], *disparity, split, left_image_uint8, right_image_uint8, disp_image_uint8_ocl, width, height, host_time, device_time);
+            else
+                disparity->computeRows(left_image_uint8, right_image_uint8, disp_image_uint8_ocl, 0, height);
+            high_resolution_clock::time_point t2_co = high_resolution_clock::now();
 
-            //cout << "Max - Min Disparity (OCL) := " << max_value << " - " << min_value;
-            //cout << " Done!\n" << endl;
+            unsigned int host_rows = (split > half) ? (split - half) : 0;
+            unsigned int device_rows = (split + half < height) ? (height - half - split) : 0;
+            scheduler.update(host_rows, host_time, device_rows, device_time);
 
-            Mat disp_image_ocl(height, width, CV_8UC1, disp_image_uint8_ocl_norm); // uint8 to Mat
+            time_elapsed += duration_cast<milliseconds>(t2_co - t1_co).count();
+            if (time_elapsed >= 500)
+            {
+                auto duration_co = duration_cast<milliseconds>(t2_co - t1_co).count();
+                cout << "Time (ms): " << duration_co << "  FPS: " << (1.0/duration_co)*1e3
+                     << "  C++ rows: " << host_rows << " (" << host_time << " ms)  OpenCL rows: " << device_rows << " (" << device_time << " ms)" << endl;
 
-            #ifdef FPGA_OCL
-            imshow("Image OpenCL_FPGA", disp_image_ocl);
-            #else
-            imshow("Image OpenCL_GPU", disp_image_ocl);
-            #endif
-            waitKey(1);
+                time_elapsed = 0;
+            }
+
+            {
+                ProfileScope normalize(PROFILE_NORMALIZE);
+                normalizer.normalize(disp_image_uint8_ocl, disp_image_uint8_ocl_norm, width*height);
+            }
+
+            outputDisparity(writer, "Image C++ + OpenCL", frame.name, disp_image_uint8_ocl_norm, disp_image_uint8_ocl, width, height, 1);
         }
         else if (opencl_vs_cpp)
         {
+            OpenCLDevice& device = devices[0];
+            OpenCL_Interface& openCL = *device.openCL;
+
             // Turn for OpenCL
             cout << "\nComputing BM Disparity Map OpenCL ..." << endl;
-            openCL.enqueueWriteBuffer(left_memobj, left_image_uint8, width*height, CL_TRUE);
-            openCL.enqueueWriteBuffer(right_memobj, right_image_uint8, width*height, CL_TRUE);
+            openCL.enqueueWriteBuffer(device.left_memobj, left_image_uint8, width*height, CL_TRUE);
+            openCL.enqueueWriteBuffer(device.right_memobj, right_image_uint8, width*height, CL_TRUE);
+            if (device.census_kernel != NULL)
+                openCL.enqueueKernel(device.census_kernel);
 
-            openCL.run(disp_memobj, disp_image_uint8_ocl, width*height, CL_TRUE);
+            cl_ulong normalize_time = 0;
+            if (device_normalize)
+                normalize_time = runNormalized(device, disp_image_uint8_ocl_norm, width*height);
+            else
+                openCL.run(device.disp_memobj, disp_image_uint8_ocl, width*height, CL_TRUE);
+            cl_ulong device_time = openCL.getTotalElapsedTime() + normalize_time;
 
-            cout << "Time (ms): " << openCL.getTotalElapsedTime()*1e-6 << "  FPS: " << (1.0/openCL.getTotalElapsedTime())*1e9 << endl;
+            cout << "Time (ms): " << device_time*1e-6 << "  FPS: " << (1.0/device_time)*1e9 << endl;
 
             // Norm for OCL
-            int max_value = 0;
-            int min_value = disp_image_uint8_ocl[0];
-            for (int k = 0; k < (width * height); k++)
-            {
-                if (min_value > disp_image_uint8_ocl[k])
-                    min_value = disp_image_uint8_ocl[k];
-
-                if (disp_image_uint8_ocl[k] > max_value)
-                    max_value = disp_image_uint8_ocl[k];
-            }
-
-            for (int k = 0; k < (width * height); k++)
-                disp_image_uint8_ocl_norm[k] = static_cast<unsigned char>(disp_image_uint8_ocl[k] * 255 / max_value);
+            if (!device_normalize)
+                normalizer.normalize(disp_image_uint8_ocl, disp_image_uint8_ocl_norm, width*height);
 
             // Turn for C++
-            BM_Disparity disparity(width, height, max_d, kernel_size);
             cout << "\nComputing BM Disparity Map C++ ..." << endl;
             high_resolution_clock::time_point t1_cpp = high_resolution_clock::now();
-            unsigned char* disp_image_uint8_norm = disparity.computeBM_Dispartity(left_image_uint8, right_image_uint8);
+            disparity->compute(left_image_uint8, right_image_uint8, NULL, disp_image_uint8_norm);
             high_resolution_clock::time_point t2_cpp = high_resolution_clock::now();
 
             auto duration_cpp = duration_cast<milliseconds>(t2_cpp - t1_cpp).count();
@@ -313,7 +1494,6 @@ int main(int argc, char** argv)
             //Mat disp_image_ocl(height, width, CV_8UC1, disp_image_uint8_ocl_norm); // uint8 to Mat
             //Mat disp_image_cpp(height, width, CV_8UC1, disp_image_uint8_norm); // uint8 to Mat
 
-            unsigned char *out_diff = new unsigned char[width*height];
             int out = 0;
             for (int k=0; k<width*height; k++)
             {
@@ -327,28 +1507,31 @@ int main(int argc, char** argv)
 
             Mat disp_frame_diff(height, width, CV_8UC1, out_diff); // uint8 to Mat*/
 
+            if (writer != NULL)
+                writer->push(frame.name, disp_image_uint8_ocl_norm, device_normalize ? NULL : disp_image_uint8_ocl, width, height);
+
             //imshow("BM Disparity OpenCL", disp_image_ocl);
             //imshow("BM Disparity C++", disp_image_cpp);
-            imshow("Diff Image", disp_frame_diff);
-            waitKey(10);
+            if (!headless)
+            {
+                imshow("Diff Image", disp_frame_diff);
+                waitKey(10);
+            }
         }
         else{
             // C++ computation
-            //BM_Disparity disparity(width, height);
-            BM_Disparity disparity(width, height, max_d, kernel_size);
-
             high_resolution_clock::time_point t1_cpp = high_resolution_clock::now();
-            unsigned char* disp_image_uint8_norm = disparity.computeBM_Dispartity(left_image_uint8, right_image_uint8);
+            {
+                ProfileScope compute(PROFILE_KERNEL);
+                disparity->compute(left_image_uint8, right_image_uint8, disp_image_raw, disp_image_uint8_norm);
+            }
             high_resolution_clock::time_point t2_cpp = high_resolution_clock::now();
 
             auto duration_c = duration_cast<milliseconds>(t2_cpp - t1_cpp).count();
             cout << "C++ Time (ms): " << duration_c << "  FPS: " << (1.0/duration_c)*1e3 << endl;
 
-            Mat disp_image_cpp(height, width, CV_8UC1, disp_image_uint8_norm); // uint8 to Mat
-
             //imwrite("output/DisparityImage_"+image_name+".png", disp_image);
-            imshow("Image C++", disp_image_cpp);
-            waitKey(10);
+            outputDisparity(writer, "Image C++", frame.name, disp_image_uint8_norm, disp_image_raw, width, height, 10);
         }
 
         //imwrite(("output/LeftImage_"+image_name+".png").c_str(), left_image);
@@ -356,28 +1539,102 @@ int main(int argc, char** argv)
         //imwrite("output/FrameDifference.png", disp_frame_diff);
         //imwrite("output/DisparityOCL_"+image_name+".png", disp_image_ocl);
 
-        /*auto duration_c = duration_cast<milliseconds>( t2_c - t1_c ).count();
-        auto duration_ocl = duration_cast<milliseconds>( t2_ocl_RB - t1_ocl ).count();
-        auto duration_ocl_WB = duration_cast<milliseconds>( t2_ocl_WB - t1_ocl ).count();
-        auto duration_ocl_NDRK = duration_cast<microseconds>( t2_ocl_NDRK - t1_ocl_NDRK ).count();
-        auto duration_ocl_RB = duration_cast<milliseconds>( t2_ocl_RB - t1_ocl_RB ).count();
+    }
+
+    // frames still in flight, in submission order
+    while (!pending.empty())
+        finishInFlight(ocl_width, ocl_height);
+
+    if (num_frames > 0)
+        printf("> Loader: queue %u, decoders %u, mean queue depth %.2f, stalls %lu (%.1f ms)\n", loader.getQueueSize(), num_decoders,
+               (double) queue_depth_sum/num_frames, loader.getStalls(), loader.getStallTime());
+
+    if (writer != NULL)
+    {
+        writer->flush();
+        printf("> Writer: %lu maps (%s), queue %u, stalls %lu (%.1f ms)\n", writer->getWritten(),
+               DisparityWriter::getFormatName(output_format), output_queue, writer->getStalls(), writer->getStallTime());
+        delete writer;
+    }
 
-        cout << "\n/ ----------- Time Summary ----------- /" << endl;
-        cout << "C++ Time (ms): " << duration_c << endl;
-        cout << "OpenCL Time (ms): " << duration_ocl << endl;
-        cout << "  - OpenCL Time Write Buffer (ms): " << duration_ocl_WB << endl;
-        cout << "  - OpenCL Time NDRKernel (us): " << duration_ocl_NDRK << endl;
-        cout << "  - OpenCL Time Read Buffer (ms): " << duration_ocl_RB << endl;
-        cout << "/ ------------------------------------ /\n" << endl;*/
+    // the device intervals and times are recorded by the callbacks of the events, off the frame loop
+    for (unsigned int d=0; d<devices.size(); d++)
+    {
+        OpenCL_Interface& openCL = *devices[d].openCL;
+        openCL.waitForCallbacks();
+        if (!use_opencl_events)
+            continue;
 
+        printf("> OpenCL Events (device %u):", openCL.getDeviceIndex());
+        for (unsigned int s=0; s<PROFILE_STAGES; s++)
+        {
+            ProfileStage stage = (ProfileStage) s;
+            if (openCL.getStageCount(stage) > 0)
+                printf(" %s %.3f ms x %lu", Profiler::getStageName(stage), openCL.getStageTime(stage)*1e-6/openCL.getStageCount(stage),
+                       openCL.getStageCount(stage));
+        }
+        printf("\n");
     }
 
-    if (use_opencl)
+    // every pair was decoded and every map queued, so nothing records anymore
+    if (Profiler::isEnabled())
     {
-        openCL.freeOpenCLMemory(left_memobj);
-        openCL.freeOpenCLMemory(right_memobj);
-        openCL.freeOpenCLMemory(disp_memobj);
+        Profiler::showSummary();
+        if ( (profile_file != NULL) && !Profiler::writeChromeTrace(profile_file) )
+            printf("[ERROR] Failed to write the profile %s\n", profile_file);
+        if ( (profile_csv != NULL) && !Profiler::writeCsv(profile_csv) )
+            printf("[ERROR] Failed to write the profile %s\n", profile_csv);
     }
 
+    if ((disparity != NULL) && (BM_Disparity::getAllocationCount() != disparity_allocations))
+        printf("[WARNING] BM_Disparity allocated %lu workspace buffers while computing frames\n",
+               BM_Disparity::getAllocationCount() - disparity_allocations);
+
+    delete disparity;
+    delete[] disp_image_uint8_norm;
+    delete[] disp_image_raw;
+    delete[] out_diff;
+
+    // the pool releases the buffers, mapped ones are unmapped first
+    for (unsigned int k=0; k<zero_copy_buffers.size(); k++)
+    {
+        devices[0].openCL->unmapBuffer(zero_copy_buffers[k].left_memobj, zero_copy_buffers[k].left);
+        devices[0].openCL->unmapBuffer(zero_copy_buffers[k].right_memobj, zero_copy_buffers[k].right);
+    }
+
+    delete[] disp_image_uint8_ocl;
+    delete[] disp_image_uint8_ocl_norm;
+
+    unsigned long buffer_allocations = 0;
+    size_t buffer_bytes = 0;
+    for (unsigned int d=0; d<devices.size(); d++)
+    {
+        OpenCLDevice& device = devices[d];
+        if (devices.size() > 1)
+            printf("> OpenCL Device %u (%s): %lu frames\n", device.openCL->getDeviceIndex(), device.openCL->getDeviceName().c_str(), device.frames);
+
+        for (unsigned int k=0; k<device.slots.size(); k++)
+        {
+            delete[] device.slots[k].disp_image;
+            delete[] device.slots[k].norm_image;
+        }
+
+        if (device.census_kernel != NULL)
+            device.openCL->freeKernel(device.census_kernel);
+        if (device.max_kernel != NULL)
+            device.openCL->freeKernel(device.max_kernel);
+        if (device.norm_kernel != NULL)
+            device.openCL->freeKernel(device.norm_kernel);
+
+        // the buffers are released before their context
+        buffer_allocations += device.pool->getAllocations();
+        buffer_bytes += device.pool->getBytes();
+        delete device.pool;
+        delete device.openCL;
+    }
+
+    if (use_opencl || opencl_vs_cpp || coschedule)
+        printf("> OpenCL Buffers: %lu allocations, %.1f MiB\n", buffer_allocations, buffer_bytes/(1024.0*1024.0));
+
     return 0;
-}
\ No newline at end of file
+}